@@ -4,7 +4,7 @@
 #
 #-------------------------------------------------
 
-QT       += core gui printsupport
+QT       += core gui printsupport concurrent
 
 greaterThan(QT_MAJOR_VERSION, 4): QT += widgets
 
@@ -25,15 +25,65 @@ DEFINES += QT_DEPRECATED_WARNINGS
 CONFIG += c++11
 
 SOURCES += \
+        bandrenderer.cpp \
+        batchrenderer.cpp \
+        blendkernels.cpp \
+        brushengine.cpp \
+        cursorcache.cpp \
+        dabkernels.cpp \
+        dabmaskcache.cpp \
         ebruapplication.cpp \
+        imagesaver.cpp \
+        latencymeter.cpp \
+        layerstack.cpp \
         main.cpp \
         mainwindow.cpp \
-        scribblearea.cpp
+        marblingbath.cpp \
+        marblingoperators.cpp \
+        mippyramid.cpp \
+        profiler.cpp \
+        profileroverlay.cpp \
+        projectfile.cpp \
+        scribblearea.cpp \
+        strokelog.cpp \
+        strokepredictor.cpp \
+        strokerasterizer.cpp \
+        strokereplayer.cpp \
+        tiffbandwriter.cpp \
+        tiledsurface.cpp \
+        undohistory.cpp
 
 HEADERS += \
+        bandrenderer.h \
+        batchrenderer.h \
+        blendkernels.h \
+        brushengine.h \
+        cursorcache.h \
+        dabkernels.h \
+        dabmaskcache.h \
         ebruapplication.h \
+        imagesaver.h \
+        latencymeter.h \
+        layerstack.h \
         mainwindow.h \
-        scribblearea.h
+        marblingbath.h \
+        marblingoperators.h \
+        mippyramid.h \
+        parallelbands.h \
+        pixelmath.h \
+        profiler.h \
+        profileroverlay.h \
+        projectfile.h \
+        samplequeue.h \
+        scribblearea.h \
+        strokelog.h \
+        strokepredictor.h \
+        strokerasterizer.h \
+        strokereplayer.h \
+        strokesample.h \
+        tiffbandwriter.h \
+        tiledsurface.h \
+        undohistory.h
 
 FORMS += \
         mainwindow.ui
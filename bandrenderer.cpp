@@ -0,0 +1,116 @@
+#include <QPainter>
+#include <QQueue>
+#include <QThreadPool>
+#include <QTransform>
+#include <QVector>
+#include <QtConcurrent>
+
+#include <cstring>
+
+#include "bandrenderer.h"
+
+BandRenderer::BandRenderer(const LayerStack &layers, const QSize &outputSize, const QColor &background)
+	: layers(layers)
+	, size(outputSize)
+	, background(background)
+	, bandHeight(DefaultBandHeight)
+	, maxInFlight(QThreadPool::globalInstance()->maxThreadCount() + 1)
+{
+}
+
+bool BandRenderer::render(const std::function<bool(const QImage &band, int top)> &consume) const
+{
+	if (size.isEmpty() || layers.size().isEmpty())
+		return true;
+
+	struct Band
+	{
+			QImage buffer;
+			int rows;
+			QFuture<void> rendered;
+	};
+
+	const QImage::Format format = QImage::Format_ARGB32_Premultiplied;
+	int width = size.width();
+	int bands = (size.height() + bandHeight - 1) / bandHeight;
+	QQueue<Band> inFlight;
+	QVector<QImage> spare;
+	int next = 0;
+	bool completed = true;
+	for (int band = 0; completed && band < bands; ++band) {
+		// Keep the pool busy with the bands coming up next, in the
+		// buffers of the bands already consumed when there are some
+		while (next < bands && inFlight.size() < maxInFlight) {
+			Band pending;
+			pending.buffer = spare.isEmpty()
+					 ? QImage(width, qMin(bandHeight, size.height()), format)
+					 : spare.takeLast();
+			if (pending.buffer.isNull()) {
+				completed = false;
+				break;
+			}
+			int top = next * bandHeight;
+			pending.rows = qMin(bandHeight, size.height() - top);
+			uchar *bits = pending.buffer.bits();
+			int bytesPerLine = pending.buffer.bytesPerLine();
+			int rows = pending.rows;
+			// The last band only uses the top of its buffer
+			pending.rendered = QtConcurrent::run([this, bits, width, rows, bytesPerLine, format, top]() {
+				QImage view(bits, width, rows, bytesPerLine, format);
+				renderBand(view, top);
+			});
+			inFlight.enqueue(pending);
+			++next;
+		}
+		if (!completed)
+			break;
+
+		Band done = inFlight.dequeue();
+		done.rendered.waitForFinished();
+		const QImage view(done.buffer.constBits(), width, done.rows, done.buffer.bytesPerLine(), format);
+		if (!consume(view, band * bandHeight))
+			completed = false;
+		spare.append(done.buffer);
+	}
+
+	// The bands still rendering use this renderer and their buffers
+	for (Band &band : inFlight)
+		band.rendered.waitForFinished();
+	return completed;
+}
+
+QImage BandRenderer::toImage(const std::function<void(int rows)> &progress) const
+{
+	if (!fitsInImage())
+		return QImage();
+	QImage image(size, QImage::Format_ARGB32_Premultiplied);
+	if (image.isNull())
+		return image;
+
+	bool rendered = render([&image, &progress](const QImage &band, int top) {
+		for (int y = 0; y < band.height(); ++y)
+			memcpy(image.scanLine(top + y), band.constScanLine(y), size_t(band.bytesPerLine()));
+		if (progress)
+			progress(top + band.height());
+		return true;
+	});
+	return rendered ? image : QImage();
+}
+
+// The part of the canvas under the band is scaled into it. Whole
+// multiples are left unfiltered so the pixels stay sharp
+void BandRenderer::renderBand(QImage &band, int top) const
+{
+	int rows = band.height();
+	band.fill(background);
+
+	qreal sx = qreal(size.width()) / layers.size().width();
+	qreal sy = qreal(size.height()) / layers.size().height();
+	QRect source = QRectF(0, top / sy, layers.size().width(), rows / sy).toAlignedRect()
+		       & QRect(QPoint(0, 0), layers.size());
+
+	QPainter painter(&band);
+	painter.setRenderHint(QPainter::SmoothPixmapTransform, sx != qRound(sx) || sy != qRound(sy));
+	painter.setTransform(QTransform(sx, 0, 0, sy, 0, -top));
+	layers.flatten(painter, source);
+}
@@ -0,0 +1,72 @@
+#ifndef BANDRENDERER_H
+#define BANDRENDERER_H
+
+#include <QColor>
+#include <QImage>
+#include <QSize>
+
+#include <functional>
+
+#include "layerstack.h"
+
+// Renders the layers scaled to any output size as horizontal bands,
+// so printing and exporting at a high resolution never needs the
+// whole output in memory. Bands are filled on the global thread pool
+// while the caller takes them strictly from the top down, at most
+// maxBandsInFlight of them exist at any time.
+//
+// The layers are read from the pool threads, pass a snapshot when
+// they may be painted on meanwhile
+class BandRenderer
+{
+	public:
+
+		enum { DefaultBandHeight = 256 };
+
+		BandRenderer(const LayerStack &layers, const QSize &outputSize,
+			     const QColor &background = Qt::transparent);
+
+		QSize outputSize() const { return size; }
+
+		void setBandHeight(int rows) { bandHeight = qMax(1, rows); }
+		int getBandHeight() const { return bandHeight; }
+
+		// Defaults to one more than the threads in the pool so that the
+		// caller has a band to work on while every thread renders. This
+		// many band buffers are allocated and reused for the whole output
+		void setMaxBandsInFlight(int count) { maxInFlight = qMax(1, count); }
+		int maxBandsInFlight() const { return maxInFlight; }
+
+		// Calls consume(band, top) for every band in order on the
+		// calling thread. Stops early and returns false if consume does
+		// or a band could not be allocated. The pixels of band are
+		// rendered over once consume returns, copy them to keep them
+		bool render(const std::function<bool(const QImage &band, int top)> &consume) const;
+
+		// The whole output in a single image, for writers that can't
+		// take it a band at a time. Null when it doesn't fit in memory
+		// or is larger than fitsInImage() allows. progress is told how
+		// many rows are done after every band
+		QImage toImage(const std::function<void(int rows)> &progress = nullptr) const;
+
+		// Memory toImage() takes, and whether that is little enough for
+		// it to try. Larger outputs have to be written a band at a time
+		qint64 imageBytes() const { return qint64(size.width()) * size.height() * 4; }
+		bool fitsInImage() const { return imageBytes() <= MaxImageBytes; }
+
+	private:
+
+		// A gigabyte, a quarter of the 32 bit limit of QImage
+		static const qint64 MaxImageBytes = qint64(1) << 30;
+
+		// Fills band with the rows of the output from top on
+		void renderBand(QImage &band, int top) const;
+
+		const LayerStack &layers;
+		QSize size;
+		QColor background;
+		int bandHeight;
+		int maxInFlight;
+};
+
+#endif // BANDRENDERER_H
@@ -0,0 +1,302 @@
+#include <QAtomicInt>
+#include <QCommandLineParser>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QFileInfo>
+#include <QImageWriter>
+#include <QReadWriteLock>
+#include <QRegularExpression>
+#include <QSet>
+#include <QTextStream>
+#include <QThread>
+#include <QThreadPool>
+
+#include <cstring>
+
+#include "bandrenderer.h"
+#include "batchrenderer.h"
+#include "layerstack.h"
+#include "marblingoperators.h"
+#include "strokelog.h"
+#include "strokereplayer.h"
+#include "tiffbandwriter.h"
+#include "tiledsurface.h"
+
+BatchRenderer::BatchRenderer()
+	: maxJobs(QThread::idealThreadCount())
+	, imageMemory(ImageMemoryMegabytes)
+{
+}
+
+bool BatchRenderer::isRequested(int argc, char *argv[])
+{
+	for (int i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "--render") == 0 || strncmp(argv[i], "--render=", 9) == 0)
+			return true;
+	}
+	return false;
+}
+
+bool BatchRenderer::isScript(const QString &fileName)
+{
+	return QFileInfo(fileName).suffix().compare("marbling", Qt::CaseInsensitive) == 0;
+}
+
+// WIDTHxHEIGHT, or a single number for a square
+bool BatchRenderer::parseSize(const QString &text, QSize *size)
+{
+	QStringList parts = text.split('x');
+	if (parts.size() == 1)
+		parts.append(parts.first());
+	if (parts.size() != 2)
+		return false;
+	bool widthOk, heightOk;
+	*size = QSize(parts.at(0).toInt(&widthOk), parts.at(1).toInt(&heightOk));
+	return widthOk && heightOk && !size->isEmpty();
+}
+
+bool BatchRenderer::parse(const QStringList &arguments, QString *error)
+{
+	QCommandLineParser parser;
+	QCommandLineOption renderOption("render", QObject::tr("Stroke log or marbling script to render."),
+					QObject::tr("file"));
+	QCommandLineOption sizeOption("size", QObject::tr("Size of the images, the canvas size by default."),
+				      QObject::tr("widthxheight"));
+	QCommandLineOption outOption("out", QObject::tr("Image to write, or the directory for several."),
+				     QObject::tr("path"));
+	QCommandLineOption jobsOption("jobs", QObject::tr("Inputs rendered at once, one per core by default."),
+				      QObject::tr("count"));
+	parser.addOptions({ renderOption, sizeOption, outOption, jobsOption });
+	parser.addPositionalArgument("inputs", QObject::tr("More files to render."), "[inputs...]");
+	if (!parser.parse(arguments)) {
+		*error = parser.errorText();
+		return false;
+	}
+
+	QStringList inputs = parser.values(renderOption) + parser.positionalArguments();
+	if (inputs.isEmpty()) {
+		*error = QObject::tr("Nothing to render");
+		return false;
+	}
+	if (parser.isSet(sizeOption) && !parseSize(parser.value(sizeOption), &outputSize)) {
+		*error = QObject::tr("Can't read the size \"%1\"").arg(parser.value(sizeOption));
+		return false;
+	}
+	if (parser.isSet(jobsOption)) {
+		bool ok;
+		maxJobs = parser.value(jobsOption).toInt(&ok);
+		if (!ok || maxJobs < 1) {
+			*error = QObject::tr("Can't read the job count \"%1\"").arg(parser.value(jobsOption));
+			return false;
+		}
+	}
+
+	// With several inputs the output is a directory to put them in
+	QString out = parser.value(outOption);
+	bool toDirectory = !out.isEmpty() && (inputs.size() > 1 || out.endsWith('/') || QFileInfo(out).isDir());
+	if (toDirectory && !QDir().mkpath(out)) {
+		*error = QObject::tr("Can't create the directory %1").arg(out);
+		return false;
+	}
+
+	jobs.clear();
+	QSet<QString> outputs;
+	for (const QString &input : inputs) {
+		QFileInfo info(input);
+		QString output;
+		if (out.isEmpty())
+			output = info.dir().filePath(info.completeBaseName() + ".png");
+		else if (toDirectory)
+			output = QDir(out).filePath(info.completeBaseName() + ".png");
+		else
+			output = out;
+		if (outputs.contains(output)) {
+			*error = QObject::tr("More than one input would be written to %1").arg(output);
+			return false;
+		}
+		outputs.insert(output);
+		jobs.append(Job { input, output });
+	}
+	return true;
+}
+
+// Each job paints its own canvas so they share nothing but the paper.
+// Bands of the output are rendered on the global pool meanwhile
+int BatchRenderer::run()
+{
+	paperSource.load(":/images/images/watercolorpaper.jpg");
+
+	QThreadPool pool;
+	pool.setMaxThreadCount(maxJobs);
+	QAtomicInt failures;
+	for (const Job &job : qAsConst(jobs)) {
+		pool.start([this, job, &failures]() {
+			QElapsedTimer clock;
+			clock.start();
+			QString error;
+			bool rendered = render(job, &error);
+
+			QMutexLocker locker(&outputMutex);
+			if (rendered) {
+				QTextStream(stdout) << job.input << " -> " << job.output
+						    << " (" << clock.elapsed() << " ms)" << Qt::endl;
+			} else {
+				QTextStream(stderr) << job.input << ": " << error << Qt::endl;
+				failures.ref();
+			}
+		});
+	}
+	pool.waitForDone();
+	return failures.loadRelaxed() ? 1 : 0;
+}
+
+bool BatchRenderer::render(const Job &job, QString *error) const
+{
+	QSize canvasSize;
+	QVector<StrokeSample> samples;
+	if (isScript(job.input)) {
+		if (!readCanvasSize(job.input, &canvasSize, error))
+			return false;
+	} else if (!StrokeLog::read(job.input, &canvasSize, &samples, error)) {
+		return false;
+	}
+
+	LayerStack layers;
+	layers.resize(canvasSize);
+	layers.reset(paper(canvasSize));
+	if (isScript(job.input)) {
+		if (!runScript(job.input, layers, error))
+			return false;
+	} else {
+		StrokeReplayer::replay(samples, *layers.currentSurface(), false);
+	}
+
+	BandRenderer renderer(layers, outputSize.isValid() ? outputSize : canvasSize);
+	QSize size = renderer.outputSize();
+	if (TiffBandWriter::canWrite(job.output))
+		return TiffBandWriter::save(renderer, job.output, error);
+	if (!renderer.fitsInImage()) {
+		*error = QObject::tr("A %1 x %2 image is too large to write as %3, write it as TIFF instead")
+			 .arg(size.width()).arg(size.height()).arg(QFileInfo(job.output).suffix().toUpper());
+		return false;
+	}
+
+	// Held from rendering until the encoder is done with the image
+	int megabytes = int(qMin<qint64>(ImageMemoryMegabytes, (renderer.imageBytes() >> 20) + 1));
+	imageMemory.acquire(megabytes);
+	QImage image = renderer.toImage();
+	QString failure;
+	if (image.isNull()) {
+		failure = QObject::tr("Not enough memory for a %1 x %2 image").arg(size.width()).arg(size.height());
+	} else {
+		QImageWriter writer(job.output);
+		if (!writer.write(image))
+			failure = writer.errorString();
+	}
+	image = QImage();
+	imageMemory.release(megabytes);
+
+	if (!failure.isEmpty()) {
+		*error = failure;
+		return false;
+	}
+	return true;
+}
+
+// The script's canvas line, or else the output size
+bool BatchRenderer::readCanvasSize(const QString &fileName, QSize *size, QString *error) const
+{
+	QFile file(fileName);
+	if (!file.open(QIODevice::ReadOnly | QIODevice::Text)) {
+		*error = file.errorString();
+		return false;
+	}
+	*size = outputSize;
+	QTextStream in(&file);
+	while (!in.atEnd()) {
+		QStringList words = in.readLine().split(QRegularExpression("\\s+"), Qt::SkipEmptyParts);
+		if (words.size() == 3 && words.first() == "canvas") {
+			*size = QSize(words.at(1).toInt(), words.at(2).toInt());
+			break;
+		}
+	}
+	if (size->isEmpty()) {
+		*error = QObject::tr("No canvas size, give the script a canvas line or pass --size");
+		return false;
+	}
+	return true;
+}
+
+bool BatchRenderer::runScript(const QString &fileName, LayerStack &layers, QString *error) const
+{
+	QFile file(fileName);
+	if (!file.open(QIODevice::ReadOnly | QIODevice::Text)) {
+		*error = file.errorString();
+		return false;
+	}
+
+	TiledSurface &surface = *layers.currentSurface();
+	QTextStream in(&file);
+	int lineNumber = 0;
+	while (!in.atEnd()) {
+		QString line = in.readLine().trimmed();
+		++lineNumber;
+		if (line.isEmpty() || line.startsWith('#'))
+			continue;
+
+		QStringList words = line.split(QRegularExpression("\\s+"), Qt::SkipEmptyParts);
+		QString command = words.takeFirst();
+		if (command == "strokes" && words.size() == 1) {
+			QSize logSize;
+			QVector<StrokeSample> samples;
+			QString logError;
+			QString logFile = QFileInfo(fileName).dir().filePath(words.first());
+			if (!StrokeLog::read(logFile, &logSize, &samples, &logError)) {
+				*error = QObject::tr("%1 line %2: %3").arg(fileName).arg(lineNumber).arg(logError);
+				return false;
+			}
+			StrokeReplayer::replay(samples, surface, false);
+			continue;
+		}
+
+		QColor color;
+		bool ok = true;
+		if (command == "drop" && words.size() == 4) {
+			color = QColor(words.takeLast());
+			ok = color.isValid();
+		}
+		QVector<qreal> values;
+		for (const QString &word : qAsConst(words)) {
+			bool isNumber;
+			values.append(word.toDouble(&isNumber));
+			ok = ok && isNumber;
+		}
+
+		QWriteLocker locker(&surface.lock());
+		if (ok && command == "canvas" && values.size() == 2) {
+			// Read before the canvas was made
+		} else if (ok && command == "drop" && values.size() == 3) {
+			MarblingOperators::inkDrop(surface, QPointF(values[0], values[1]), values[2], color);
+		} else if (ok && command == "tine" && values.size() == 5) {
+			MarblingOperators::tine(surface, QPointF(values[0], values[1]), QPointF(values[2], values[3]),
+						values[4]);
+		} else if (ok && command == "comb" && values.size() == 6) {
+			MarblingOperators::tine(surface, QPointF(values[0], values[1]), QPointF(values[2], values[3]),
+						values[4], values[5]);
+		} else {
+			*error = QObject::tr("%1 line %2: can't read \"%3\"").arg(fileName).arg(lineNumber).arg(line);
+			return false;
+		}
+	}
+	return true;
+}
+
+// Covers the canvas the way the editor's paper does
+QImage BatchRenderer::paper(const QSize &canvasSize) const
+{
+	if (paperSource.isNull())
+		return QImage();
+	return paperSource.scaled(canvasSize, Qt::KeepAspectRatioByExpanding, Qt::SmoothTransformation)
+		.convertToFormat(QImage::Format_ARGB32_Premultiplied);
+}
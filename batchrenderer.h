@@ -0,0 +1,84 @@
+#ifndef BATCHRENDERER_H
+#define BATCHRENDERER_H
+
+#include <QImage>
+#include <QMutex>
+#include <QSemaphore>
+#include <QSize>
+#include <QString>
+#include <QStringList>
+#include <QVector>
+
+class LayerStack;
+
+// Renders stroke logs and marbling scripts to image files without a
+// window, for runs such as
+//
+//   Ebru --render plate.log --size 8192x8192 --out plate.png
+//
+// Every input is painted on a canvas of the size it was made for and
+// scaled to the output size the way an export at scale is. A marbling
+// script holds one operation per line, coordinates in canvas pixels:
+//
+//   canvas <width> <height>
+//   strokes <stroke log, relative to the script>
+//   drop <x> <y> <radius> <color>
+//   tine <x1> <y1> <x2> <y2> <sharpness>
+//   comb <x1> <y1> <x2> <y2> <sharpness> <spacing>
+//
+// Blank lines and those starting with # are skipped. Several inputs
+// are rendered at once, each on a thread of its own.
+//
+// Outputs named .tif or .tiff are written a band at a time whatever
+// their size. Other formats need the whole image in memory, a job only
+// builds one once the images of the others leave room for it
+class BatchRenderer
+{
+	public:
+
+		struct Job
+		{
+				QString input;
+				QString output;
+		};
+
+		BatchRenderer();
+
+		// Whether the command line asks for a batch render instead of
+		// the editor, looked at before any application object exists
+		static bool isRequested(int argc, char *argv[]);
+
+		// Takes the inputs and options from the command line, without
+		// --out an image is written next to every input
+		bool parse(const QStringList &arguments, QString *error);
+
+		const QVector<Job> &getJobs() const { return jobs; }
+
+		// Renders every job, a line for each goes to standard output and
+		// failures to standard error. Returns the exit code
+		int run();
+
+		// A single job on the calling thread
+		bool render(const Job &job, QString *error) const;
+
+	private:
+
+		// Memory the whole images of the jobs running at once may take
+		enum { ImageMemoryMegabytes = 2048 };
+
+		static bool isScript(const QString &fileName);
+		static bool parseSize(const QString &text, QSize *size);
+
+		bool readCanvasSize(const QString &fileName, QSize *size, QString *error) const;
+		bool runScript(const QString &fileName, LayerStack &layers, QString *error) const;
+		QImage paper(const QSize &canvasSize) const;
+
+		QVector<Job> jobs;
+		QSize outputSize;
+		int maxJobs;
+		QImage paperSource;
+		mutable QMutex outputMutex;
+		mutable QSemaphore imageMemory;
+};
+
+#endif // BATCHRENDERER_H
@@ -0,0 +1,10 @@
+# Benchmarks for the painting hot paths, build and run them with
+#   qmake && make && QT_QPA_PLATFORM=offscreen make check
+# Every benchmark also takes -json <file> to write its results as JSON,
+#   QT_QPA_PLATFORM=offscreen make check TESTARGS="-json results.json"
+
+TEMPLATE = subdirs
+
+SUBDIRS += \
+        brushengine \
+        scribblearea
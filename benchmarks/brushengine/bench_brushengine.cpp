@@ -0,0 +1,121 @@
+#include <QtTest>
+
+#include "benchmarkreport.h"
+#include "brushengine.h"
+#include "tiledsurface.h"
+
+// Stamps dabs with every blend kernel and with the QPainter calls
+// the tablet branches used before the brush engine, and reports how
+// many dabs per second each of them manages
+class BenchBrushEngine : public QObject
+{
+		Q_OBJECT
+
+	private slots:
+
+		void dabs_data();
+		void dabs();
+
+	private:
+
+		enum { DabsPerIteration = 256 };
+
+		static QPointF dabPosition(int i);
+		static void paintWithQPainter(TiledSurface &surface, const BrushEngine::Dab &dab, const QColor &color);
+};
+
+QPointF BenchBrushEngine::dabPosition(int i)
+{
+	return QPointF(64 + (i * 7) % 896, 64 + (i * 13) % 896);
+}
+
+// What paintPixmap used to do for a single dab
+void BenchBrushEngine::paintWithQPainter(TiledSurface &surface, const BrushEngine::Dab &dab, const QColor &color)
+{
+	QRect rect = QRectF(dab.pos - QPointF(dab.radius, dab.radius), QSizeF(dab.radius * 2, dab.radius * 2))
+			 .toAlignedRect().adjusted(-1, -1, 1, 1);
+	surface.paint(rect, [&](QPainter &painter) {
+		painter.setRenderHint(QPainter::Antialiasing);
+		painter.setPen(Qt::NoPen);
+		if (dab.hardness < 1.0) {
+			QRadialGradient grad(dab.pos, dab.radius * 2);
+			grad.setColorAt(0, color);
+			grad.setColorAt(0.5, Qt::transparent);
+			painter.setBrush(grad);
+		} else {
+			painter.setBrush(color);
+		}
+		painter.translate(dab.pos);
+		painter.rotate(dab.angle);
+		painter.drawEllipse(QPointF(0, 0), dab.radius, dab.radius * dab.aspectRatio);
+	});
+}
+
+void BenchBrushEngine::dabs_data()
+{
+	QTest::addColumn<QString>("path");
+	QTest::addColumn<qreal>("radius");
+	QTest::addColumn<qreal>("aspectRatio");
+	QTest::addColumn<qreal>("hardness");
+
+	const QStringList paths = QStringList() << "qpainter" << "scalar" << "sse2" << "avx2";
+	const QList<qreal> radii = QList<qreal>() << 2 << 8 << 32;
+
+	for (const QString &path : paths) {
+		for (qreal radius : radii) {
+			QByteArray size = QByteArray::number(radius);
+			QTest::newRow(QByteArray(path.toLatin1() + " round " + size).constData())
+					<< path << radius << qreal(1) << qreal(1);
+			QTest::newRow(QByteArray(path.toLatin1() + " soft " + size).constData())
+					<< path << radius << qreal(1) << qreal(0);
+			QTest::newRow(QByteArray(path.toLatin1() + " elliptical " + size).constData())
+					<< path << radius << qreal(0.25) << qreal(1);
+		}
+	}
+}
+
+void BenchBrushEngine::dabs()
+{
+	QFETCH(QString, path);
+	QFETCH(qreal, radius);
+	QFETCH(qreal, aspectRatio);
+	QFETCH(qreal, hardness);
+
+	TiledSurface surface;
+	surface.resize(QSize(1024, 1024));
+	QColor color(40, 90, 200, 160);
+
+	BrushEngine engine;
+	if (path == "sse2" || path == "avx2") {
+		DabKernels::Kind kind = path == "sse2" ? DabKernels::SSE2 : DabKernels::AVX2;
+		if (!DabKernels::isSupported(kind))
+			QSKIP("Kernel not supported by this cpu");
+		engine.setKernel(kind);
+	} else {
+		engine.setKernel(DabKernels::Scalar);
+	}
+
+	BrushEngine::Dab dab;
+	dab.radius = radius;
+	dab.aspectRatio = aspectRatio;
+	dab.hardness = hardness;
+	quint32 premultipliedColor = qPremultiply(color.rgba());
+
+	BenchmarkTimer timer;
+	QBENCHMARK {
+		for (int i = 0; i < DabsPerIteration; ++i) {
+			dab.pos = dabPosition(i);
+			dab.angle = i * 11 % 180;
+			if (path == "qpainter")
+				paintWithQPainter(surface, dab, color);
+			else
+				engine.stampDab(surface, dab, premultipliedColor);
+		}
+		timer.iteration();
+	}
+	timer.report(DabsPerIteration, "dabs");
+}
+
+EBRU_BENCHMARK_MAIN(BenchBrushEngine)
+
+#include "bench_brushengine.moc"
@@ -0,0 +1,24 @@
+QT       += core gui testlib
+
+TARGET = bench_brushengine
+CONFIG += c++11 console testcase
+CONFIG -= app_bundle
+
+INCLUDEPATH += ../.. ../common
+
+SOURCES += \
+        bench_brushengine.cpp \
+        ../../blendkernels.cpp \
+        ../../brushengine.cpp \
+        ../../dabkernels.cpp \
+        ../../dabmaskcache.cpp \
+        ../../tiledsurface.cpp
+
+HEADERS += \
+        ../common/benchmarkreport.h \
+        ../../blendkernels.h \
+        ../../brushengine.h \
+        ../../dabkernels.h \
+        ../../dabmaskcache.h \
+        ../../pixelmath.h \
+        ../../tiledsurface.h
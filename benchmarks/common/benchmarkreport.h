@@ -0,0 +1,142 @@
+#ifndef BENCHMARKREPORT_H
+#define BENCHMARKREPORT_H
+
+#include <QDateTime>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QStringList>
+#include <QSysInfo>
+#include <QtTest>
+
+// Collects what each benchmark measured next to QBENCHMARK and writes
+// it as JSON when the benchmark is run with -json <file>, so build
+// machines can track the numbers from one release to the next
+namespace BenchmarkReport
+{
+	struct Result
+	{
+			QString name;
+			qint64 iterations;
+			qint64 nsecs;
+			double itemsPerIteration;
+			QString unit;
+	};
+
+	inline QVector<Result> &results()
+	{
+		static QVector<Result> collected;
+		return collected;
+	}
+
+	// Reports iterations over nsecs for the running test function and data tag
+	inline void add(qint64 iterations, qint64 nsecs, double itemsPerIteration = 0, const QString &unit = QString())
+	{
+		if (iterations <= 0 || nsecs <= 0)
+			return;
+		Result result;
+		result.name = QString::fromLatin1(QTest::currentTestFunction());
+		if (QTest::currentDataTag() && *QTest::currentDataTag())
+			result.name += QLatin1Char(':') + QString::fromLatin1(QTest::currentDataTag());
+		result.iterations = iterations;
+		result.nsecs = nsecs;
+		result.itemsPerIteration = itemsPerIteration;
+		result.unit = unit;
+		results().append(result);
+
+		if (itemsPerIteration > 0)
+			qInfo("%s: %.0f %s/s", qPrintable(result.name),
+				itemsPerIteration * iterations * 1e9 / nsecs, qPrintable(unit));
+	}
+
+	inline bool write(const QString &fileName, const QString &suite)
+	{
+		QJsonArray entries;
+		for (const Result &result : results()) {
+			QJsonObject entry;
+			entry.insert("name", result.name);
+			entry.insert("iterations", double(result.iterations));
+			entry.insert("nsPerIteration", double(result.nsecs) / result.iterations);
+			if (result.itemsPerIteration > 0) {
+				entry.insert("unit", result.unit);
+				entry.insert("perSecond", result.itemsPerIteration * result.iterations * 1e9 / result.nsecs);
+			}
+			entries.append(entry);
+		}
+
+		QJsonObject report;
+		report.insert("suite", suite);
+		report.insert("qt", QString::fromLatin1(qVersion()));
+		report.insert("cpu", QSysInfo::currentCpuArchitecture());
+		report.insert("date", QDateTime::currentDateTimeUtc().toString(Qt::ISODate));
+		report.insert("results", entries);
+
+		QFile file(fileName);
+		if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+			return false;
+		file.write(QJsonDocument(report).toJson());
+		return true;
+	}
+
+	// Runs the test with the remaining arguments and writes the report
+	inline int exec(QObject *test, int argc, char **argv)
+	{
+		QStringList arguments;
+		QString jsonFile;
+		for (int i = 0; i < argc; ++i) {
+			if (qstrcmp(argv[i], "-json") == 0 && i + 1 < argc)
+				jsonFile = QString::fromLocal8Bit(argv[++i]);
+			else
+				arguments << QString::fromLocal8Bit(argv[i]);
+		}
+
+		int failures = QTest::qExec(test, arguments);
+		if (!jsonFile.isEmpty() && !write(jsonFile, QString::fromLatin1(test->metaObject()->className()))) {
+			qWarning("Could not write %s", qPrintable(jsonFile));
+			return failures ? failures : 1;
+		}
+		return failures;
+	}
+}
+
+// Counts the runs of a QBENCHMARK body, call iteration() at the end
+// of the body and report() after the loop
+class BenchmarkTimer
+{
+	public:
+
+		BenchmarkTimer() : count(0) { timer.start(); }
+
+		void iteration() { ++count; }
+		void report(double itemsPerIteration = 0, const QString &unit = QString())
+		{
+			BenchmarkReport::add(count, timer.nsecsElapsed(), itemsPerIteration, unit);
+		}
+
+	private:
+
+		QElapsedTimer timer;
+		qint64 count;
+};
+
+#ifdef QT_WIDGETS_LIB
+#include <QApplication>
+#define BENCHMARK_APPLICATION QApplication
+#else
+#include <QGuiApplication>
+#define BENCHMARK_APPLICATION QGuiApplication
+#endif
+
+// Like QTEST_MAIN but understands -json <file>
+#define EBRU_BENCHMARK_MAIN(TestObject) \
+int main(int argc, char *argv[]) \
+{ \
+	BENCHMARK_APPLICATION app(argc, argv); \
+	app.setAttribute(Qt::AA_Use96Dpi, true); \
+	TestObject test; \
+	return BenchmarkReport::exec(&test, argc, argv); \
+}
+
+#endif // BENCHMARKREPORT_H
@@ -0,0 +1,653 @@
+#include <QtTest>
+#include <QtWidgets>
+
+#include <limits>
+
+#include "bandrenderer.h"
+#include "benchmarkreport.h"
+#include "blendkernels.h"
+#include "layerstack.h"
+#include "marblingbath.h"
+#include "marblingoperators.h"
+#include "mippyramid.h"
+#include "scribblearea.h"
+#include "strokerasterizer.h"
+#include "strokesample.h"
+#include "tiledsurface.h"
+
+// Times the paths a ScribbleArea goes through while it is used: the
+// stroke branches of the rasterizer, repainting, clearing, resizing,
+// saving and loading at a few canvas sizes, the marbling bath, the
+// marbling operators and the pyramid behind zoomed out views
+class BenchScribbleArea : public QObject
+{
+		Q_OBJECT
+
+	private slots:
+
+		void initTestCase();
+
+		void drawLineTo_data();
+		void drawLineTo();
+		void paintPixmap_data();
+		void paintPixmap();
+		void updateBrush_data();
+		void updateBrush();
+		void concurrentStrokes_data();
+		void concurrentStrokes();
+		void paintEvent_data();
+		void paintEvent();
+		void clearImage_data();
+		void clearImage();
+		void resizeEvent_data();
+		void resizeEvent();
+		void save_data();
+		void save();
+		void load_data();
+		void load();
+		void marblingStep_data();
+		void marblingStep();
+		void marblingOperator_data();
+		void marblingOperator();
+		void mipPyramid_data();
+		void mipPyramid();
+		void bandRender_data();
+		void bandRender();
+		void blendKernels_data();
+		void blendKernels();
+
+	private:
+
+		enum { SamplesPerIteration = 256 };
+
+		static StrokeSample sample(StrokeSample::Type type, int i, QTabletEvent::TabletDevice device);
+		static void paintSomething(ScribbleArea &canvas, const QSize &size);
+		static void addSizes();
+
+		QTemporaryDir tempDir;
+};
+
+void BenchScribbleArea::initTestCase()
+{
+	QVERIFY(tempDir.isValid());
+}
+
+// Zigzags over the middle of a 1024 x 1024 canvas
+StrokeSample BenchScribbleArea::sample(StrokeSample::Type type, int i, QTabletEvent::TabletDevice device)
+{
+	StrokeSample sample;
+	sample.type = type;
+	sample.pointer = 0;
+	sample.timestamp = quint64(i) * 4;
+	sample.pos = QPointF(128 + (i * 5) % 768, 128 + (i % 64) * 12);
+	sample.pressure = 0.25 + (i % 16) / 32.0;
+	sample.tangentialPressure = 0.5;
+	sample.rotation = (i * 7) % 360;
+	sample.xTilt = (i % 40) - 20;
+	sample.yTilt = 20 - (i % 40);
+	sample.device = device;
+	sample.pointerType = device == QTabletEvent::NoDevice ? QTabletEvent::UnknownPointer : QTabletEvent::Pen;
+	sample.color = QColor(40, 90, 200);
+	sample.alphaChannelValuator = ScribbleArea::TangentialPressureValuator;
+	sample.colorSaturationValuator = ScribbleArea::NoValuator;
+	sample.lineWidthValuator = ScribbleArea::PressureValuator;
+	sample.spacing = 0.15;
+	sample.penWidth = 1;
+	return sample;
+}
+
+// Paints a mouse stroke every 512 pixels so saves have tiles to write.
+// The events are sent straight to the canvas so it needn't be shown
+void BenchScribbleArea::paintSomething(ScribbleArea &canvas, const QSize &size)
+{
+	for (int y = 64; y < size.height(); y += 512) {
+		QPoint start(16, y);
+		QPoint end(size.width() - 16, y + 32);
+		QMouseEvent press(QEvent::MouseButtonPress, start, Qt::LeftButton, Qt::LeftButton, Qt::NoModifier);
+		QMouseEvent move(QEvent::MouseMove, end, Qt::NoButton, Qt::LeftButton, Qt::NoModifier);
+		QMouseEvent release(QEvent::MouseButtonRelease, end, Qt::LeftButton, Qt::NoButton, Qt::NoModifier);
+		QCoreApplication::sendEvent(&canvas, &press);
+		QCoreApplication::sendEvent(&canvas, &move);
+		QCoreApplication::sendEvent(&canvas, &release);
+	}
+	canvas.waitForStrokes();
+}
+
+void BenchScribbleArea::addSizes()
+{
+	QTest::addColumn<int>("size");
+	QTest::newRow("512") << 512;
+	QTest::newRow("2048") << 2048;
+	QTest::newRow("4096") << 4096;
+}
+
+// Mouse strokes are round capped QPainter lines
+void BenchScribbleArea::drawLineTo_data()
+{
+	QTest::addColumn<int>("penWidth");
+	QTest::newRow("1") << 1;
+	QTest::newRow("8") << 8;
+	QTest::newRow("32") << 32;
+}
+
+void BenchScribbleArea::drawLineTo()
+{
+	QFETCH(int, penWidth);
+
+	TiledSurface surface;
+	surface.resize(QSize(1024, 1024));
+	StrokeRasterizer rasterizer(&surface);
+
+	StrokeSample press = sample(StrokeSample::Press, 0, QTabletEvent::NoDevice);
+	press.penWidth = penWidth;
+	rasterizer.rasterize(press);
+
+	BenchmarkTimer timer;
+	QBENCHMARK {
+		for (int i = 1; i <= SamplesPerIteration; ++i) {
+			StrokeSample move = sample(StrokeSample::Move, i, QTabletEvent::NoDevice);
+			move.penWidth = penWidth;
+			rasterizer.rasterize(move);
+		}
+		timer.iteration();
+	}
+	timer.report(SamplesPerIteration, "samples");
+}
+
+void BenchScribbleArea::paintPixmap_data()
+{
+	QTest::addColumn<int>("device");
+	QTest::addColumn<int>("pointerType");
+	QTest::newRow("stylus") << int(QTabletEvent::Stylus) << int(QTabletEvent::Pen);
+	QTest::newRow("airbrush") << int(QTabletEvent::Airbrush) << int(QTabletEvent::Pen);
+	QTest::newRow("rotation stylus") << int(QTabletEvent::RotationStylus) << int(QTabletEvent::Pen);
+	QTest::newRow("eraser") << int(QTabletEvent::Stylus) << int(QTabletEvent::Eraser);
+	QTest::newRow("puck") << int(QTabletEvent::Puck) << int(QTabletEvent::Cursor);
+}
+
+void BenchScribbleArea::paintPixmap()
+{
+	QFETCH(int, device);
+	QFETCH(int, pointerType);
+
+	TiledSurface surface;
+	surface.resize(QSize(1024, 1024));
+	StrokeRasterizer rasterizer(&surface);
+
+	StrokeSample press = sample(StrokeSample::Press, 0, QTabletEvent::TabletDevice(device));
+	press.pointerType = QTabletEvent::PointerType(pointerType);
+	rasterizer.rasterize(press);
+
+	BenchmarkTimer timer;
+	QBENCHMARK {
+		for (int i = 1; i <= SamplesPerIteration; ++i) {
+			StrokeSample move = sample(StrokeSample::Move, i, QTabletEvent::TabletDevice(device));
+			move.pointerType = QTabletEvent::PointerType(pointerType);
+			rasterizer.rasterize(move);
+		}
+		timer.iteration();
+	}
+	timer.report(SamplesPerIteration, "samples");
+}
+
+// Puck samples paint nothing, so what is left of rasterizing them
+// is updateBrush and taking the surface lock
+void BenchScribbleArea::updateBrush_data()
+{
+	QTest::addColumn<int>("alpha");
+	QTest::addColumn<int>("saturation");
+	QTest::addColumn<int>("lineWidth");
+	QTest::newRow("defaults") << int(ScribbleArea::TangentialPressureValuator)
+				     << int(ScribbleArea::NoValuator) << int(ScribbleArea::PressureValuator);
+	QTest::newRow("tilt") << int(ScribbleArea::TiltValuator)
+				<< int(ScribbleArea::VTiltValuator) << int(ScribbleArea::TiltValuator);
+	QTest::newRow("pressure") << int(ScribbleArea::PressureValuator)
+				    << int(ScribbleArea::PressureValuator) << int(ScribbleArea::PressureValuator);
+}
+
+void BenchScribbleArea::updateBrush()
+{
+	QFETCH(int, alpha);
+	QFETCH(int, saturation);
+	QFETCH(int, lineWidth);
+
+	TiledSurface surface;
+	surface.resize(QSize(1024, 1024));
+	StrokeRasterizer rasterizer(&surface);
+
+	BenchmarkTimer timer;
+	QBENCHMARK {
+		for (int i = 0; i < SamplesPerIteration; ++i) {
+			StrokeSample move = sample(StrokeSample::Move, i, QTabletEvent::Puck);
+			move.alphaChannelValuator = qint8(alpha);
+			move.colorSaturationValuator = qint8(saturation);
+			move.lineWidthValuator = qint8(lineWidth);
+			rasterizer.rasterize(move);
+		}
+		timer.iteration();
+	}
+	timer.report(SamplesPerIteration, "samples");
+}
+
+void BenchScribbleArea::concurrentStrokes_data()
+{
+	QTest::addColumn<int>("pointers");
+	QTest::addColumn<bool>("apart");
+	QTest::newRow("1 pointer") << 1 << true;
+	QTest::newRow("4 pointers") << 4 << true;
+	QTest::newRow("4 pointers/overlapping") << 4 << false;
+}
+
+// Airbrush strokes of several pointers interleaved the way a touch
+// table sends them. Apart each one has a 1024 x 1024 quarter of the
+// canvas, so the rasterizer can paint them in parallel
+void BenchScribbleArea::concurrentStrokes()
+{
+	QFETCH(int, pointers);
+	QFETCH(bool, apart);
+
+	TiledSurface surface;
+	surface.resize(QSize(2048, 2048));
+	StrokeRasterizer rasterizer(&surface);
+	rasterizer.start();
+
+	auto pointerSample = [pointers, apart](StrokeSample::Type type, int i, int pointer) {
+		StrokeSample s = sample(type, i, QTabletEvent::Airbrush);
+		s.pointer = pointer;
+		if (apart)
+			s.pos += QPointF((pointer % 2) * 1024, (pointer / 2) * 1024);
+		return s;
+	};
+	for (int pointer = 0; pointer < pointers; ++pointer)
+		rasterizer.enqueue(pointerSample(StrokeSample::Press, 0, pointer));
+
+	BenchmarkTimer timer;
+	QBENCHMARK {
+		for (int i = 1; i <= SamplesPerIteration; ++i) {
+			for (int pointer = 0; pointer < pointers; ++pointer)
+				rasterizer.enqueue(pointerSample(StrokeSample::Move, i, pointer));
+		}
+		rasterizer.waitUntilIdle();
+		timer.iteration();
+	}
+	timer.report(SamplesPerIteration * pointers, "samples");
+	rasterizer.stop();
+}
+
+void BenchScribbleArea::paintEvent_data()
+{
+	QTest::addColumn<QRect>("rect");
+	QTest::addColumn<int>("layers");
+	QTest::addColumn<bool>("serial");
+	QTest::newRow("small") << QRect(400, 400, 64, 64) << 1 << false;
+	QTest::newRow("full") << QRect(0, 0, 1024, 1024) << 1 << false;
+	QTest::newRow("full/serial") << QRect(0, 0, 1024, 1024) << 1 << true;
+	QTest::newRow("small/16 layers") << QRect(400, 400, 64, 64) << 16 << false;
+	QTest::newRow("full/16 layers") << QRect(0, 0, 1024, 1024) << 16 << false;
+	QTest::newRow("full/16 layers/serial") << QRect(0, 0, 1024, 1024) << 16 << true;
+}
+
+// Refreshes the display store inside rect and copies it to the screen.
+// With more layers something is painted on every one of them and the
+// one in the middle is current, the cost should stay about the same.
+// Full frames are composited in bands on every core unless serial, the
+// serial rows show what that gains
+void BenchScribbleArea::paintEvent()
+{
+	QFETCH(QRect, rect);
+	QFETCH(int, layers);
+	QFETCH(bool, serial);
+
+	ScribbleArea canvas;
+	if (serial)
+		canvas.setCompositeThreshold(std::numeric_limits<int>::max());
+	canvas.resize(1024, 1024);
+	canvas.show();
+	QVERIFY(QTest::qWaitForWindowExposed(&canvas));
+	paintSomething(canvas, canvas.size());
+	for (int i = 1; i < layers; ++i) {
+		canvas.addLayer();
+		paintSomething(canvas, canvas.size());
+	}
+	canvas.setCurrentLayer(canvas.layerStack().count() / 2);
+	canvas.updateCanvas();
+	canvas.repaint();
+
+	BenchmarkTimer timer;
+	QBENCHMARK {
+		canvas.updateCanvas(rect);
+		canvas.repaint(rect);
+		timer.iteration();
+	}
+	timer.report(1, "frames");
+}
+
+void BenchScribbleArea::clearImage_data()
+{
+	addSizes();
+}
+
+void BenchScribbleArea::clearImage()
+{
+	QFETCH(int, size);
+
+	ScribbleArea canvas;
+	canvas.resize(size, size);
+
+	BenchmarkTimer timer;
+	QBENCHMARK {
+		canvas.clearImage();
+		timer.iteration();
+	}
+	timer.report();
+}
+
+void BenchScribbleArea::resizeEvent_data()
+{
+	QTest::addColumn<int>("step");
+	QTest::newRow("16") << 16;
+	QTest::newRow("256") << 256;
+}
+
+// Grows a shown canvas from 512 pixels by step 32 times, the way
+// dragging the window edge does
+void BenchScribbleArea::resizeEvent()
+{
+	QFETCH(int, step);
+
+	enum { Steps = 32 };
+	QBENCHMARK_ONCE {
+		ScribbleArea canvas;
+		canvas.resize(512, 512);
+		canvas.show();
+		QVERIFY(QTest::qWaitForWindowExposed(&canvas));
+
+		BenchmarkTimer timer;
+		for (int i = 1; i <= Steps; ++i) {
+			canvas.resize(512 + i * step, 512 + i * step);
+			timer.iteration();
+		}
+		timer.report(1, "resizes");
+	}
+}
+
+void BenchScribbleArea::save_data()
+{
+	QTest::addColumn<int>("size");
+	QTest::addColumn<QString>("format");
+	for (int size : QList<int>() << 512 << 2048 << 4096) {
+		QByteArray tag = QByteArray::number(size);
+		QTest::newRow(QByteArray("png " + tag).constData()) << size << QString("png");
+		QTest::newRow(QByteArray("ebru " + tag).constData()) << size << QString("ebru");
+		QTest::newRow(QByteArray("ebru incremental " + tag).constData()) << size << QString("incremental");
+	}
+}
+
+void BenchScribbleArea::save()
+{
+	QFETCH(int, size);
+	QFETCH(QString, format);
+
+	ScribbleArea canvas;
+	canvas.resize(size, size);
+	canvas.clearImage();
+	paintSomething(canvas, QSize(size, size));
+
+	QString fileName = tempDir.filePath(QString("save-%1.%2").arg(size)
+						   .arg(format == "png" ? "png" : "ebru"));
+	if (format == "incremental")
+		QVERIFY(canvas.saveImage(fileName));
+
+	BenchmarkTimer timer;
+	QBENCHMARK {
+		// A full save each time unless the file is there to add to
+		if (format == "ebru")
+			QFile::remove(fileName);
+		else if (format == "incremental")
+			paintSomething(canvas, QSize(size, 600));
+		QVERIFY(canvas.saveImage(fileName));
+		timer.iteration();
+	}
+	timer.report(1, "saves");
+}
+
+void BenchScribbleArea::load_data()
+{
+	QTest::addColumn<int>("size");
+	QTest::addColumn<QString>("format");
+	for (int size : QList<int>() << 512 << 2048 << 4096) {
+		QByteArray tag = QByteArray::number(size);
+		QTest::newRow(QByteArray("png " + tag).constData()) << size << QString("png");
+		QTest::newRow(QByteArray("ebru " + tag).constData()) << size << QString("ebru");
+	}
+}
+
+// Opening counts up to the first frame being on screen, that is
+// when a project has decompressed the tiles it shows
+void BenchScribbleArea::load()
+{
+	QFETCH(int, size);
+	QFETCH(QString, format);
+
+	QString fileName = tempDir.filePath(QString("load-%1.%2").arg(size).arg(format));
+	{
+		ScribbleArea source;
+		source.resize(size, size);
+		source.clearImage();
+		paintSomething(source, QSize(size, size));
+		QVERIFY(source.saveImage(fileName));
+	}
+
+	ScribbleArea canvas;
+	canvas.resize(512, 512);
+	canvas.show();
+	QVERIFY(QTest::qWaitForWindowExposed(&canvas));
+
+	BenchmarkTimer timer;
+	QBENCHMARK {
+		QVERIFY(canvas.openImage(fileName));
+		canvas.repaint();
+		timer.iteration();
+	}
+	timer.report(1, "loads");
+}
+
+void BenchScribbleArea::marblingStep_data()
+{
+	QTest::addColumn<int>("cellSize");
+	QTest::newRow("2") << 2;
+	QTest::newRow("4") << 4;
+	QTest::newRow("8") << 8;
+}
+
+// One frame of the bath over a 1920 x 1080 canvas that is being stirred
+void BenchScribbleArea::marblingStep()
+{
+	QFETCH(int, cellSize);
+
+	QImage paint(1920, 1080, QImage::Format_ARGB32_Premultiplied);
+	QPainter painter(&paint);
+	for (int y = 0; y < paint.height(); y += 40)
+		painter.fillRect(0, y, paint.width(), 20, QColor::fromHsv(y % 360, 200, 220));
+	painter.end();
+
+	MarblingBath bath;
+	bath.setCellSize(cellSize);
+	bath.start(paint, paint.rect());
+
+	int i = 0;
+	BenchmarkTimer timer;
+	QBENCHMARK {
+		QPointF from(200 + (i * 37) % 1500, 540 + 300 * qSin(i * 0.1));
+		bath.drag(from, from + QPointF(24, 8), 48);
+		bath.step(1.0 / 30);
+		++i;
+		timer.iteration();
+	}
+	timer.report(1, "frames");
+}
+
+void BenchScribbleArea::marblingOperator_data()
+{
+	QTest::addColumn<QString>("operation");
+	QTest::newRow("inkDrop") << QString("inkDrop");
+	QTest::newRow("tine") << QString("tine");
+	QTest::newRow("comb") << QString("comb");
+}
+
+// One operation on a fully painted 3840 x 2160 plate, the comb
+// touches every tile of it
+void BenchScribbleArea::marblingOperator()
+{
+	QFETCH(QString, operation);
+
+	TiledSurface surface;
+	surface.resize(QSize(3840, 2160));
+	surface.paint(QRect(QPoint(0, 0), surface.size()), [](QPainter &painter) {
+		for (int y = 0; y < 2160; y += 40)
+			painter.fillRect(0, y, 3840, 20, QColor::fromHsv(y % 360, 200, 220));
+	});
+
+	int i = 0;
+	BenchmarkTimer timer;
+	QBENCHMARK {
+		QPointF from(400 + (i * 53) % 3000, 1080);
+		if (operation == "inkDrop")
+			MarblingOperators::inkDrop(surface, from, 24, Qt::darkBlue);
+		else if (operation == "tine")
+			MarblingOperators::tine(surface, from, from + QPointF(0, 40), 12);
+		else
+			MarblingOperators::tine(surface, QPointF(0, 200), QPointF(60, 200), 12, 48);
+		++i;
+		timer.iteration();
+	}
+	timer.report(1, "operations");
+}
+
+void BenchScribbleArea::mipPyramid_data()
+{
+	QTest::addColumn<QRect>("rect");
+	QTest::newRow("stroke") << QRect(2000, 2000, 64, 64);
+	QTest::newRow("full") << QRect(0, 0, 8192, 8192);
+}
+
+// Brings the levels of an 8192 x 8192 display up to date after rect
+// changed, a stroke only touches a few texels on every level
+void BenchScribbleArea::mipPyramid()
+{
+	QFETCH(QRect, rect);
+
+	QImage base(8192, 8192, QImage::Format_ARGB32_Premultiplied);
+	QPainter painter(&base);
+	for (int y = 0; y < base.height(); y += 40)
+		painter.fillRect(0, y, base.width(), 20, QColor::fromHsv(y % 360, 200, 220));
+	painter.end();
+
+	MipPyramid pyramid;
+	pyramid.update(base);
+
+	BenchmarkTimer timer;
+	QBENCHMARK {
+		pyramid.invalidate(rect);
+		pyramid.update(base);
+		timer.iteration();
+	}
+	timer.report(1, "updates");
+}
+
+void BenchScribbleArea::bandRender_data()
+{
+	QTest::addColumn<int>("scale");
+	QTest::newRow("1x") << 1;
+	QTest::newRow("2x") << 2;
+	QTest::newRow("4x") << 4;
+}
+
+// Scales a 2048 x 2048 stack up as printing and exporting do, the
+// bands are dropped as they come so only rendering is measured
+void BenchScribbleArea::bandRender()
+{
+	QFETCH(int, scale);
+
+	QImage paper(2048, 2048, QImage::Format_ARGB32_Premultiplied);
+	QPainter painter(&paper);
+	for (int y = 0; y < paper.height(); y += 40)
+		painter.fillRect(0, y, paper.width(), 20, QColor::fromHsv(y % 360, 200, 220));
+	painter.end();
+
+	LayerStack layers;
+	layers.resize(paper.size());
+	layers.reset(paper);
+	BandRenderer renderer(layers, paper.size() * scale, Qt::white);
+
+	BenchmarkTimer timer;
+	QBENCHMARK {
+		QVERIFY(renderer.render([](const QImage &, int) { return true; }));
+		timer.iteration();
+	}
+	timer.report(1, "renders");
+}
+
+void BenchScribbleArea::blendKernels_data()
+{
+	QTest::addColumn<int>("mode");
+	QTest::addColumn<int>("composition");
+	QTest::addColumn<bool>("opaque");
+
+	struct Replaced
+	{
+			BlendKernels::Mode mode;
+			QPainter::CompositionMode composition;
+	};
+	const Replaced replaced[] = {
+		{ BlendKernels::Normal, QPainter::CompositionMode_SourceOver },
+		{ BlendKernels::Multiply, QPainter::CompositionMode_Multiply },
+		{ BlendKernels::Screen, QPainter::CompositionMode_Screen },
+		{ BlendKernels::Erase, QPainter::CompositionMode_DestinationOut }
+	};
+	for (const Replaced &r : replaced) {
+		QByteArray tag = BlendKernels::name(r.mode);
+		QTest::newRow(QByteArray(tag + "/kernel").constData()) << int(r.mode) << -1 << false;
+		QTest::newRow(QByteArray(tag + "/qpainter").constData()) << int(r.mode) << int(r.composition) << false;
+	}
+	QTest::newRow("paper erase/kernel") << int(BlendKernels::PaperErase) << -1 << false;
+	QTest::newRow("normal/rgb32/kernel") << int(BlendKernels::Normal) << -1 << true;
+	QTest::newRow("normal/rgb32/qpainter") << int(BlendKernels::Normal)
+						 << int(QPainter::CompositionMode_SourceOver) << true;
+}
+
+// Blends a half transparent 1024 x 1024 layer onto another, with the
+// specialized kernel or the QPainter composition mode it stands in for
+void BenchScribbleArea::blendKernels()
+{
+	QFETCH(int, mode);
+	QFETCH(int, composition);
+	QFETCH(bool, opaque);
+
+	QImage source(1024, 1024, QImage::Format_ARGB32_Premultiplied);
+	source.fill(Qt::transparent);
+	QPainter painter(&source);
+	for (int y = 0; y < source.height(); y += 40)
+		painter.fillRect(0, y, source.width(), 20, QColor::fromHsv(y % 360, 200, 220, 128));
+	painter.end();
+
+	QImage destination(source.size(), opaque ? QImage::Format_RGB32 : QImage::Format_ARGB32_Premultiplied);
+	destination.fill(QColor(200, 180, 150));
+
+	BenchmarkTimer timer;
+	QBENCHMARK {
+		if (composition < 0) {
+			QVERIFY(BlendKernels::blendImage(destination, QPoint(), source, BlendKernels::Mode(mode)));
+		} else {
+			QPainter painter(&destination);
+			painter.setCompositionMode(QPainter::CompositionMode(composition));
+			painter.drawImage(0, 0, source);
+		}
+		timer.iteration();
+	}
+	timer.report(source.width() * source.height(), "pixels");
+}
+
+EBRU_BENCHMARK_MAIN(BenchScribbleArea)
+
+#include "bench_scribblearea.moc"
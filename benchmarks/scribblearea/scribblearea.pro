@@ -0,0 +1,65 @@
+QT       += core gui widgets printsupport concurrent testlib
+
+TARGET = bench_scribblearea
+CONFIG += c++11 console testcase
+CONFIG -= app_bundle
+
+INCLUDEPATH += ../.. ../common
+
+SOURCES += \
+        bench_scribblearea.cpp \
+        ../../bandrenderer.cpp \
+        ../../blendkernels.cpp \
+        ../../brushengine.cpp \
+        ../../cursorcache.cpp \
+        ../../dabkernels.cpp \
+        ../../dabmaskcache.cpp \
+        ../../imagesaver.cpp \
+        ../../latencymeter.cpp \
+        ../../layerstack.cpp \
+        ../../marblingbath.cpp \
+        ../../marblingoperators.cpp \
+        ../../mippyramid.cpp \
+        ../../profiler.cpp \
+        ../../profileroverlay.cpp \
+        ../../projectfile.cpp \
+        ../../scribblearea.cpp \
+        ../../strokelog.cpp \
+        ../../strokepredictor.cpp \
+        ../../strokerasterizer.cpp \
+        ../../strokereplayer.cpp \
+        ../../tiffbandwriter.cpp \
+        ../../tiledsurface.cpp \
+        ../../undohistory.cpp
+
+HEADERS += \
+        ../common/benchmarkreport.h \
+        ../../bandrenderer.h \
+        ../../blendkernels.h \
+        ../../brushengine.h \
+        ../../cursorcache.h \
+        ../../dabkernels.h \
+        ../../dabmaskcache.h \
+        ../../imagesaver.h \
+        ../../latencymeter.h \
+        ../../layerstack.h \
+        ../../marblingbath.h \
+        ../../marblingoperators.h \
+        ../../mippyramid.h \
+        ../../parallelbands.h \
+        ../../pixelmath.h \
+        ../../profiler.h \
+        ../../profileroverlay.h \
+        ../../projectfile.h \
+        ../../samplequeue.h \
+        ../../scribblearea.h \
+        ../../strokelog.h \
+        ../../strokepredictor.h \
+        ../../strokerasterizer.h \
+        ../../strokereplayer.h \
+        ../../strokesample.h \
+        ../../tiffbandwriter.h \
+        ../../tiledsurface.h \
+        ../../undohistory.h
+
+RESOURCES += ../../images.qrc
@@ -0,0 +1,206 @@
+#include "blendkernels.h"
+#include "pixelmath.h"
+
+namespace
+{
+
+using namespace BlendKernels;
+using PixelMath::byteMul;
+using PixelMath::div255;
+
+// Every channel of a times the same channel of b, / 255
+inline quint32 channelMul(quint32 a, quint32 b)
+{
+	quint32 result = 0;
+	for (int shift = 0; shift < 32; shift += 8)
+		result |= div255(((a >> shift) & 0xff) * ((b >> shift) & 0xff)) << shift;
+	return result;
+}
+
+// How pixels of each format are read and written
+template <Format F>
+struct Pixel
+{
+	static quint32 load(quint32 pixel) { return pixel; }
+	static quint32 store(quint32 pixel) { return pixel; }
+};
+
+template <>
+struct Pixel<RGB32>
+{
+	static quint32 load(quint32 pixel) { return pixel | 0xff000000; }
+	static quint32 store(quint32 pixel) { return pixel | 0xff000000; }
+};
+
+// The blend itself, with the coverage of the pixel out of 255
+template <Mode M>
+struct Op;
+
+template <>
+struct Op<Normal>
+{
+	static quint32 blend(quint32 dst, quint32 src, quint32 coverage)
+	{
+		src = byteMul(src, coverage);
+		return src + byteMul(dst, 255 - (src >> 24));
+	}
+};
+
+// s * d + s * (1 - da) + d * (1 - sa), which Qt uses as well. Each
+// channel is clamped on its own, the three roundings could carry
+template <>
+struct Op<Multiply>
+{
+	static quint32 blend(quint32 dst, quint32 src, quint32 coverage)
+	{
+		src = byteMul(src, coverage);
+		quint32 sa = src >> 24;
+		quint32 da = dst >> 24;
+		quint32 result = 0;
+		for (int shift = 0; shift < 32; shift += 8) {
+			quint32 s = (src >> shift) & 0xff;
+			quint32 d = (dst >> shift) & 0xff;
+			quint32 channel = div255(s * d + s * (255 - da) + d * (255 - sa));
+			result |= qMin(channel, 255u) << shift;
+		}
+		return result;
+	}
+};
+
+// s + d - s * d, never past 255 so the channels can't carry
+template <>
+struct Op<Screen>
+{
+	static quint32 blend(quint32 dst, quint32 src, quint32 coverage)
+	{
+		src = byteMul(src, coverage);
+		return src + dst - channelMul(src, dst);
+	}
+};
+
+template <>
+struct Op<Erase>
+{
+	static quint32 blend(quint32 dst, quint32 src, quint32 coverage)
+	{
+		return byteMul(dst, 255 - div255((src >> 24) * coverage));
+	}
+};
+
+template <>
+struct Op<PaperErase>
+{
+	static quint32 blend(quint32 dst, quint32 src, quint32 coverage)
+	{
+		return byteMul(src, coverage) + byteMul(dst, 255 - coverage);
+	}
+};
+
+template <Mode M, Format S, Format D, bool Masked>
+void blendRow(quint32 *dst, const quint32 *src, const quint8 *mask, quint32 opacity, int count)
+{
+	const quint32 solid = S == Solid ? src[0] : 0;
+	for (int i = 0; i < count; ++i) {
+		quint32 coverage = Masked ? div255(mask[i] * opacity) : opacity;
+		if (!coverage)
+			continue;
+		quint32 source = S == Solid ? solid : Pixel<S>::load(src[i]);
+		dst[i] = Pixel<D>::store(Op<M>::blend(Pixel<D>::load(dst[i]), source, coverage));
+	}
+}
+
+// Every combination, indexed by mode, source, destination and mask
+struct Table
+{
+	RowFunction rows[ModeCount][FormatCount][2][2];
+
+	Table()
+	{
+		addMode<Normal>();
+		addMode<Multiply>();
+		addMode<Screen>();
+		addMode<Erase>();
+		addMode<PaperErase>();
+	}
+
+	template <Mode M>
+	void addMode()
+	{
+		addSource<M, Solid>();
+		addSource<M, ARGB32Premultiplied>();
+		addSource<M, RGB32>();
+	}
+
+	template <Mode M, Format S>
+	void addSource()
+	{
+		rows[M][S][0][0] = blendRow<M, S, ARGB32Premultiplied, false>;
+		rows[M][S][0][1] = blendRow<M, S, ARGB32Premultiplied, true>;
+		rows[M][S][1][0] = blendRow<M, S, RGB32, false>;
+		rows[M][S][1][1] = blendRow<M, S, RGB32, true>;
+	}
+};
+
+}
+
+namespace BlendKernels
+{
+
+RowFunction rowFunction(Mode mode, Format source, Format destination, bool masked)
+{
+	static const Table table;
+	if (mode < 0 || mode >= ModeCount || source < 0 || source >= FormatCount
+	    || (destination != ARGB32Premultiplied && destination != RGB32))
+		return nullptr;
+	return table.rows[mode][source][destination == RGB32][masked];
+}
+
+Format format(QImage::Format imageFormat)
+{
+	switch (imageFormat) {
+		case QImage::Format_ARGB32_Premultiplied:
+			return ARGB32Premultiplied;
+		case QImage::Format_RGB32:
+			return RGB32;
+		default:
+			return FormatCount;
+	}
+}
+
+const char *name(Mode mode)
+{
+	switch (mode) {
+		case Normal:
+			return "normal";
+		case Multiply:
+			return "multiply";
+		case Screen:
+			return "screen";
+		case Erase:
+			return "erase";
+		case PaperErase:
+			return "paper erase";
+		default:
+			return "";
+	}
+}
+
+bool blendImage(QImage &destination, const QPoint &pos, const QImage &source, Mode mode, quint32 opacity)
+{
+	Format from = format(source.format());
+	Format to = format(destination.format());
+	if (from == FormatCount || to == FormatCount)
+		return false;
+
+	RowFunction blend = rowFunction(mode, from, to, false);
+	QRect area = QRect(pos, source.size()) & destination.rect();
+	for (int y = area.top(); y <= area.bottom(); ++y) {
+		const quint32 *src = reinterpret_cast<const quint32 *>(source.constScanLine(y - pos.y()))
+				     + (area.left() - pos.x());
+		quint32 *dst = reinterpret_cast<quint32 *>(destination.scanLine(y)) + area.left();
+		blend(dst, src, nullptr, opacity, area.width());
+	}
+	return true;
+}
+
+}
@@ -0,0 +1,62 @@
+#ifndef BLENDKERNELS_H
+#define BLENDKERNELS_H
+
+#include <QImage>
+#include <QPoint>
+#include <QtGlobal>
+
+// Row compositing kernels, one instance per blend mode, source format,
+// destination format and whether there is a coverage mask. They are
+// picked once, when a stroke or an image blend starts, and nothing is
+// decided per pixel after that. Pixels are premultiplied ARGB32 or
+// RGB32, whose alpha byte is ignored on the way in and set on the
+// way out
+namespace BlendKernels
+{
+	enum Mode
+	{
+		Normal,
+		Multiply,
+		Screen,
+
+		// Takes away as much of the destination as the source alpha
+		// covers, leaving it transparent
+		Erase,
+
+		// Brings the destination back to the source, which is whatever
+		// lies under the paint such as the paper. Over a transparent
+		// source it is the same as Erase
+		PaperErase,
+
+		ModeCount
+	};
+
+	enum Format
+	{
+		// A single color repeated over the row, sources only
+		Solid,
+		ARGB32Premultiplied,
+		RGB32,
+		FormatCount
+	};
+
+	// Blends count source pixels onto dst, each one scaled by its mask
+	// coverage and by opacity. A solid source only reads src[0], an
+	// unmasked kernel ignores mask
+	typedef void (*RowFunction)(quint32 *dst, const quint32 *src, const quint8 *mask,
+				    quint32 opacity, int count);
+
+	// Null for a destination that is neither of the two image formats
+	RowFunction rowFunction(Mode mode, Format source, Format destination, bool masked);
+
+	// FormatCount for anything there are no kernels for
+	Format format(QImage::Format imageFormat);
+	const char *name(Mode mode);
+
+	// The whole of source onto destination at pos. Returns false and
+	// leaves destination alone if either format has no kernels
+	bool blendImage(QImage &destination, const QPoint &pos, const QImage &source,
+			Mode mode, quint32 opacity = 255);
+}
+
+#endif // BLENDKERNELS_H
@@ -0,0 +1,203 @@
+#include "brushengine.h"
+#include "tiledsurface.h"
+
+#include <QLineF>
+#include <QtMath>
+#include <cmath>
+
+BrushEngine::BrushEngine()
+	: dabSpacing(0.15)
+	, spacingCarry(0)
+	, stampedDabs(0)
+	, mode(BlendKernels::Normal)
+	, blendRow(nullptr)
+	, dabMasks(new DabMaskCache)
+{
+	setKernel(DabKernels::bestKind());
+}
+
+void BrushEngine::setBlendMode(BlendKernels::Mode newMode)
+{
+	mode = newMode;
+	if (mode == BlendKernels::Normal)
+		blendRow = nullptr;
+	else
+		blendRow = BlendKernels::rowFunction(mode, mode == BlendKernels::PaperErase ? BlendKernels::ARGB32Premultiplied
+										   : BlendKernels::Solid,
+						     BlendKernels::ARGB32Premultiplied, true);
+}
+
+// One row of a dab at x, y in surface coordinates
+inline void BrushEngine::blendLine(const TiledSurface &surface, quint32 *line, int x, int y, const quint8 *mask,
+				   quint32 premultipliedColor, int count)
+{
+	if (!blendRow)
+		blendMask(line, mask, premultipliedColor, count);
+	else if (mode == BlendKernels::PaperErase)
+		blendRow(line, backgroundLine(surface, x, y, count), mask, qAlpha(premultipliedColor), count);
+	else
+		blendRow(line, &premultipliedColor, mask, 255, count);
+}
+
+// What the surface shows under its tiles, straight from the background
+// image where it covers the whole row
+const quint32 *BrushEngine::backgroundLine(const TiledSurface &surface, int x, int y, int count)
+{
+	const QImage &background = surface.background();
+	if (y < background.height() && x + count <= background.width())
+		return reinterpret_cast<const quint32 *>(background.constScanLine(y)) + x;
+
+	backgroundRow.resize(count);
+	quint32 fill = qPremultiply(surface.backgroundColor().rgba());
+	const quint32 *image = y < background.height() ? reinterpret_cast<const quint32 *>(background.constScanLine(y))
+						       : nullptr;
+	for (int i = 0; i < count; ++i)
+		backgroundRow[i] = image && x + i < background.width() ? image[x + i] : fill;
+	return backgroundRow.constData();
+}
+
+void BrushEngine::setKernel(DabKernels::Kind kind)
+{
+	kernelKind = DabKernels::isSupported(kind) ? kind : DabKernels::Scalar;
+	blendMask = DabKernels::blendMask(kernelKind);
+}
+
+// Walks along the segment placing a dab every spacing * diameter
+// pixels. Whatever distance is left over is carried into the next
+// segment so the dabs stay evenly spaced across tablet events
+QRect BrushEngine::strokeSegment(TiledSurface &surface, const Dab &from, const Dab &to, const QColor &color)
+{
+	quint32 premultipliedColor = qPremultiply(color.rgba());
+	qreal length = QLineF(from.pos, to.pos).length();
+	// Ellipses look the same turned half way around
+	qreal turn = std::remainder(to.angle - from.angle, 180.0);
+
+	QRect painted;
+	qreal position = spacingCarry;
+	while (position <= length) {
+		qreal t = length > 0 ? position / length : 0;
+		Dab dab;
+		dab.pos = from.pos + (to.pos - from.pos) * t;
+		dab.radius = from.radius + (to.radius - from.radius) * t;
+		dab.aspectRatio = from.aspectRatio + (to.aspectRatio - from.aspectRatio) * t;
+		dab.angle = from.angle + turn * t;
+		dab.hardness = from.hardness + (to.hardness - from.hardness) * t;
+		painted |= stampDab(surface, dab, premultipliedColor);
+
+		qreal diameter = 2 * dab.radius * qMin(dab.aspectRatio, qreal(1));
+		position += qMax(qreal(0.5), dabSpacing * diameter);
+	}
+	spacingCarry = position - length;
+	return painted;
+}
+
+// Round dabs come out of the mask cache, only elliptical ones
+// have their coverage worked out pixel by pixel
+QRect BrushEngine::stampDab(TiledSurface &surface, const Dab &dab, quint32 premultipliedColor)
+{
+	if (qFuzzyCompare(dab.aspectRatio, qreal(1)))
+		return stampCachedDab(surface, dab, premultipliedColor);
+	return stampComputedDab(surface, dab, premultipliedColor);
+}
+
+QRect BrushEngine::stampCachedDab(TiledSurface &surface, const Dab &dab, quint32 premultipliedColor)
+{
+	QPoint origin;
+	QSharedPointer<const DabMaskCache::Mask> mask = dabMasks->mask(dab.pos, qMax(dab.radius, qreal(0.5)),
+									dab.hardness, &origin);
+	// Too big to ever fit in the cache
+	if (!mask)
+		return stampComputedDab(surface, dab, premultipliedColor);
+
+	QRect maskRect = mask->rect.translated(origin);
+	QRect bounds = maskRect & QRect(QPoint(0, 0), surface.size());
+	if (bounds.isEmpty())
+		return QRect();
+
+	const quint8 *alpha = reinterpret_cast<const quint8 *>(mask->alpha.constData());
+	QRect range = surface.tilesIn(bounds);
+	for (int row = range.top(); row <= range.bottom(); ++row) {
+		for (int column = range.left(); column <= range.right(); ++column) {
+			QRect tileRect = surface.tileRect(column, row);
+			QRect area = tileRect & bounds;
+			QImage &tile = surface.tile(column, row);
+			uchar *bits = tile.bits();
+			int bytesPerLine = tile.bytesPerLine();
+
+			for (int y = area.top(); y <= area.bottom(); ++y) {
+				const quint8 *maskLine = alpha + (y - maskRect.top()) * maskRect.width()
+							     + (area.left() - maskRect.left());
+				quint32 *line = reinterpret_cast<quint32 *>(bits + (y - tileRect.top()) * bytesPerLine);
+				blendLine(surface, line + (area.left() - tileRect.left()), area.left(), y, maskLine,
+					  premultipliedColor, area.width());
+			}
+		}
+	}
+
+	++stampedDabs;
+	return bounds;
+}
+
+QRect BrushEngine::stampComputedDab(TiledSurface &surface, const Dab &dab, quint32 premultipliedColor)
+{
+	qreal major = qMax(dab.radius, qreal(0.5));
+	qreal minor = qMax(major * dab.aspectRatio, qreal(0.5));
+	qreal angle = qDegreesToRadians(dab.angle);
+	qreal cosAngle = qCos(angle);
+	qreal sinAngle = qSin(angle);
+
+	// Bounding box of the turned ellipse
+	qreal extentX = qSqrt(major * major * cosAngle * cosAngle + minor * minor * sinAngle * sinAngle);
+	qreal extentY = qSqrt(major * major * sinAngle * sinAngle + minor * minor * cosAngle * cosAngle);
+	QRect bounds = QRectF(dab.pos.x() - extentX, dab.pos.y() - extentY, extentX * 2, extentY * 2)
+			   .toAlignedRect() & QRect(QPoint(0, 0), surface.size());
+	if (bounds.isEmpty())
+		return QRect();
+
+	// Maps pixel offsets so the ellipse edge is at distance 1. The
+	// edge is never sharper than a pixel to keep hard dabs antialiased
+	const float ux = float(cosAngle / major);
+	const float uy = float(sinAngle / major);
+	const float vx = float(-sinAngle / minor);
+	const float vy = float(cosAngle / minor);
+	const float falloff = float(qMax(1 - dab.hardness, 1 / minor));
+	const float centerX = float(dab.pos.x());
+	const float centerY = float(dab.pos.y());
+
+	maskRow.resize(bounds.width());
+	quint8 *mask = maskRow.data();
+
+	QRect range = surface.tilesIn(bounds);
+	for (int row = range.top(); row <= range.bottom(); ++row) {
+		for (int column = range.left(); column <= range.right(); ++column) {
+			QRect tileRect = surface.tileRect(column, row);
+			QRect area = tileRect & bounds;
+			QImage &tile = surface.tile(column, row);
+			uchar *bits = tile.bits();
+			int bytesPerLine = tile.bytesPerLine();
+
+			for (int y = area.top(); y <= area.bottom(); ++y) {
+				float dy = y + 0.5f - centerY;
+				int covered = 0;
+				for (int i = 0; i < area.width(); ++i) {
+					float dx = area.left() + i + 0.5f - centerX;
+					float u = dx * ux + dy * uy;
+					float v = dx * vx + dy * vy;
+					float coverage = (1.0f - std::sqrt(u * u + v * v)) / falloff;
+					coverage = coverage < 0.0f ? 0.0f : coverage > 1.0f ? 1.0f : coverage;
+					mask[i] = quint8(coverage * 255.0f + 0.5f);
+					covered |= mask[i];
+				}
+				if (!covered)
+					continue;
+
+				quint32 *line = reinterpret_cast<quint32 *>(bits + (y - tileRect.top()) * bytesPerLine);
+				blendLine(surface, line + (area.left() - tileRect.left()), area.left(), y, mask,
+					  premultipliedColor, area.width());
+			}
+		}
+	}
+
+	++stampedDabs;
+	return bounds;
+}
@@ -0,0 +1,95 @@
+#ifndef BRUSHENGINE_H
+#define BRUSHENGINE_H
+
+#include <QColor>
+#include <QPointF>
+#include <QRect>
+#include <QSharedPointer>
+#include <QVector>
+
+#include "blendkernels.h"
+#include "dabkernels.h"
+#include "dabmaskcache.h"
+
+class TiledSurface;
+
+// Paints strokes as a row of round or elliptical dabs stamped
+// straight into the surface tiles
+class BrushEngine
+{
+	public:
+
+		struct Dab
+		{
+				QPointF pos;
+
+				// Radius along the major axis in pixels
+				qreal radius;
+
+				// Minor radius divided by the major one, 1 for round dabs
+				qreal aspectRatio;
+
+				// Direction of the major axis in degrees
+				qreal angle;
+
+				// 0 fades out from the center, 1 is solid up to the edge
+				qreal hardness;
+		};
+
+		BrushEngine();
+
+		// Distance between dabs as a fraction of the dab diameter
+		void setSpacing(qreal spacing) { dabSpacing = spacing; }
+		qreal spacing() const { return dabSpacing; }
+
+		void setKernel(DabKernels::Kind kind);
+		DabKernels::Kind kernel() const { return kernelKind; }
+
+		// How dabs go onto the surface, Normal by default. Normal uses
+		// the vector dab kernels, the other modes the blend kernel
+		// picked here. PaperErase brings back the surface background
+		void setBlendMode(BlendKernels::Mode mode);
+		BlendKernels::Mode blendMode() const { return mode; }
+
+		// Starts a new stroke, the next segment stamps at its start
+		void beginStroke() { spacingCarry = 0; }
+
+		// Stamps dabs from one dab to the other, interpolating size and
+		// angle. Returns the rect that was painted on
+		QRect strokeSegment(TiledSurface &surface, const Dab &from, const Dab &to, const QColor &color);
+
+		QRect stampDab(TiledSurface &surface, const Dab &dab, quint32 premultipliedColor);
+
+		// Brushes of several pointers can share one mask cache, each
+		// engine has one of its own until it is given another
+		void setMaskCache(const QSharedPointer<DabMaskCache> &cache) { dabMasks = cache; }
+		const QSharedPointer<DabMaskCache> &maskCache() const { return dabMasks; }
+
+		// Memory the cached round dab masks may use
+		void setMaskCacheLimit(int bytes) { dabMasks->setMaxBytes(bytes); }
+		int maskCacheLimit() const { return dabMasks->maxBytes(); }
+
+		// Number of dabs stamped since the engine was created
+		qint64 dabCount() const { return stampedDabs; }
+
+	private:
+
+		QRect stampCachedDab(TiledSurface &surface, const Dab &dab, quint32 premultipliedColor);
+		QRect stampComputedDab(TiledSurface &surface, const Dab &dab, quint32 premultipliedColor);
+		void blendLine(const TiledSurface &surface, quint32 *line, int x, int y, const quint8 *mask,
+			       quint32 premultipliedColor, int count);
+		const quint32 *backgroundLine(const TiledSurface &surface, int x, int y, int count);
+
+		qreal dabSpacing;
+		qreal spacingCarry;
+		qint64 stampedDabs;
+		DabKernels::Kind kernelKind;
+		DabKernels::BlendMaskFunction blendMask;
+		BlendKernels::Mode mode;
+		BlendKernels::RowFunction blendRow;
+		QVector<quint32> backgroundRow;
+		QVector<quint8> maskRow;
+		QSharedPointer<DabMaskCache> dabMasks;
+};
+
+#endif // BRUSHENGINE_H
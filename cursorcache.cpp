@@ -0,0 +1,87 @@
+#include <QPainter>
+#include <QPixmap>
+#include <QtMath>
+
+#include "cursorcache.h"
+
+CursorCache::CursorCache()
+	: eraser(QPixmap(":/images/cursor-eraser.png"), 3, 28)
+	, pencil(QPixmap(":/images/cursor-pencil.png"), 0, 0)
+	, airbrush(QPixmap(":/images/cursor-airbrush.png"), 3, 4)
+	, feltMarker(QLatin1String(":/images/cursor-felt-marker.png"))
+	, markerColor(0)
+	, markerSteps(RotationSteps)
+	, markerRendered(RotationSteps, false)
+{
+}
+
+CursorCache::Key CursorCache::key(const QTabletEvent *event, const QColor &color)
+{
+	Key key = { NoCursor, 0, 0 };
+	if (event->type() == QEvent::TabletLeaveProximity)
+		return key;
+	if (event->pointerType() == QTabletEvent::Eraser) {
+		key.kind = EraserCursor;
+		return key;
+	}
+	switch (event->device()) {
+		case QTabletEvent::Stylus:
+			key.kind = PencilCursor;
+			break;
+		case QTabletEvent::Airbrush:
+			key.kind = AirbrushCursor;
+			break;
+		case QTabletEvent::RotationStylus: {
+			key.kind = FeltMarkerCursor;
+			int step = qRound(event->rotation() / RotationStep) % RotationSteps;
+			key.step = step < 0 ? step + RotationSteps : step;
+			key.color = color.rgb();
+		} break;
+		default:
+			break;
+	}
+	return key;
+}
+
+const QCursor &CursorCache::cursor(const Key &key)
+{
+	switch (key.kind) {
+		case EraserCursor:
+			return eraser;
+		case PencilCursor:
+			return pencil;
+		case AirbrushCursor:
+			return airbrush;
+		case FeltMarkerCursor:
+			if (key.color != markerColor) {
+				markerColor = key.color;
+				markerRendered.fill(false);
+			}
+			if (!markerRendered.at(key.step)) {
+				markerSteps[key.step] = renderFeltMarker(key.step, key.color);
+				markerRendered[key.step] = true;
+			}
+			return markerSteps.at(key.step);
+		default:
+			return none;
+	}
+}
+
+// The marker's outline filled with the solid color, then its shading
+// laid over it
+QCursor CursorCache::renderFeltMarker(int step, QRgb color) const
+{
+	QImage img(32, 32, QImage::Format_ARGB32);
+	img.fill(QColor(color));
+	QPainter painter(&img);
+	QTransform transform = painter.transform();
+	transform.translate(16, 16);
+	transform.rotate(step * RotationStep);
+	painter.setTransform(transform);
+	painter.setCompositionMode(QPainter::CompositionMode_DestinationIn);
+	painter.drawImage(-24, -24, feltMarker);
+	painter.setCompositionMode(QPainter::CompositionMode_HardLight);
+	painter.drawImage(-24, -24, feltMarker);
+	painter.end();
+	return QCursor(QPixmap::fromImage(img), 16, 16);
+}
@@ -0,0 +1,64 @@
+#ifndef CURSORCACHE_H
+#define CURSORCACHE_H
+
+#include <QColor>
+#include <QCursor>
+#include <QImage>
+#include <QTabletEvent>
+#include <QVector>
+
+// Tablet cursors, decoded once. The felt marker cursor follows the
+// rotation of the pen in steps of RotationStep degrees and is tinted
+// with the brush color. Its rotations are rendered the first time they
+// are needed and forgotten when the color changes
+class CursorCache
+{
+	public:
+
+		enum { RotationStep = 2, RotationSteps = 360 / RotationStep };
+
+		enum Kind
+		{
+			NoCursor,
+			EraserCursor,
+			PencilCursor,
+			AirbrushCursor,
+			FeltMarkerCursor
+		};
+
+		// Tells cursors apart, two equal keys give the same cursor
+		struct Key
+		{
+				Kind kind;
+				int step;
+				QRgb color;
+
+				bool operator==(const Key &other) const
+				{
+					return kind == other.kind && step == other.step && color == other.color;
+				}
+				bool operator!=(const Key &other) const { return !(*this == other); }
+		};
+
+		CursorCache();
+
+		// The cursor for the pen of the event painting in color
+		static Key key(const QTabletEvent *event, const QColor &color);
+		const QCursor &cursor(const Key &key);
+
+	private:
+
+		QCursor renderFeltMarker(int step, QRgb color) const;
+
+		QCursor eraser;
+		QCursor pencil;
+		QCursor airbrush;
+		QCursor none;
+		QImage feltMarker;
+
+		QRgb markerColor;
+		QVector<QCursor> markerSteps;
+		QVector<bool> markerRendered;
+};
+
+#endif // CURSORCACHE_H
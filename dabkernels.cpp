@@ -0,0 +1,224 @@
+#include "dabkernels.h"
+#include "pixelmath.h"
+
+#include <cstring>
+
+#if defined(Q_PROCESSOR_X86)
+#include <immintrin.h>
+#if defined(Q_CC_MSVC)
+#include <intrin.h>
+#endif
+#endif
+
+// GCC and Clang only let us use AVX2 intrinsics inside functions
+// built for it, MSVC accepts them anywhere
+#if defined(Q_PROCESSOR_X86) && defined(Q_CC_GNU)
+#define DAB_TARGET(features) __attribute__((target(features)))
+#else
+#define DAB_TARGET(features)
+#endif
+
+namespace
+{
+
+using PixelMath::byteMul;
+
+inline quint32 blendPixel(quint32 dst, quint8 mask, quint32 color)
+{
+	quint32 src = mask == 255 ? color : byteMul(color, mask);
+	return src + byteMul(dst, 255 - (src >> 24));
+}
+
+void blendMaskScalar(quint32 *dst, const quint8 *mask, quint32 color, int count)
+{
+	for (int i = 0; i < count; ++i) {
+		if (mask[i])
+			dst[i] = blendPixel(dst[i], mask[i], color);
+	}
+}
+
+#if defined(Q_PROCESSOR_X86)
+
+// x / 255 rounded, for 16 bit lanes holding at most 255 * 255
+DAB_TARGET("sse2")
+inline __m128i div255(__m128i x)
+{
+	x = _mm_add_epi16(x, _mm_set1_epi16(128));
+	return _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+}
+
+// Two pixels unpacked to 16 bit lanes, blended with their masks
+DAB_TARGET("sse2")
+inline __m128i blendPair(__m128i dst, __m128i mask, __m128i color)
+{
+	__m128i src = div255(_mm_mullo_epi16(color, mask));
+	__m128i alpha = _mm_shufflehi_epi16(_mm_shufflelo_epi16(src, _MM_SHUFFLE(3, 3, 3, 3)),
+							_MM_SHUFFLE(3, 3, 3, 3));
+	__m128i inverse = _mm_sub_epi16(_mm_set1_epi16(255), alpha);
+	return _mm_add_epi16(src, div255(_mm_mullo_epi16(dst, inverse)));
+}
+
+DAB_TARGET("sse2")
+void blendMaskSSE2(quint32 *dst, const quint8 *mask, quint32 color, int count)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i color16 = _mm_unpacklo_epi8(_mm_set1_epi32(int(color)), zero);
+
+	int i = 0;
+	for (; i + 4 <= count; i += 4) {
+		quint32 masks;
+		memcpy(&masks, mask + i, sizeof(masks));
+		if (!masks)
+			continue;
+
+		// Spread every mask byte over the four channels of its pixel
+		__m128i mask32 = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(int(masks)), zero), zero);
+		mask32 = _mm_or_si128(mask32, _mm_slli_epi32(mask32, 16));
+
+		__m128i pixels = _mm_loadu_si128(reinterpret_cast<const __m128i *>(dst + i));
+		__m128i low = blendPair(_mm_unpacklo_epi8(pixels, zero), _mm_unpacklo_epi32(mask32, mask32), color16);
+		__m128i high = blendPair(_mm_unpackhi_epi8(pixels, zero), _mm_unpackhi_epi32(mask32, mask32), color16);
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), _mm_packus_epi16(low, high));
+	}
+	blendMaskScalar(dst + i, mask + i, color, count - i);
+}
+
+DAB_TARGET("avx2")
+inline __m256i div255(__m256i x)
+{
+	x = _mm256_add_epi16(x, _mm256_set1_epi16(128));
+	return _mm256_srli_epi16(_mm256_add_epi16(x, _mm256_srli_epi16(x, 8)), 8);
+}
+
+DAB_TARGET("avx2")
+inline __m256i blendPair(__m256i dst, __m256i mask, __m256i color)
+{
+	__m256i src = div255(_mm256_mullo_epi16(color, mask));
+	__m256i alpha = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(src, _MM_SHUFFLE(3, 3, 3, 3)),
+							   _MM_SHUFFLE(3, 3, 3, 3));
+	__m256i inverse = _mm256_sub_epi16(_mm256_set1_epi16(255), alpha);
+	return _mm256_add_epi16(src, div255(_mm256_mullo_epi16(dst, inverse)));
+}
+
+DAB_TARGET("avx2")
+void blendMaskAVX2(quint32 *dst, const quint8 *mask, quint32 color, int count)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i color16 = _mm256_unpacklo_epi8(_mm256_set1_epi32(int(color)), zero);
+
+	int i = 0;
+	for (; i + 8 <= count; i += 8) {
+		quint64 masks;
+		memcpy(&masks, mask + i, sizeof(masks));
+		if (!masks)
+			continue;
+
+		// The unpacks work per 128 bit lane, so the first four masks
+		// end up in the low lane and the last four in the high lane
+		__m256i mask32 = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(mask + i)));
+		mask32 = _mm256_or_si256(mask32, _mm256_slli_epi32(mask32, 16));
+
+		__m256i pixels = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(dst + i));
+		__m256i low = blendPair(_mm256_unpacklo_epi8(pixels, zero), _mm256_unpacklo_epi32(mask32, mask32), color16);
+		__m256i high = blendPair(_mm256_unpackhi_epi8(pixels, zero), _mm256_unpackhi_epi32(mask32, mask32), color16);
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i), _mm256_packus_epi16(low, high));
+	}
+	blendMaskSSE2(dst + i, mask + i, color, count - i);
+}
+
+bool cpuHasAVX2()
+{
+#if defined(Q_CC_MSVC)
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] < 7)
+		return false;
+	__cpuid(info, 1);
+	// The OS has to save the ymm registers for us
+	bool osSavesYmm = (info[2] & (1 << 27)) && (_xgetbv(0) & 0x6) == 0x6;
+	__cpuidex(info, 7, 0);
+	return osSavesYmm && (info[1] & (1 << 5));
+#elif defined(Q_CC_GNU)
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+#else
+	return false;
+#endif
+}
+
+bool cpuHasSSE2()
+{
+#if defined(Q_PROCESSOR_X86_64)
+	return true;
+#elif defined(Q_CC_MSVC)
+	int info[4];
+	__cpuid(info, 1);
+	return info[3] & (1 << 26);
+#elif defined(Q_CC_GNU)
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("sse2");
+#else
+	return false;
+#endif
+}
+
+#endif // Q_PROCESSOR_X86
+
+}
+
+namespace DabKernels
+{
+
+bool isSupported(Kind kind)
+{
+	switch (kind) {
+		case Scalar:
+			return true;
+#if defined(Q_PROCESSOR_X86)
+		case SSE2:
+			return cpuHasSSE2();
+		case AVX2:
+			return cpuHasSSE2() && cpuHasAVX2();
+#endif
+		default:
+			return false;
+	}
+}
+
+Kind bestKind()
+{
+	static const Kind kind = isSupported(AVX2) ? AVX2 : isSupported(SSE2) ? SSE2 : Scalar;
+	return kind;
+}
+
+const char *name(Kind kind)
+{
+	switch (kind) {
+		case SSE2:
+			return "sse2";
+		case AVX2:
+			return "avx2";
+		default:
+			return "scalar";
+	}
+}
+
+// Falls back to the scalar kernel for anything the cpu can't run
+BlendMaskFunction blendMask(Kind kind)
+{
+	if (!isSupported(kind))
+		return blendMaskScalar;
+
+	switch (kind) {
+#if defined(Q_PROCESSOR_X86)
+		case SSE2:
+			return blendMaskSSE2;
+		case AVX2:
+			return blendMaskAVX2;
+#endif
+		default:
+			return blendMaskScalar;
+	}
+}
+
+}
@@ -0,0 +1,28 @@
+#ifndef DABKERNELS_H
+#define DABKERNELS_H
+
+#include <QtGlobal>
+
+// Row blending kernels used by the brush engine.
+// Every kernel composites a solid premultiplied ARGB32 color over
+// count premultiplied ARGB32 pixels, scaled by an 8 bit coverage mask
+namespace DabKernels
+{
+	enum Kind
+	{
+		Scalar,
+		SSE2,
+		AVX2
+	};
+
+	typedef void (*BlendMaskFunction)(quint32 *dst, const quint8 *mask, quint32 color, int count);
+
+	// Fastest kind the cpu we are running on supports
+	Kind bestKind();
+	bool isSupported(Kind kind);
+	const char *name(Kind kind);
+
+	BlendMaskFunction blendMask(Kind kind);
+}
+
+#endif // DABKERNELS_H
@@ -0,0 +1,93 @@
+#include "dabmaskcache.h"
+
+#include <QtMath>
+#include <cmath>
+
+DabMaskCache::DabMaskCache(int maxBytes)
+	: masks(maxBytes)
+{
+}
+
+void DabMaskCache::setMaxBytes(int maxBytes)
+{
+	QMutexLocker locker(&mutex);
+	masks.setMaxCost(maxBytes);
+}
+
+int DabMaskCache::maxBytes() const
+{
+	QMutexLocker locker(&mutex);
+	return masks.maxCost();
+}
+
+int DabMaskCache::usedBytes() const
+{
+	QMutexLocker locker(&mutex);
+	return masks.totalCost();
+}
+
+// Quarter pixel steps for small dabs, coarser steps for large
+// ones where a fraction of a pixel can't be seen anyway
+qreal DabMaskCache::quantizeRadius(qreal radius)
+{
+	qreal step = radius < 16 ? 0.25 : radius < 64 ? 1.0 : 4.0;
+	return qMax(step, qRound(radius / step) * step);
+}
+
+// A mask missing from the cache is made outside the lock, two threads
+// after the same one both make it and the last one is kept
+QSharedPointer<const DabMaskCache::Mask> DabMaskCache::mask(const QPointF &pos, qreal radius, qreal hardness,
+							     QPoint *origin)
+{
+	qreal x = qRound(pos.x() * SubPixelSteps) / qreal(SubPixelSteps);
+	qreal y = qRound(pos.y() * SubPixelSteps) / qreal(SubPixelSteps);
+	*origin = QPoint(qFloor(x), qFloor(y));
+
+	int phaseX = qRound((x - origin->x()) * SubPixelSteps);
+	int phaseY = qRound((y - origin->y()) * SubPixelSteps);
+	qreal quantizedRadius = quantizeRadius(radius);
+	int hardnessStep = qRound(qBound(qreal(0), hardness, qreal(1)) * HardnessSteps);
+
+	quint64 key = (quint64(quantizedRadius * 4) << 16) | (quint64(hardnessStep) << 8)
+			  | (quint64(phaseY) << 4) | quint64(phaseX);
+
+	{
+		QMutexLocker locker(&mutex);
+		if (Entry *cached = masks.object(key))
+			return cached->mask;
+	}
+
+	Entry *entry = new Entry;
+	entry->mask.reset(createMask(phaseX / qreal(SubPixelSteps), phaseY / qreal(SubPixelSteps),
+				     quantizedRadius, hardnessStep / qreal(HardnessSteps)));
+	QSharedPointer<const Mask> mask = entry->mask;
+	int cost = mask->alpha.size() + int(sizeof(Mask));
+	// The cache deletes the entry straight away if it doesn't fit
+	QMutexLocker locker(&mutex);
+	if (!masks.insert(key, entry, cost))
+		return QSharedPointer<const Mask>();
+	return mask;
+}
+
+// Same falloff as BrushEngine::stampDab uses for uncached dabs
+DabMaskCache::Mask *DabMaskCache::createMask(qreal centerX, qreal centerY, qreal radius, qreal hardness)
+{
+	Mask *mask = new Mask;
+	mask->rect = QRect(QPoint(qFloor(centerX - radius), qFloor(centerY - radius)),
+				 QPoint(qCeil(centerX + radius), qCeil(centerY + radius)));
+	mask->alpha.resize(mask->rect.width() * mask->rect.height());
+
+	const float scale = float(1 / radius);
+	const float falloff = float(qMax(1 - hardness, 1 / radius));
+	quint8 *alpha = reinterpret_cast<quint8 *>(mask->alpha.data());
+	for (int y = mask->rect.top(); y <= mask->rect.bottom(); ++y) {
+		float v = (y + 0.5f - float(centerY)) * scale;
+		for (int x = mask->rect.left(); x <= mask->rect.right(); ++x) {
+			float u = (x + 0.5f - float(centerX)) * scale;
+			float coverage = (1.0f - std::sqrt(u * u + v * v)) / falloff;
+			coverage = coverage < 0.0f ? 0.0f : coverage > 1.0f ? 1.0f : coverage;
+			*alpha++ = quint8(coverage * 255.0f + 0.5f);
+		}
+	}
+	return mask;
+}
@@ -0,0 +1,56 @@
+#ifndef DABMASKCACHE_H
+#define DABMASKCACHE_H
+
+#include <QByteArray>
+#include <QCache>
+#include <QMutex>
+#include <QPointF>
+#include <QRect>
+#include <QSharedPointer>
+
+// Precomputed 8 bit coverage masks for round dabs, keyed by
+// quantized radius, hardness and sub pixel position. The least
+// recently used masks are dropped once the cache is over budget.
+//
+// One cache can be shared by brushes painting on several threads,
+// a mask that is dropped stays alive for as long as a brush uses it
+class DabMaskCache
+{
+	public:
+
+		struct Mask
+		{
+				// Mask area relative to the pixel the dab center falls in
+				QRect rect;
+				QByteArray alpha;
+		};
+
+		explicit DabMaskCache(int maxBytes = 8 * 1024 * 1024);
+
+		void setMaxBytes(int maxBytes);
+		int maxBytes() const;
+		int usedBytes() const;
+
+		// Mask for a round dab centered at pos, origin is set to the
+		// pixel the mask rect is relative to. Null if the mask is
+		// bigger than the whole cache
+		QSharedPointer<const Mask> mask(const QPointF &pos, qreal radius, qreal hardness, QPoint *origin);
+
+	private:
+
+		enum { SubPixelSteps = 4, HardnessSteps = 32 };
+
+		// QCache owns what it holds, the masks are only referenced
+		struct Entry
+		{
+				QSharedPointer<const Mask> mask;
+		};
+
+		static qreal quantizeRadius(qreal radius);
+		static Mask *createMask(qreal centerX, qreal centerY, qreal radius, qreal hardness);
+
+		mutable QMutex mutex;
+		QCache<quint64, Entry> masks;
+};
+
+#endif // DABMASKCACHE_H
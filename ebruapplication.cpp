@@ -6,7 +6,8 @@ bool EbruApplication::event(QEvent *event)
 {
     if (event->type() == QEvent::TabletEnterProximity ||
 	  event->type() == QEvent::TabletLeaveProximity) {
-	  myCanvas->setTabletDevice(static_cast<QTabletEvent *>(event));
+	  if (myCanvas)
+		myCanvas->setTabletDevice(static_cast<QTabletEvent *>(event));
 	  return true;
     }
     return QApplication::event(event);
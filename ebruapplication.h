@@ -12,9 +12,11 @@ class EbruApplication : public QApplication
 		Q_OBJECT
 	public:
 		EbruApplication(int &argv, char **args)
-		 : QApplication(argv, args) {}
+		 : QApplication(argv, args), myCanvas(nullptr) {}
 
 		bool event(QEvent* event) override;
+
+		// Proximity events go to the canvas being shown
 		void setCanvas(ScribbleArea* canvas){myCanvas = canvas;}
 
 	signals:
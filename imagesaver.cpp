@@ -0,0 +1,78 @@
+#include <QFileInfo>
+#include <QImageWriter>
+
+#include "bandrenderer.h"
+#include "imagesaver.h"
+#include "tiffbandwriter.h"
+
+ImageSaver::ImageSaver(const LayerStack &snapshot, const QString &fileName, QObject *parent)
+	: QThread(parent)
+	, layers(snapshot)
+	, targetFile(fileName)
+	, scale(1)
+{
+}
+
+// The snapshot belongs to this thread alone so no locking is needed
+void ImageSaver::run()
+{
+	if (ProjectFile::isProjectFile(targetFile))
+		saveProject();
+	else if (TiffBandWriter::canWrite(targetFile))
+		saveTiff();
+	else
+		saveImage();
+}
+
+void ImageSaver::saveProject()
+{
+	QString error;
+	if (!ProjectFile::save(layers, targetFile, previousIndex, &projectIndex, &error,
+				     [this](int percent) { emit progress(percent); })) {
+		emit failed(targetFile, error);
+		return;
+	}
+	emit saved(targetFile);
+}
+
+// Bands are rendered in parallel and copied into the image as they
+// come, the only full size buffer is the one handed to the writer
+void ImageSaver::saveImage()
+{
+	BandRenderer renderer(layers, layers.size() * scale);
+	if (!renderer.fitsInImage()) {
+		emit failed(targetFile, tr("A %1 x %2 image is too large to write as %3, save it as TIFF instead")
+				    .arg(renderer.outputSize().width()).arg(renderer.outputSize().height())
+				    .arg(QFileInfo(targetFile).suffix().toUpper()));
+		return;
+	}
+	int height = renderer.outputSize().height();
+	QImage image = renderer.toImage([this, height](int rows) { emit progress(rows * 50 / height); });
+	if (image.isNull()) {
+		emit failed(targetFile, tr("Not enough memory to flatten the image"));
+		return;
+	}
+
+	QImageWriter writer(targetFile);
+	if (!writer.write(image)) {
+		emit failed(targetFile, writer.errorString());
+		return;
+	}
+	emit progress(100);
+	emit saved(targetFile);
+}
+
+// Each band is compressed and written while the next ones render, so
+// only the bands in flight are ever in memory
+void ImageSaver::saveTiff()
+{
+	BandRenderer renderer(layers, layers.size() * scale);
+	qint64 height = renderer.outputSize().height();
+	QString error;
+	if (!TiffBandWriter::save(renderer, targetFile, &error,
+				  [this, height](int rows) { emit progress(int(rows * 100 / height)); })) {
+		emit failed(targetFile, error);
+		return;
+	}
+	emit saved(targetFile);
+}
@@ -0,0 +1,59 @@
+#ifndef IMAGESAVER_H
+#define IMAGESAVER_H
+
+#include <QString>
+#include <QThread>
+
+#include "layerstack.h"
+#include "projectfile.h"
+
+// Flattens a snapshot of the layers and writes it to a file on its
+// own thread, so the canvas can be painted on while it saves. Project
+// files are written tile by tile instead of flattened, images may be
+// scaled up by a whole factor on the way. TIFFs are written a band at
+// a time however large they are, other formats need the whole image
+// in memory and are refused past BandRenderer's limit
+class ImageSaver : public QThread
+{
+		Q_OBJECT
+
+	public:
+
+		ImageSaver(const LayerStack &snapshot, const QString &fileName, QObject *parent = nullptr);
+
+		QString fileName() const { return targetFile; }
+
+		// Images are written this many times the canvas size
+		void setScale(int factor) { scale = qMax(1, factor); }
+
+		// What was last saved to the project, only the tiles that
+		// changed since are written again
+		void setPreviousIndex(const ProjectFile::Index &index) { previousIndex = index; }
+		ProjectFile::Index savedIndex() const { return projectIndex; }
+
+	signals:
+
+		// Percent done. Images are flattened in the first half and
+		// encoded in the second, TIFFs and projects count the rows written
+		void progress(int percent);
+		void saved(const QString &fileName);
+		void failed(const QString &fileName, const QString &error);
+
+	protected:
+
+		void run() override;
+
+	private:
+
+		void saveImage();
+		void saveTiff();
+		void saveProject();
+
+		LayerStack layers;
+		QString targetFile;
+		int scale;
+		ProjectFile::Index previousIndex;
+		ProjectFile::Index projectIndex;
+};
+
+#endif // IMAGESAVER_H
@@ -0,0 +1,69 @@
+#include <QElapsedTimer>
+
+#include <algorithm>
+
+#include "latencymeter.h"
+
+LatencyMeter::LatencyMeter()
+	: nextLatency(0)
+	, clockOffset(0)
+	, sameClock(true)
+	, offsetKnown(false)
+{
+}
+
+void LatencyMeter::clear()
+{
+	pending.clear();
+	latencies.clear();
+	nextLatency = 0;
+}
+
+qint64 LatencyMeter::now()
+{
+	return QElapsedTimer::msecsSinceReference();
+}
+
+void LatencyMeter::sampleQueued(quint64 sequence, quint64 timestamp)
+{
+	qint64 received = now();
+	qint64 offset = received - qint64(timestamp);
+	if (offset < 0 || offset > SameClockLimit)
+		sameClock = false;
+	if (!sameClock && (!offsetKnown || offset < clockOffset)) {
+		clockOffset = offset;
+		offsetKnown = true;
+	}
+
+	// Nothing is shown while the window is hidden, don't pile up
+	if (pending.size() >= MaxPending)
+		pending.dequeue();
+	pending.enqueue(Pending { sequence, qint64(timestamp) });
+}
+
+void LatencyMeter::frameShown(quint64 samples)
+{
+	if (pending.isEmpty() || pending.head().sequence >= samples)
+		return;
+
+	qint64 shown = now() - (sameClock ? 0 : clockOffset);
+	while (!pending.isEmpty() && pending.head().sequence < samples) {
+		float latency = float(qMax(qint64(0), shown - pending.dequeue().eventTime));
+		if (latencies.size() < KeptMeasurements) {
+			latencies.append(latency);
+		} else {
+			latencies[nextLatency] = latency;
+			nextLatency = (nextLatency + 1) % KeptMeasurements;
+		}
+	}
+}
+
+qreal LatencyMeter::percentile(qreal fraction) const
+{
+	if (latencies.isEmpty())
+		return 0;
+	QVector<float> sorted = latencies;
+	int index = qBound(0, int(fraction * sorted.size()), sorted.size() - 1);
+	std::nth_element(sorted.begin(), sorted.begin() + index, sorted.end());
+	return sorted.at(index);
+}
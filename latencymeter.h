@@ -0,0 +1,59 @@
+#ifndef LATENCYMETER_H
+#define LATENCYMETER_H
+
+#include <QQueue>
+#include <QVector>
+
+// Time from an input event to the first frame that shows what it
+// painted. Samples are numbered in the order they are queued for the
+// rasterizer and a frame reports how many of them it shows.
+//
+// Event timestamps are compared with QElapsedTimer's clock. Where the
+// two don't share an origin the offset between them is estimated from
+// the quickest delivered event, which leaves out the event delivery
+// time itself
+class LatencyMeter
+{
+	public:
+
+		LatencyMeter();
+
+		void clear();
+
+		// Sample number sequence was queued, timestamp being the one
+		// of the event in milliseconds
+		void sampleQueued(quint64 sequence, quint64 timestamp);
+
+		// A frame went to the screen showing every sample numbered
+		// below samples
+		void frameShown(quint64 samples);
+
+		// Latency in milliseconds below which the given fraction of the
+		// recent samples lie, 0 without any measurements
+		qreal percentile(qreal fraction) const;
+		int measurements() const { return latencies.size(); }
+
+	private:
+
+		struct Pending
+		{
+				quint64 sequence;
+				qint64 eventTime;
+		};
+
+		enum { KeptMeasurements = 1024, MaxPending = 4096 };
+
+		// Events further from our clock than this come from another one
+		static const qint64 SameClockLimit = 10000;
+
+		static qint64 now();
+
+		QQueue<Pending> pending;
+		QVector<float> latencies;
+		int nextLatency;
+		qint64 clockOffset;
+		bool sameClock;
+		bool offsetKnown;
+};
+
+#endif // LATENCYMETER_H
@@ -0,0 +1,513 @@
+#include <QObject>
+#include <QReadLocker>
+#include <QWriteLocker>
+#include <QtMath>
+
+#include <cstring>
+
+#include "layerstack.h"
+#include "mippyramid.h"
+#include "parallelbands.h"
+
+LayerStack::Layer::Layer()
+	: id(0)
+	, opacity(1)
+	, blendMode(QPainter::CompositionMode_SourceOver)
+	, visible(true)
+{
+}
+
+LayerStack::LayerStack()
+	: current(0)
+	, nextId(1)
+	, minParallelPixels(256 * 256)
+	, cacheRatio(0)
+{
+	reset(QImage());
+}
+
+QSharedPointer<TiledSurface> LayerStack::newSurface(const QColor &fill) const
+{
+	QSharedPointer<TiledSurface> surface(new TiledSurface);
+	surface->setBackgroundColor(fill);
+	surface->resize(stackSize);
+	return surface;
+}
+
+void LayerStack::resize(const QSize &newSize)
+{
+	if (newSize == stackSize)
+		return;
+
+	// The caches keep what they hold, only the area that wasn't
+	// there before needs to be rendered
+	QRegion exposed = QRegion(QRect(QPoint(0, 0), newSize)) - QRect(QPoint(0, 0), stackSize);
+	stackSize = newSize;
+	for (const Layer &layer : layers) {
+		QWriteLocker locker(&layer.surface->lock());
+		layer.surface->resize(newSize);
+	}
+	staleBelow += exposed;
+	staleAbove += exposed;
+}
+
+// The paper is white wherever the background image doesn't reach,
+// the layers above it are transparent
+void LayerStack::reset(const QImage &paper)
+{
+	Layer paperLayer;
+	paperLayer.id = nextId++;
+	paperLayer.name = QObject::tr("Paper");
+	paperLayer.surface = newSurface(Qt::white);
+	paperLayer.surface->setBackground(paper);
+
+	Layer paintLayer;
+	paintLayer.id = nextId++;
+	paintLayer.name = QObject::tr("Layer 1");
+	paintLayer.surface = newSurface(Qt::transparent);
+
+	layers.clear();
+	layers << paperLayer << paintLayer;
+	current = 1;
+	invalidate();
+}
+
+void LayerStack::setLayers(const QVector<Layer> &newLayers, int currentLayer)
+{
+	if (newLayers.isEmpty())
+		return;
+
+	layers = newLayers;
+	for (Layer &layer : layers)
+		layer.id = nextId++;
+	current = qBound(0, currentLayer, layers.size() - 1);
+	stackSize = QSize();
+	resize(layers.first().surface->size());
+}
+
+void LayerStack::setCurrentIndex(int index)
+{
+	index = qBound(0, index, layers.size() - 1);
+	if (index == current)
+		return;
+	current = index;
+	invalidate();
+}
+
+int LayerStack::addLayer(const QString &name)
+{
+	Layer layer;
+	layer.id = nextId++;
+	layer.name = name;
+	layer.surface = newSurface(Qt::transparent);
+	layers.insert(++current, layer);
+	invalidate();
+	return current;
+}
+
+int LayerStack::indexOf(const QSharedPointer<TiledSurface> &surface) const
+{
+	for (int i = 0; i < layers.size(); ++i) {
+		if (layers.at(i).surface == surface)
+			return i;
+	}
+	return -1;
+}
+
+void LayerStack::removeLayer(int index)
+{
+	if (layers.size() <= 1 || index < 0 || index >= layers.size())
+		return;
+
+	layers.remove(index);
+	if (current > index || current == layers.size())
+		--current;
+	invalidate();
+}
+
+void LayerStack::moveLayer(int from, int to)
+{
+	if (from == to || from < 0 || to < 0 || from >= layers.size() || to >= layers.size())
+		return;
+
+	layers.move(from, to);
+	if (current == from)
+		current = to;
+	else if (from < current && to >= current)
+		--current;
+	else if (from > current && to <= current)
+		++current;
+	invalidate();
+}
+
+void LayerStack::setName(int index, const QString &name)
+{
+	layers[index].name = name;
+}
+
+// Changes to the current layer don't touch the caches
+void LayerStack::setOpacity(int index, qreal opacity)
+{
+	layers[index].opacity = qBound(qreal(0), opacity, qreal(1));
+	if (index != current)
+		invalidate();
+}
+
+void LayerStack::setBlendMode(int index, QPainter::CompositionMode mode)
+{
+	layers[index].blendMode = mode;
+	if (index != current)
+		invalidate();
+}
+
+void LayerStack::setVisible(int index, bool visible)
+{
+	layers[index].visible = visible;
+	if (index != current)
+		invalidate();
+}
+
+LayerStack LayerStack::snapshot() const
+{
+	LayerStack copy;
+	copy.stackSize = stackSize;
+	copy.layers = layers;
+	copy.current = current;
+	copy.nextId = nextId;
+	for (int i = 0; i < layers.size(); ++i) {
+		const TiledSurface &surface = *layers.at(i).surface;
+		QReadLocker locker(&surface.lock());
+		copy.layers[i].surface.reset(new TiledSurface(surface));
+	}
+	copy.invalidate();
+	return copy;
+}
+
+void LayerStack::composite(QImage &image, qreal ratio, const QPointF &origin, const QRegion &region,
+			   const QColor &background)
+{
+	collectDirtyTiles();
+	followView(image.size(), ratio, origin);
+	if (current > 0)
+		refreshCache(belowCache, staleBelow, region, 0, current);
+	bool cachedAbove = aboveIsCached();
+	if (cachedAbove)
+		refreshCache(aboveCache, staleAbove, region, current + 1, layers.size());
+
+	paintBands(image, ratio, origin, region, [&](QPainter &painter, QImage &, int, const QRect &rect) {
+		painter.setCompositionMode(QPainter::CompositionMode_SourceOver);
+		painter.fillRect(rect, background);
+		// The caches line up with the image, a supersampled band
+		// only repeats their pixels
+		bool smooth = painter.testRenderHint(QPainter::SmoothPixmapTransform);
+		auto drawCache = [&](const QImage &cache) {
+			painter.setRenderHint(QPainter::SmoothPixmapTransform, false);
+			painter.drawImage(QRectF(rect), cache,
+					  QRectF((QPointF(rect.topLeft()) - origin) * ratio, QSizeF(rect.size()) * ratio));
+			painter.setRenderHint(QPainter::SmoothPixmapTransform, smooth);
+		};
+		if (current > 0)
+			drawCache(belowCache);
+		renderLayer(painter, rect, layers.at(current));
+		if (cachedAbove)
+			drawCache(aboveCache);
+		else
+			renderLayers(painter, rect, current + 1, layers.size());
+	});
+}
+
+void LayerStack::flatten(QPainter &painter, const QRect &rect) const
+{
+	renderLayers(painter, rect, 0, layers.size());
+}
+
+QImage LayerStack::toImage() const
+{
+	QImage image(stackSize, QImage::Format_ARGB32_Premultiplied);
+	image.fill(Qt::transparent);
+	QPainter painter(&image);
+	flatten(painter, image.rect());
+	painter.end();
+	return image;
+}
+
+void LayerStack::invalidate(const QRect &rect)
+{
+	staleBelow += rect;
+	staleAbove += rect;
+}
+
+void LayerStack::invalidate()
+{
+	invalidate(QRect(QPoint(0, 0), stackSize));
+}
+
+void LayerStack::renderLayers(QPainter &painter, const QRect &rect, int first, int last) const
+{
+	for (int i = first; i < last; ++i)
+		renderLayer(painter, rect, layers.at(i));
+}
+
+void LayerStack::renderLayer(QPainter &painter, const QRect &rect, const Layer &layer) const
+{
+	if (!layer.visible || layer.opacity <= 0)
+		return;
+
+	painter.save();
+	painter.setOpacity(layer.opacity);
+	painter.setCompositionMode(layer.blendMode);
+	{
+		QReadLocker locker(&layer.surface->lock());
+		layer.surface->render(painter, rect);
+	}
+	painter.restore();
+}
+
+// Layers in one of the modes there are kernels for are blended into
+// target without a painter. Returns false for the other modes
+bool LayerStack::blendLayer(QImage &target, const QPoint &offset, const QRect &rect, const Layer &layer) const
+{
+	BlendKernels::Mode mode;
+	switch (layer.blendMode) {
+		case QPainter::CompositionMode_SourceOver:
+			mode = BlendKernels::Normal;
+			break;
+		case QPainter::CompositionMode_Multiply:
+			mode = BlendKernels::Multiply;
+			break;
+		case QPainter::CompositionMode_Screen:
+			mode = BlendKernels::Screen;
+			break;
+		default:
+			return false;
+	}
+	if (!layer.visible || layer.opacity <= 0)
+		return true;
+
+	QReadLocker locker(&layer.surface->lock());
+	layer.surface->blend(target, offset, rect, mode, quint32(qRound(qMin(layer.opacity, 1.0) * 255)));
+	return true;
+}
+
+// Normal layers can be composited on their own first and put over
+// the rest afterwards, other blend modes have to see what is below
+bool LayerStack::aboveIsCached() const
+{
+	bool any = false;
+	for (int i = current + 1; i < layers.size(); ++i) {
+		const Layer &layer = layers.at(i);
+		if (!layer.visible)
+			continue;
+		if (layer.blendMode != QPainter::CompositionMode_SourceOver)
+			return false;
+		any = true;
+	}
+	return any;
+}
+
+// Whatever happened to the tiles of the layers other than the current
+// one since the last frame is redrawn. That is the GUI thread, or a
+// stroke that was still down when its layer stopped being current
+void LayerStack::collectDirtyTiles()
+{
+	for (int i = 0; i < layers.size(); ++i) {
+		if (i == current)
+			continue;
+		TiledSurface &surface = *layers.at(i).surface;
+		QRegion dirty;
+		{
+			QWriteLocker locker(&surface.lock());
+			dirty = surface.dirtyRegion();
+			surface.clearDirty();
+		}
+		if (i < current)
+			staleBelow += dirty;
+		else
+			staleAbove += dirty;
+	}
+}
+
+// Panned by whole pixels the caches move along and only what came into
+// view is redrawn, anything else redraws all of them. What is out of
+// view is forgotten, it is redrawn once it comes back
+void LayerStack::followView(const QSize &size, qreal ratio, const QPointF &origin)
+{
+	QRect view = fromImage(QRect(QPoint(0, 0), size), ratio, origin);
+	if (size != cacheSize || ratio != cacheRatio || origin != cacheOrigin) {
+		QPointF shift = (cacheOrigin - origin) * ratio;
+		QPoint delta = shift.toPoint();
+		if (size == cacheSize && ratio == cacheRatio
+		    && qFuzzyCompare(shift.x() + 1, delta.x() + 1) && qFuzzyCompare(shift.y() + 1, delta.y() + 1)) {
+			scrollImage(belowCache, delta);
+			scrollImage(aboveCache, delta);
+			QRect pixels(QPoint(0, 0), size);
+			for (const QRect &rect : QRegion(pixels) - pixels.translated(delta)) {
+				staleBelow += fromImage(rect, ratio, origin);
+				staleAbove += fromImage(rect, ratio, origin);
+			}
+		} else {
+			if (size != cacheSize) {
+				belowCache = QImage();
+				aboveCache = QImage();
+			}
+			staleBelow = view;
+			staleAbove = view;
+		}
+		cacheSize = size;
+		cacheRatio = ratio;
+		cacheOrigin = origin;
+	}
+	staleBelow &= view;
+	staleAbove &= view;
+}
+
+// Only allocated once it is used, the stack may have nothing above the
+// current layer
+void LayerStack::refreshCache(QImage &cache, QRegion &stale, const QRegion &region, int first, int last) const
+{
+	if (cache.size() != cacheSize) {
+		cache = QImage(cacheSize, QImage::Format_ARGB32_Premultiplied);
+		stale = fromImage(cache.rect(), cacheRatio, cacheOrigin);
+	}
+	QRegion part = stale & region;
+	if (part.isEmpty())
+		return;
+
+	// At ratio 1 and a whole pixel origin the band painters only move
+	// the rows up, so the layers can be blended straight into their bands
+	bool aligned = cacheRatio == 1 && cacheOrigin == QPointF(cacheOrigin.toPoint());
+	QPoint shift = -cacheOrigin.toPoint();
+	paintBands(cache, cacheRatio, cacheOrigin, part, [&](QPainter &painter, QImage &band, int top, const QRect &area) {
+		painter.setCompositionMode(QPainter::CompositionMode_Source);
+		painter.fillRect(area, Qt::transparent);
+		QPoint offset = shift - QPoint(0, top);
+		for (int i = first; i < last; ++i) {
+			if (!aligned || !blendLayer(band, offset, area, layers.at(i)))
+				renderLayer(painter, area, layers.at(i));
+		}
+	});
+	stale -= part;
+}
+
+QRect LayerStack::toImage(const QRect &rect, qreal ratio, const QPointF &origin)
+{
+	return QRectF((QPointF(rect.topLeft()) - origin) * ratio, QSizeF(rect.size()) * ratio).toAlignedRect();
+}
+
+QRect LayerStack::fromImage(const QRect &rect, qreal ratio, const QPointF &origin)
+{
+	return QRectF(origin + QPointF(rect.topLeft()) / ratio, QSizeF(rect.size()) / ratio).toAlignedRect();
+}
+
+void LayerStack::scrollImage(QImage &image, const QPoint &delta)
+{
+	QRect kept = image.rect() & image.rect().translated(delta);
+	if (kept.isEmpty() || delta.isNull())
+		return;
+
+	int bytesPerLine = image.bytesPerLine();
+	int depth = image.depth() / 8;
+	uchar *bits = image.bits();
+	auto moveRow = [&](int y) {
+		memmove(bits + qsizetype(y) * bytesPerLine + kept.left() * depth,
+			bits + qsizetype(y - delta.y()) * bytesPerLine + (kept.left() - delta.x()) * depth,
+			size_t(kept.width()) * depth);
+	};
+	// Rows are copied in the order that doesn't overwrite the ones
+	// still to be moved
+	if (delta.y() > 0) {
+		for (int y = kept.bottom(); y >= kept.top(); --y)
+			moveRow(y);
+	} else {
+		for (int y = kept.top(); y <= kept.bottom(); ++y)
+			moveRow(y);
+	}
+}
+
+// The image is painted through QImages of its own over ranges of its
+// pixel rows, a large region is split into bands of rows painted on the
+// thread pool. Only the surfaces are shared between the bands and those
+// are read under their read locks. Every image pixel the region touches
+// is painted whole, the painter is clipped to them. Paint gets a painter
+// mapping stack pixels into the band, the band itself and the image row
+// it starts at. Zoomed far out the band is a scratch image at a multiple
+// of the ratio, only at ratio 1 is it a slice of image
+void LayerStack::paintBands(QImage &image, qreal ratio, const QPointF &origin, const QRegion &region,
+			    const std::function<void(QPainter &, QImage &, int, const QRect &)> &paint) const
+{
+	QVector<QRect> pixels;
+	QRect bounds;
+	qint64 count = 0;
+	for (const QRect &rect : region) {
+		QRect part = toImage(rect, ratio, origin) & image.rect();
+		if (part.isEmpty())
+			continue;
+		pixels.append(part);
+		bounds |= part;
+		count += qint64(part.width()) * part.height();
+	}
+	if (pixels.isEmpty())
+		return;
+
+	// Drawn any smaller the tiles would be point sampled, each level
+	// doubles the samples per pixel in both directions
+	int levels = 0;
+	while (levels < MaxSupersampleLevels && ratio * (1 << levels) < 0.5)
+		++levels;
+	int scale = 1 << levels;
+
+	// Fills target with the pixels of area, target having scale
+	// pixels to each of them
+	auto paintArea = [&](QImage &target, int top, const QRect &area, const QRect &clip) {
+		QPainter painter(&target);
+		painter.setClipRect(QRect((clip.topLeft() - area.topLeft()) * scale, clip.size() * scale));
+		painter.setRenderHint(QPainter::SmoothPixmapTransform, ratio * scale < 1);
+		QPointF shift = origin * ratio + QPointF(area.topLeft());
+		painter.setTransform(QTransform(ratio * scale, 0, 0, ratio * scale,
+						-shift.x() * scale, -shift.y() * scale));
+		paint(painter, target, top, fromImage(clip, ratio, origin));
+	};
+
+	uchar *bits = image.bits();
+	int bytesPerLine = image.bytesPerLine();
+	auto paintRows = [&](int first, int last) {
+		if (scale == 1) {
+			QImage band(bits + qsizetype(first) * bytesPerLine, image.width(), last - first,
+				    bytesPerLine, image.format());
+			QRect area(0, first, image.width(), last - first);
+			for (const QRect &part : qAsConst(pixels)) {
+				QRect clip = part & area;
+				if (!clip.isEmpty())
+					paintArea(band, first, area, clip);
+			}
+			return;
+		}
+
+		// A few rows of a rect at a time, painted big and halved
+		// until they fit into image
+		for (const QRect &part : qAsConst(pixels)) {
+			QRect rows = part & QRect(bounds.left(), first, bounds.width(), last - first);
+			if (rows.isEmpty())
+				continue;
+			int step = qMax(1, int(MaxScratchPixels / (qint64(rows.width()) * scale * scale)));
+			for (int top = rows.top(); top <= rows.bottom(); top += step) {
+				QRect area(rows.left(), top, rows.width(), qMin(step, rows.bottom() + 1 - top));
+				QImage scratch(area.size() * scale, QImage::Format_ARGB32_Premultiplied);
+				paintArea(scratch, top, area, area);
+				for (int level = levels - 1; level > 0; --level) {
+					QImage half(area.size() * (1 << level), QImage::Format_ARGB32_Premultiplied);
+					MipPyramid::downsample(scratch, half, half.rect());
+					scratch = half;
+				}
+				QImage target(bits + qsizetype(top) * bytesPerLine + area.left() * 4,
+					      area.width(), area.height(), bytesPerLine, image.format());
+				MipPyramid::downsample(scratch, target, target.rect());
+			}
+		}
+	};
+
+	if (count * scale * scale <= minParallelPixels)
+		paintRows(bounds.top(), bounds.bottom() + 1);
+	else
+		ParallelBands::forEach(bounds.top(), bounds.bottom() + 1, paintRows);
+}
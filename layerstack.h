@@ -0,0 +1,150 @@
+#ifndef LAYERSTACK_H
+#define LAYERSTACK_H
+
+#include <QImage>
+#include <QPainter>
+#include <QPointF>
+#include <QRect>
+#include <QRegion>
+#include <QSharedPointer>
+#include <QSize>
+#include <QString>
+#include <QVector>
+
+#include <functional>
+
+#include "tiledsurface.h"
+
+// The paper at the bottom and the paint layers above it, each of them
+// a tiled surface of its own. New strokes go onto the current layer,
+// one still down when another layer is made current stays on its own.
+// Everything below it and everything above it is kept composited in
+// two cached images, so a frame blends three layers however many
+// there are. The caches only hold what the last composited image
+// showed, at its size and ratio. They are redrawn where another
+// layer's tiles went dirty, where the view moved onto, or everywhere
+// once the layers themselves or the ratio change
+class LayerStack
+{
+	public:
+
+		struct Layer
+		{
+				Layer();
+
+				// Stays the same while the layer is moved around
+				int id;
+				QString name;
+				QSharedPointer<TiledSurface> surface;
+				qreal opacity;
+				QPainter::CompositionMode blendMode;
+				bool visible;
+		};
+
+		LayerStack();
+
+		QSize size() const { return stackSize; }
+		void resize(const QSize &newSize);
+
+		// Replaces every layer with paper showing the background and
+		// a single empty layer to paint on
+		void reset(const QImage &paper);
+
+		// Replaces every layer, such as with the ones of a project.
+		// The layers are given new ids
+		void setLayers(const QVector<Layer> &newLayers, int currentLayer);
+
+		int count() const { return layers.size(); }
+		const Layer &layer(int index) const { return layers.at(index); }
+
+		// Index of the layer painted on surface, -1 once it is gone
+		int indexOf(const QSharedPointer<TiledSurface> &surface) const;
+
+		int currentIndex() const { return current; }
+		void setCurrentIndex(int index);
+		const QSharedPointer<TiledSurface> &currentSurface() const { return layers.at(current).surface; }
+
+		// A new empty layer above the current one, it becomes current
+		int addLayer(const QString &name);
+
+		// The last layer is never removed
+		void removeLayer(int index);
+		void moveLayer(int from, int to);
+
+		void setName(int index, const QString &name);
+		void setOpacity(int index, qreal opacity);
+		void setBlendMode(int index, QPainter::CompositionMode mode);
+		void setVisible(int index, bool visible);
+
+		// Copy whose layers share every tile with these ones, each
+		// layer is locked for reading while it is copied
+		LayerStack snapshot() const;
+
+		// Fills the pixels of image covering region with background and
+		// draws every layer over them. The image has ratio pixels to each
+		// pixel of the stack and its top left corner shows the stack at
+		// origin, such as a view onto part of it. Uses the caches, the
+		// current layer is read under its lock
+		void composite(QImage &image, qreal ratio, const QPointF &origin, const QRegion &region,
+				   const QColor &background);
+
+		// Where rect of the stack lands on an image composited at ratio
+		// from origin and back, both taking every pixel they touch
+		static QRect toImage(const QRect &rect, qreal ratio, const QPointF &origin);
+		static QRect fromImage(const QRect &rect, qreal ratio, const QPointF &origin);
+
+		// Moves the pixels of image by delta, the ones it uncovers keep
+		// whatever they held
+		static void scrollImage(QImage &image, const QPoint &delta);
+
+		// Regions of more pixels than this are composited in bands on
+		// the global thread pool, smaller ones on the calling thread
+		void setParallelThreshold(int pixels) { minParallelPixels = pixels; }
+		int parallelThreshold() const { return minParallelPixels; }
+
+		// Same without the caches, for a stack nobody paints on any
+		// more such as a snapshot. Every layer is locked while it is read
+		void flatten(QPainter &painter, const QRect &rect) const;
+		QImage toImage() const;
+
+		// Redraws the caches inside rect on the next composite
+		void invalidate(const QRect &rect);
+		void invalidate();
+
+	private:
+
+		// Zoomed out further than half a stack pixel per image pixel,
+		// bands are painted at up to 8 times the ratio and box filtered
+		// down in scratch images of at most MaxScratchPixels
+		enum { MaxSupersampleLevels = 3, MaxScratchPixels = 256 * 256 };
+
+		void renderLayers(QPainter &painter, const QRect &rect, int first, int last) const;
+		void renderLayer(QPainter &painter, const QRect &rect, const Layer &layer) const;
+		bool blendLayer(QImage &target, const QPoint &offset, const QRect &rect, const Layer &layer) const;
+		bool aboveIsCached() const;
+		void collectDirtyTiles();
+		void followView(const QSize &size, qreal ratio, const QPointF &origin);
+		void refreshCache(QImage &cache, QRegion &stale, const QRegion &region, int first, int last) const;
+		void paintBands(QImage &image, qreal ratio, const QPointF &origin, const QRegion &region,
+				    const std::function<void(QPainter &, QImage &, int, const QRect &)> &paint) const;
+		QSharedPointer<TiledSurface> newSurface(const QColor &fill) const;
+
+		QSize stackSize;
+		QVector<Layer> layers;
+		int current;
+		int nextId;
+		int minParallelPixels;
+
+		// Layers below and above the current one composited over
+		// transparent pixels like the last image, with the parts of
+		// the stack still to be redrawn
+		QImage belowCache;
+		QImage aboveCache;
+		QRegion staleBelow;
+		QRegion staleAbove;
+		QSize cacheSize;
+		qreal cacheRatio;
+		QPointF cacheOrigin;
+};
+
+#endif // LAYERSTACK_H
@@ -1,14 +1,36 @@
 #include "mainwindow.h"
 #include <QApplication>
+#include <QGuiApplication>
+#include <QTextStream>
+#include <batchrenderer.h>
 #include <scribblearea.h>
 #include <ebruapplication.h>
 
+// Renders the files given with --render and quits, no window is
+// shown and no display is needed
+static int renderBatch(int argc, char *argv[])
+{
+    if (qEnvironmentVariableIsEmpty("QT_QPA_PLATFORM"))
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+    QGuiApplication app(argc, argv);
+
+    BatchRenderer renderer;
+    QString error;
+    if (!renderer.parse(app.arguments(), &error)) {
+        QTextStream(stderr) << error << Qt::endl;
+        return 2;
+    }
+    return renderer.run();
+}
+
 int main(int argc, char *argv[])
 {
+    if (BatchRenderer::isRequested(argc, argv))
+        return renderBatch(argc, argv);
+
     EbruApplication app(argc, argv);
-    ScribbleArea* canvas = new ScribbleArea();
-    app.setCanvas(canvas);
     MainWindow w;
+    app.setCanvas(w.canvas());
     w.resize(500, 500);
     w.show();
 
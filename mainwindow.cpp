@@ -1,13 +1,20 @@
 #include <QtWidgets>
 
 #include "mainwindow.h"
+#include "profiler.h"
 #include "scribblearea.h"
 
 // MainWindow constructor
 MainWindow::MainWindow()
 	:
 	  myCanvas(nullptr),
-	  colorDialog(nullptr)
+	  colorDialog(nullptr),
+	  saveProgress(nullptr),
+	  latencyLabel(nullptr),
+	  currentLayerMenu(nullptr),
+	  currentLayerGroup(nullptr),
+	  blendModeGroup(nullptr),
+	  layerVisibleAction(nullptr)
 {
 	// Create the ScribbleArea widget and make it
 	// the central widget
@@ -16,6 +23,22 @@ MainWindow::MainWindow()
 
 	createMenus();
 
+	// Saves run in the background and report back here
+	saveProgress = new QProgressBar;
+	saveProgress->setRange(0, 100);
+	saveProgress->setMaximumWidth(160);
+	saveProgress->hide();
+	statusBar()->addPermanentWidget(saveProgress);
+	connect(myCanvas, &ScribbleArea::saveProgress, saveProgress, &QProgressBar::setValue);
+	connect(myCanvas, &ScribbleArea::saveFinished, this, &MainWindow::saveFinished);
+	connect(myCanvas, &ScribbleArea::saveFailed, this, &MainWindow::saveFailed);
+
+	latencyLabel = new QLabel;
+	statusBar()->addPermanentWidget(latencyLabel);
+	QTimer *latencyTimer = new QTimer(this);
+	connect(latencyTimer, &QTimer::timeout, this, &MainWindow::updateLatency);
+	latencyTimer->start(1000);
+
 	// Set the title
 	setWindowTitle(tr("Ebru by Beren Kusmenoglu"));
 	QCoreApplication::setAttribute(Qt::AA_CompressHighFrequencyEvents);
@@ -39,11 +62,115 @@ void MainWindow::createMenus()
 	QMenu *fileMenu = menuBar()->addMenu(tr("&File"));
 	   fileMenu->addAction(tr("&Open..."), this, &MainWindow::load, QKeySequence::Open);
 	   fileMenu->addAction(tr("&Save As..."), this, &MainWindow::save, QKeySequence::SaveAs);
+	   fileMenu->addAction(tr("&Export at Scale..."), this, &MainWindow::exportScaled);
+	   fileMenu->addAction(tr("&Print..."), myCanvas, &ScribbleArea::print, QKeySequence::Print);
 	   fileMenu->addAction(tr("&New"), this, &MainWindow::clear, QKeySequence::New);
 	   fileMenu->addAction(tr("E&xit"), this, &MainWindow::close, QKeySequence::Quit);
 
+	   QMenu *editMenu = menuBar()->addMenu(tr("&Edit"));
+	   QAction *undoAction = editMenu->addAction(tr("&Undo"), myCanvas, &ScribbleArea::undo, QKeySequence::Undo);
+	   undoAction->setEnabled(myCanvas->canUndo());
+	   connect(myCanvas, &ScribbleArea::canUndoChanged, undoAction, &QAction::setEnabled);
+	   QAction *redoAction = editMenu->addAction(tr("&Redo"), myCanvas, &ScribbleArea::redo, QKeySequence::Redo);
+	   redoAction->setEnabled(myCanvas->canRedo());
+	   connect(myCanvas, &ScribbleArea::canRedoChanged, redoAction, &QAction::setEnabled);
+	   editMenu->addSeparator();
+	   editMenu->addAction(tr("History &Memory..."), this, &MainWindow::setUndoMemoryLimit);
+
 	   QMenu *brushMenu = menuBar()->addMenu(tr("&Brush"));
 	   brushMenu->addAction(tr("&Brush Color..."), this, &MainWindow::setBrushColor, tr("Ctrl+B"));
+	   brushMenu->addAction(tr("Dab &Spacing..."), this, &MainWindow::setBrushSpacing);
+
+	   QMenu *marblingMenu = menuBar()->addMenu(tr("&Marbling"));
+	   QAction *bathAction = marblingMenu->addAction(tr("Marbling &Bath"));
+	   bathAction->setShortcut(tr("Ctrl+M"));
+	   bathAction->setCheckable(true);
+	   connect(bathAction, &QAction::toggled, myCanvas, &ScribbleArea::setMarbling);
+	   connect(myCanvas, &ScribbleArea::marblingChanged, bathAction, &QAction::setChecked);
+
+	   QMenu *resolutionMenu = marblingMenu->addMenu(tr("Simulation &Resolution"));
+	   QActionGroup *resolutionGroup = new QActionGroup(this);
+	   const QList<QPair<QString, int> > resolutions = QList<QPair<QString, int> >()
+			   << qMakePair(tr("&High (2 px cells)"), 2)
+			   << qMakePair(tr("&Medium (4 px cells)"), 4)
+			   << qMakePair(tr("&Low (8 px cells)"), 8);
+	   for (const QPair<QString, int> &resolution : resolutions) {
+		   QAction *action = resolutionMenu->addAction(resolution.first);
+		   action->setData(resolution.second);
+		   action->setCheckable(true);
+		   action->setChecked(resolution.second == myCanvas->marblingCellSize());
+		   resolutionGroup->addAction(action);
+	   }
+	   connect(resolutionGroup, &QActionGroup::triggered, this, &MainWindow::setMarblingResolution);
+
+	   marblingMenu->addSeparator();
+	   QActionGroup *toolGroup = new QActionGroup(this);
+	   const QList<QPair<QString, int> > tools = QList<QPair<QString, int> >()
+			   << qMakePair(tr("B&rush"), int(ScribbleArea::BrushTool))
+			   << qMakePair(tr("&Ink Drop"), int(ScribbleArea::InkDropTool))
+			   << qMakePair(tr("&Tine"), int(ScribbleArea::TineTool))
+			   << qMakePair(tr("&Comb"), int(ScribbleArea::CombTool));
+	   for (const QPair<QString, int> &tool : tools) {
+		   QAction *action = marblingMenu->addAction(tool.first);
+		   action->setData(tool.second);
+		   action->setCheckable(true);
+		   action->setChecked(tool.second == myCanvas->getMarblingTool());
+		   toolGroup->addAction(action);
+	   }
+	   connect(toolGroup, &QActionGroup::triggered, this, &MainWindow::setMarblingTool);
+	   marblingMenu->addSeparator();
+	   marblingMenu->addAction(tr("Ink Drop Si&ze..."), this, &MainWindow::setInkDropRadius);
+	   marblingMenu->addAction(tr("Tine &Sharpness..."), this, &MainWindow::setTineSharpness);
+	   marblingMenu->addAction(tr("Comb S&pacing..."), this, &MainWindow::setCombSpacing);
+
+	   QMenu *layerMenu = menuBar()->addMenu(tr("&Layers"));
+	   layerMenu->addAction(tr("&New Layer"), myCanvas, &ScribbleArea::addLayer, tr("Ctrl+Shift+N"));
+	   layerMenu->addAction(tr("&Delete Layer"), myCanvas, &ScribbleArea::removeLayer);
+	   layerMenu->addAction(tr("&Raise Layer"), myCanvas, &ScribbleArea::raiseLayer, tr("Ctrl+]"));
+	   layerMenu->addAction(tr("&Lower Layer"), myCanvas, &ScribbleArea::lowerLayer, tr("Ctrl+["));
+	   layerMenu->addSeparator();
+	   currentLayerMenu = layerMenu->addMenu(tr("&Current Layer"));
+	   currentLayerGroup = new QActionGroup(this);
+	   connect(currentLayerGroup, &QActionGroup::triggered, this, &MainWindow::setCurrentLayer);
+	   layerMenu->addAction(tr("Layer &Opacity..."), this, &MainWindow::setLayerOpacity);
+
+	   QMenu *blendModeMenu = layerMenu->addMenu(tr("&Blend Mode"));
+	   blendModeGroup = new QActionGroup(this);
+	   const QList<QPair<QString, QPainter::CompositionMode> > blendModes = QList<QPair<QString, QPainter::CompositionMode> >()
+			   << qMakePair(tr("&Normal"), QPainter::CompositionMode_SourceOver)
+			   << qMakePair(tr("&Multiply"), QPainter::CompositionMode_Multiply)
+			   << qMakePair(tr("&Screen"), QPainter::CompositionMode_Screen)
+			   << qMakePair(tr("&Overlay"), QPainter::CompositionMode_Overlay)
+			   << qMakePair(tr("&Darken"), QPainter::CompositionMode_Darken)
+			   << qMakePair(tr("&Lighten"), QPainter::CompositionMode_Lighten)
+			   << qMakePair(tr("Color D&odge"), QPainter::CompositionMode_ColorDodge)
+			   << qMakePair(tr("Color &Burn"), QPainter::CompositionMode_ColorBurn)
+			   << qMakePair(tr("&Hard Light"), QPainter::CompositionMode_HardLight)
+			   << qMakePair(tr("So&ft Light"), QPainter::CompositionMode_SoftLight)
+			   << qMakePair(tr("D&ifference"), QPainter::CompositionMode_Difference)
+			   << qMakePair(tr("&Exclusion"), QPainter::CompositionMode_Exclusion);
+	   for (const QPair<QString, QPainter::CompositionMode> &blendMode : blendModes) {
+		   QAction *action = blendModeMenu->addAction(blendMode.first);
+		   action->setData(int(blendMode.second));
+		   action->setCheckable(true);
+		   blendModeGroup->addAction(action);
+	   }
+	   connect(blendModeGroup, &QActionGroup::triggered, this, &MainWindow::setLayerBlendMode);
+
+	   // Triggered rather than toggled, the menu is updated to show
+	   // each layer that becomes current
+	   layerVisibleAction = layerMenu->addAction(tr("&Visible"));
+	   layerVisibleAction->setCheckable(true);
+	   connect(layerVisibleAction, &QAction::triggered, myCanvas, &ScribbleArea::setLayerVisible);
+	   connect(myCanvas, &ScribbleArea::layersChanged, this, &MainWindow::updateLayerMenu);
+	   updateLayerMenu();
+
+	   // The middle button and the wheel pan, Ctrl and the wheel zoom
+	   QMenu *viewMenu = menuBar()->addMenu(tr("&View"));
+	   viewMenu->addAction(tr("Zoom &In"), myCanvas, &ScribbleArea::zoomIn, QKeySequence::ZoomIn);
+	   viewMenu->addAction(tr("Zoom &Out"), myCanvas, &ScribbleArea::zoomOut, QKeySequence::ZoomOut);
+	   viewMenu->addAction(tr("&Actual Size"), myCanvas, &ScribbleArea::resetZoom, tr("Ctrl+0"));
+	   viewMenu->addAction(tr("&Fit Canvas"), myCanvas, &ScribbleArea::zoomToFit, tr("Ctrl+9"));
 
 	   QMenu *tabletMenu = menuBar()->addMenu(tr("&Tablet"));
 	   QMenu *lineWidthMenu = tabletMenu->addMenu(tr("&Line Width"));
@@ -125,6 +252,33 @@ void MainWindow::createMenus()
 	   compressAction->setCheckable(true);
 	   connect(compressAction, &QAction::toggled, this, &MainWindow::setEventCompression);
 
+	   QAction *predictAction = tabletMenu->addAction(tr("&Predict strokes"));
+	   predictAction->setCheckable(true);
+	   connect(predictAction, &QAction::toggled, myCanvas, &ScribbleArea::setStrokePrediction);
+
+	   tabletMenu->addSeparator();
+	   QAction *recordAction = tabletMenu->addAction(tr("&Record Strokes..."));
+	   recordAction->setCheckable(true);
+	   connect(recordAction, &QAction::toggled, this, &MainWindow::recordStrokes);
+	   tabletMenu->addAction(tr("R&eplay Strokes..."), this, &MainWindow::replayStrokes);
+	   tabletMenu->addAction(tr("Replay Strokes &Fast..."), this, &MainWindow::replayStrokesFast);
+
+	   // Timings of input, rasterizing, compositing and painting
+	   QMenu *profileMenu = menuBar()->addMenu(tr("&Profile"));
+	   QAction *profileAction = profileMenu->addAction(tr("&Record Timings"));
+	   profileAction->setCheckable(true);
+	   connect(profileAction, &QAction::toggled, this, &MainWindow::setProfiling);
+	   QAction *overlayAction = profileMenu->addAction(tr("Show &Overlay"));
+	   overlayAction->setCheckable(true);
+	   connect(overlayAction, &QAction::toggled, myCanvas, &ScribbleArea::setProfilerOverlay);
+	   // The overlay has little to show without timings
+	   connect(overlayAction, &QAction::toggled, profileAction, [profileAction](bool show) {
+		   if (show)
+			   profileAction->setChecked(true);
+	   });
+	   profileMenu->addAction(tr("&Clear Timings"), this, &MainWindow::clearProfile);
+	   profileMenu->addAction(tr("&Export Timings..."), this, &MainWindow::exportProfile);
+
 	   QMenu *helpMenu = menuBar()->addMenu("&Help");
 	   helpMenu->addAction(tr("A&bout"), this, &MainWindow::about);
 	   helpMenu->addAction(tr("About &Qt"), qApp, &QApplication::aboutQt);
@@ -153,6 +307,100 @@ void MainWindow::setEventCompression(bool compress)
     QCoreApplication::setAttribute(Qt::AA_CompressTabletEvents, compress);
 }
 
+// Refreshed once a second, blank until a tablet has been used
+void MainWindow::updateLatency()
+{
+	if (myCanvas->inputLatencyMeasurements() == 0)
+		return;
+	QString text = tr("Latency p50 %1 ms, p99 %2 ms")
+			   .arg(myCanvas->inputLatency(0.5), 0, 'f', 1)
+			   .arg(myCanvas->inputLatency(0.99), 0, 'f', 1);
+	if (myCanvas->getStrokePrediction())
+		text += tr(", predicting %1 ms").arg(myCanvas->predictionHorizon(), 0, 'f', 0);
+	latencyLabel->setText(text);
+}
+
+void MainWindow::setProfiling(bool profile)
+{
+	Profiler::setEnabled(profile);
+}
+
+void MainWindow::clearProfile()
+{
+	Profiler::clear();
+}
+
+// Chrome trace JSON unless a .csv file is picked
+void MainWindow::exportProfile()
+{
+	QString selectedFilter;
+	QString fileName = QFileDialog::getSaveFileName(this, tr("Export Timings"),
+							QDir::currentPath() + "/ebru-trace.json",
+							tr("Chrome Trace (*.json);;CSV (*.csv)"),
+							&selectedFilter);
+	if (fileName.isEmpty())
+		return;
+
+	QString error;
+	bool csv = fileName.endsWith(".csv", Qt::CaseInsensitive)
+		   || (!fileName.endsWith(".json", Qt::CaseInsensitive) && selectedFilter.contains("*.csv"));
+	bool written = csv ? Profiler::writeCsv(fileName, &error)
+			   : Profiler::writeChromeTrace(fileName, &error);
+	if (written)
+		statusBar()->showMessage(tr("Exported timings to %1").arg(QDir::toNativeSeparators(fileName)), 5000);
+	else
+		statusBar()->showMessage(tr("Could not export timings to %1: %2")
+						 .arg(QDir::toNativeSeparators(fileName), error));
+}
+
+// Logs every sample from now until the action is unchecked
+void MainWindow::recordStrokes(bool record)
+{
+	if (!record) {
+		myCanvas->stopRecording();
+		statusBar()->showMessage(tr("Stopped recording strokes"), 5000);
+		return;
+	}
+
+	QAction *action = qobject_cast<QAction *>(sender());
+	QString fileName = QFileDialog::getSaveFileName(this, tr("Record Strokes"),
+									QDir::currentPath() + "/strokes.ebrl",
+									tr("Stroke logs (*.ebrl)"));
+	QString error;
+	if (fileName.isEmpty() || !myCanvas->startRecording(fileName, &error)) {
+		if (!fileName.isEmpty())
+			statusBar()->showMessage(tr("Could not record to %1: %2")
+							 .arg(QDir::toNativeSeparators(fileName), error));
+		QSignalBlocker blocker(action);
+		action->setChecked(false);
+		return;
+	}
+	statusBar()->showMessage(tr("Recording strokes to %1").arg(QDir::toNativeSeparators(fileName)));
+}
+
+void MainWindow::replayStrokes()
+{
+	replay(true);
+}
+
+void MainWindow::replayStrokesFast()
+{
+	replay(false);
+}
+
+void MainWindow::replay(bool realTime)
+{
+	QString fileName = QFileDialog::getOpenFileName(this, tr("Replay Strokes"), QDir::currentPath(),
+									tr("Stroke logs (*.ebrl)"));
+	if (fileName.isEmpty())
+		return;
+
+	QString error;
+	if (!myCanvas->replayStrokes(fileName, realTime, &error))
+		statusBar()->showMessage(tr("Could not replay %1: %2")
+						 .arg(QDir::toNativeSeparators(fileName), error));
+}
+
 void MainWindow::setBrushColor()
 {
 	if (!colorDialog) {
@@ -164,26 +412,173 @@ void MainWindow::setBrushColor()
 	colorDialog->setVisible(true);
 }
 
+// Ask for the gap between brush dabs in percent of the dab size
+void MainWindow::setBrushSpacing()
+{
+	bool ok;
+	int spacing = QInputDialog::getInt(this, tr("Dab Spacing"), tr("Spacing (% of the dab size):"),
+						     qRound(myCanvas->getBrushSpacing() * 100), 1, 200, 1, &ok);
+	if (ok)
+		myCanvas->setBrushSpacing(spacing / 100.0);
+}
+
+void MainWindow::setMarblingResolution(QAction *action)
+{
+	myCanvas->setMarblingCellSize(action->data().toInt());
+}
+
+void MainWindow::setMarblingTool(QAction *action)
+{
+	myCanvas->setMarblingTool(ScribbleArea::MarblingTool(action->data().toInt()));
+}
+
+void MainWindow::setCurrentLayer(QAction *action)
+{
+	myCanvas->setCurrentLayer(action->data().toInt());
+}
+
+void MainWindow::setLayerOpacity()
+{
+	const LayerStack &layers = myCanvas->layerStack();
+	bool ok;
+	int opacity = QInputDialog::getInt(this, tr("Layer Opacity"), tr("Opacity (%):"),
+						     qRound(layers.layer(layers.currentIndex()).opacity * 100), 0, 100, 1, &ok);
+	if (ok)
+		myCanvas->setLayerOpacity(opacity / 100.0);
+}
+
+void MainWindow::setLayerBlendMode(QAction *action)
+{
+	myCanvas->setLayerBlendMode(QPainter::CompositionMode(action->data().toInt()));
+}
+
+// Lists the layers top down, the way they are stacked
+void MainWindow::updateLayerMenu()
+{
+	const LayerStack &layers = myCanvas->layerStack();
+	// This runs from the triggered signal of one of these actions,
+	// so they are only deleted once control is back in the event loop
+	for (QAction *action : currentLayerGroup->actions()) {
+		currentLayerGroup->removeAction(action);
+		currentLayerMenu->removeAction(action);
+		action->deleteLater();
+	}
+	for (int i = layers.count() - 1; i >= 0; --i) {
+		const LayerStack::Layer &layer = layers.layer(i);
+		QString text = layer.visible ? layer.name : tr("%1 (hidden)").arg(layer.name);
+		QAction *action = currentLayerMenu->addAction(text);
+		action->setData(i);
+		action->setCheckable(true);
+		action->setChecked(i == layers.currentIndex());
+		currentLayerGroup->addAction(action);
+	}
+
+	const LayerStack::Layer &current = layers.layer(layers.currentIndex());
+	for (QAction *action : blendModeGroup->actions())
+		action->setChecked(action->data().toInt() == int(current.blendMode));
+	layerVisibleAction->setChecked(current.visible);
+}
+
+void MainWindow::setInkDropRadius()
+{
+	bool ok;
+	int radius = QInputDialog::getInt(this, tr("Ink Drop Size"), tr("Drop radius (pixels):"),
+						    myCanvas->getInkDropRadius(), 2, 512, 1, &ok);
+	if (ok)
+		myCanvas->setInkDropRadius(radius);
+}
+
+// How far to the side of a tine the paint still gets pulled along
+void MainWindow::setTineSharpness()
+{
+	bool ok;
+	int sharpness = QInputDialog::getInt(this, tr("Tine Sharpness"), tr("Falloff distance (pixels):"),
+							 myCanvas->getTineSharpness(), 1, 256, 1, &ok);
+	if (ok)
+		myCanvas->setTineSharpness(sharpness);
+}
+
+void MainWindow::setCombSpacing()
+{
+	bool ok;
+	int spacing = QInputDialog::getInt(this, tr("Comb Spacing"), tr("Distance between tines (pixels):"),
+						     myCanvas->getCombSpacing(), 4, 1024, 1, &ok);
+	if (ok)
+		myCanvas->setCombSpacing(spacing);
+}
+
+// Ask how many megabytes the undo history may keep
+void MainWindow::setUndoMemoryLimit()
+{
+	bool ok;
+	int megabytes = QInputDialog::getInt(this, tr("History Memory"), tr("Undo history size (MB):"),
+							 int(myCanvas->undoMemoryLimit() / (1024 * 1024)), 16, 8192, 16, &ok);
+	if (ok)
+		myCanvas->setUndoMemoryLimit(qint64(megabytes) * 1024 * 1024);
+}
+
 bool MainWindow::save()
 {
 	QString path = QDir::currentPath() + "/untitled.png";
-	QString fileName = QFileDialog::getSaveFileName(this, tr("Save Picture"),
-									path);
-	bool success = myCanvas->saveImage(fileName);
-	if (!success)
-		QMessageBox::information(this, "Error Saving Picture",
-						 "Could not save the image");
-	return success;
+	QString fileName = QFileDialog::getSaveFileName(this, tr("Save Picture"), path,
+									tr("Images (*.png *.jpg *.bmp);;TIFF, any size (*.tif *.tiff);;Ebru projects (*.ebru)"));
+	if (fileName.isEmpty())
+		return false;
+
+	saveProgress->setValue(0);
+	saveProgress->show();
+	statusBar()->showMessage(tr("Saving %1...").arg(QDir::toNativeSeparators(fileName)));
+	myCanvas->saveImageInBackground(fileName);
+	return true;
+}
+
+// The picture at a whole multiple of the canvas size, rendered the
+// same banded way as printing
+void MainWindow::exportScaled()
+{
+	bool ok;
+	int scale = QInputDialog::getInt(this, tr("Export at Scale"), tr("Times the canvas size:"),
+					 2, 1, 8, 1, &ok);
+	if (!ok)
+		return;
+
+	QString path = QDir::currentPath() + QString("/untitled@%1x.png").arg(scale);
+	QString fileName = QFileDialog::getSaveFileName(this, tr("Export Picture"), path,
+							tr("Images (*.png *.jpg *.bmp);;TIFF, any size (*.tif *.tiff)"));
+	if (fileName.isEmpty())
+		return;
+
+	saveProgress->setValue(0);
+	saveProgress->show();
+	statusBar()->showMessage(tr("Exporting %1...").arg(QDir::toNativeSeparators(fileName)));
+	myCanvas->saveImageInBackground(fileName, scale);
+}
+
+void MainWindow::saveFinished(const QString &fileName)
+{
+	saveProgress->hide();
+	statusBar()->showMessage(tr("Saved %1").arg(QDir::toNativeSeparators(fileName)), 5000);
+}
+
+void MainWindow::saveFailed(const QString &fileName, const QString &error)
+{
+	saveProgress->hide();
+	statusBar()->showMessage(tr("Could not save %1: %2")
+					 .arg(QDir::toNativeSeparators(fileName), error));
 }
 
 void MainWindow::load()
 {
-	QString fileName = QFileDialog::getOpenFileName(this, tr("Open Picture"),
-									QDir::currentPath());
+	QString fileName = QFileDialog::getOpenFileName(this, tr("Open Picture"), QDir::currentPath(),
+									tr("Pictures and projects (*.png *.jpg *.bmp *.ebru);;All files (*)"));
+
+	if (fileName.isEmpty())
+		return;
 
-	if (!myCanvas->openImage(fileName))
-		QMessageBox::information(this, "Error Opening Picture",
-						 "Could not open picture");
+	QString error;
+	if (!myCanvas->openImage(fileName, &error))
+		QMessageBox::information(this, tr("Error Opening Picture"),
+						 tr("Could not open %1: %2").arg(QDir::toNativeSeparators(fileName), error));
 }
 
 void MainWindow::clear()
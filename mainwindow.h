@@ -5,6 +5,10 @@
 #include <QMainWindow>
 #include <QColorDialog>
 
+class QActionGroup;
+class QLabel;
+class QProgressBar;
+
 // ScribbleArea used to paint the image
 class ScribbleArea;
 
@@ -18,14 +22,38 @@ class MainWindow : public QMainWindow
 public:
     MainWindow();
 
+    // The canvas shown in the window
+    ScribbleArea *canvas() const { return myCanvas; }
+
 // The events that can be triggered
 private slots:
     void setBrushColor();
+    void setBrushSpacing();
+    void setUndoMemoryLimit();
+    void setMarblingResolution(QAction *action);
+    void setMarblingTool(QAction *action);
+    void setInkDropRadius();
+    void setTineSharpness();
+    void setCombSpacing();
+    void setCurrentLayer(QAction *action);
+    void setLayerOpacity();
+    void setLayerBlendMode(QAction *action);
+    void updateLayerMenu();
     void setAlphaValuator(QAction *action);
     void setLineWidthValuator(QAction *action);
     void setSaturationValuator(QAction *action);
     void setEventCompression(bool compress);
+    void updateLatency();
+    void setProfiling(bool profile);
+    void clearProfile();
+    void exportProfile();
+    void recordStrokes(bool record);
+    void replayStrokes();
+    void replayStrokesFast();
     bool save();
+    void exportScaled();
+    void saveFinished(const QString &fileName);
+    void saveFailed(const QString &fileName, const QString &error);
     void load();
     void clear();
     void about();
@@ -33,11 +61,25 @@ private slots:
 private:
 
     void createMenus();
+    void replay(bool realTime);
 
     // What we'll draw on
     ScribbleArea *myCanvas;
     QColorDialog* colorDialog;
 
+    // Shown in the status bar while a save runs
+    QProgressBar* saveProgress;
+
+    // Input to screen latency of recent tablet samples
+    QLabel* latencyLabel;
+
+    // Layer list and the settings of the current layer, kept in
+    // step with the canvas
+    QMenu* currentLayerMenu;
+    QActionGroup* currentLayerGroup;
+    QActionGroup* blendModeGroup;
+    QAction* layerVisibleAction;
+
 };
 
 #endif
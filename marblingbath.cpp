@@ -0,0 +1,339 @@
+#include <QtMath>
+
+#include <cstring>
+
+#include "marblingbath.h"
+#include "marblingoperators.h"
+#include "parallelbands.h"
+
+// Water in a marbling tray is thick, the flow slows down and settles
+// within a second or two after the stylus stops
+static const float Viscosity = 0.02f;
+static const float Damping = 1.5f;
+static const int DiffuseIterations = 8;
+static const int PressureIterations = 24;
+
+// Flow slower than this in cells per second doesn't move the paint
+static const float StillSpeed = 0.05f;
+
+MarblingBath::MarblingBath()
+	: cell(4)
+	, columns(0)
+	, rows(0)
+{
+}
+
+void MarblingBath::setCellSize(int pixels)
+{
+	cell = qMax(1, pixels);
+	if (isRunning())
+		start(paintImage, bathArea);
+}
+
+void MarblingBath::start(const QImage &paint, const QRect &area)
+{
+	paintImage = paint.convertToFormat(QImage::Format_ARGB32_Premultiplied);
+	nextPaint = paintImage.copy();
+	bathArea = area;
+	columns = qMax(2, (area.width() + cell - 1) / cell);
+	rows = qMax(2, (area.height() + cell - 1) / cell);
+
+	int cells = columns * rows;
+	u.fill(0, cells);
+	v.fill(0, cells);
+	scratchU.fill(0, cells);
+	scratchV.fill(0, cells);
+	pressure.fill(0, cells);
+	scratchPressure.fill(0, cells);
+	divergence.fill(0, cells);
+	drags.clear();
+}
+
+void MarblingBath::stop()
+{
+	paintImage = QImage();
+	nextPaint = QImage();
+	u.clear();
+	v.clear();
+	scratchU.clear();
+	scratchV.clear();
+	pressure.clear();
+	scratchPressure.clear();
+	divergence.clear();
+	drags.clear();
+}
+
+void MarblingBath::drag(const QPointF &from, const QPointF &to, qreal radius)
+{
+	if (isRunning())
+		drags.append(Drag { from - bathArea.topLeft(), to - bathArea.topLeft(), radius });
+}
+
+QRect MarblingBath::step(qreal seconds)
+{
+	if (!isRunning() || seconds <= 0)
+		return QRect();
+
+	float dt = float(seconds);
+	applyDrags(dt);
+	diffuse(u, Viscosity * dt);
+	diffuse(v, Viscosity * dt);
+	project();
+	advectVelocity(dt);
+	project();
+
+	float damping = qMax(0.0f, 1.0f - Damping * dt);
+	float *uData = u.data();
+	float *vData = v.data();
+	ParallelBands::forEach(0, rows, [&](int first, int last) {
+		float *uRow = uData + first * columns;
+		float *vRow = vData + first * columns;
+		for (int i = 0, n = (last - first) * columns; i < n; ++i) {
+			uRow[i] *= damping;
+			vRow[i] *= damping;
+		}
+	});
+
+	QRect rect = movingRect(dt);
+	if (rect.isEmpty())
+		return QRect();
+	advectPaint(dt, rect);
+	return rect.translated(bathArea.topLeft());
+}
+
+// Pulls the water under the stylus towards the speed the stylus
+// moved at, fading out with distance from the stroke
+void MarblingBath::applyDrags(float dt)
+{
+	for (const Drag &drag : drags) {
+		QPointF from = drag.from / cell;
+		QPointF to = drag.to / cell;
+		QPointF velocity = (to - from) / dt;
+		float radius = qMax(1.0f, float(drag.radius / cell));
+		int steps = qMax(1, qCeil(QLineF(from, to).length()));
+
+		for (int s = 0; s <= steps; ++s) {
+			QPointF center = from + (to - from) * (qreal(s) / steps);
+			int left = qMax(1, qFloor(center.x() - radius));
+			int right = qMin(columns - 2, qCeil(center.x() + radius));
+			int top = qMax(1, qFloor(center.y() - radius));
+			int bottom = qMin(rows - 2, qCeil(center.y() + radius));
+			for (int y = top; y <= bottom; ++y) {
+				for (int x = left; x <= right; ++x) {
+					float dx = float(x - center.x());
+					float dy = float(y - center.y());
+					float weight = qExp(-(dx * dx + dy * dy) / (radius * radius)) * 0.5f;
+					int i = y * columns + x;
+					u[i] += weight * (float(velocity.x()) - u[i]);
+					v[i] += weight * (float(velocity.y()) - v[i]);
+				}
+			}
+		}
+	}
+	drags.clear();
+}
+
+// Jacobi iterations of the implicit diffusion step
+void MarblingBath::diffuse(Field &field, float amount)
+{
+	if (amount <= 0)
+		return;
+
+	const float scale = 1.0f / (1.0f + 4.0f * amount);
+	Field &next = &field == &u ? scratchU : scratchV;
+	diffuseStart = field;
+	diffuseStart.detach();
+	const float *start = diffuseStart.constData();
+	for (int iteration = 0; iteration < DiffuseIterations; ++iteration) {
+		const float *current = field.constData();
+		float *target = next.data();
+		ParallelBands::forEach(1, rows - 1, [&](int first, int last) {
+			for (int y = first; y < last; ++y) {
+				const float *b = start + y * columns;
+				const float *x = current + y * columns;
+				const float *up = x - columns;
+				const float *down = x + columns;
+				float *out = target + y * columns;
+				for (int i = 1; i < columns - 1; ++i)
+					out[i] = (b[i] + amount * (x[i - 1] + x[i + 1] + up[i] + down[i])) * scale;
+			}
+		});
+		clearBorder(next);
+		field.swap(next);
+	}
+}
+
+// Makes the flow divergence free so the water neither piles up
+// nor drains away, which is what gives marbling its swirls
+void MarblingBath::project()
+{
+	float *uData = u.data();
+	float *vData = v.data();
+	float *divergenceData = divergence.data();
+	float *pressureData = pressure.data();
+	ParallelBands::forEach(1, rows - 1, [&](int first, int last) {
+		for (int y = first; y < last; ++y) {
+			const float *uRow = uData + y * columns;
+			const float *vUp = vData + (y - 1) * columns;
+			const float *vDown = vData + (y + 1) * columns;
+			float *out = divergenceData + y * columns;
+			float *p = pressureData + y * columns;
+			for (int i = 1; i < columns - 1; ++i) {
+				out[i] = -0.5f * (uRow[i + 1] - uRow[i - 1] + vDown[i] - vUp[i]);
+				p[i] = 0;
+			}
+		}
+	});
+	clearBorder(divergence);
+	clearBorder(pressure);
+
+	for (int iteration = 0; iteration < PressureIterations; ++iteration) {
+		const float *current = pressure.constData();
+		float *target = scratchPressure.data();
+		ParallelBands::forEach(1, rows - 1, [&](int first, int last) {
+			for (int y = first; y < last; ++y) {
+				const float *d = divergenceData + y * columns;
+				const float *p = current + y * columns;
+				const float *up = p - columns;
+				const float *down = p + columns;
+				float *out = target + y * columns;
+				for (int i = 1; i < columns - 1; ++i)
+					out[i] = (d[i] + p[i - 1] + p[i + 1] + up[i] + down[i]) * 0.25f;
+			}
+		});
+		clearBorder(scratchPressure);
+		pressure.swap(scratchPressure);
+	}
+
+	const float *solved = pressure.constData();
+	ParallelBands::forEach(1, rows - 1, [&](int first, int last) {
+		for (int y = first; y < last; ++y) {
+			const float *p = solved + y * columns;
+			const float *up = p - columns;
+			const float *down = p + columns;
+			float *uRow = uData + y * columns;
+			float *vRow = vData + y * columns;
+			for (int i = 1; i < columns - 1; ++i) {
+				uRow[i] -= 0.5f * (p[i + 1] - p[i - 1]);
+				vRow[i] -= 0.5f * (down[i] - up[i]);
+			}
+		}
+	});
+	clearBorder(u);
+	clearBorder(v);
+}
+
+// Semi-Lagrangian: every cell takes the velocity found where the
+// flow through it came from
+void MarblingBath::advectVelocity(float dt)
+{
+	const float *uData = u.constData();
+	const float *vData = v.constData();
+	float *uTarget = scratchU.data();
+	float *vTarget = scratchV.data();
+	ParallelBands::forEach(1, rows - 1, [&](int first, int last) {
+		for (int y = first; y < last; ++y) {
+			const float *uRow = uData + y * columns;
+			const float *vRow = vData + y * columns;
+			float *uOut = uTarget + y * columns;
+			float *vOut = vTarget + y * columns;
+			for (int i = 1; i < columns - 1; ++i) {
+				float x = i - dt * uRow[i];
+				float sy = y - dt * vRow[i];
+				uOut[i] = sample(u, x, sy);
+				vOut[i] = sample(v, x, sy);
+			}
+		}
+	});
+	clearBorder(scratchU);
+	clearBorder(scratchV);
+	u.swap(scratchU);
+	v.swap(scratchV);
+}
+
+// Same back tracing for the paint, but per pixel with the velocity
+// interpolated between the cells
+void MarblingBath::advectPaint(float dt, const QRect &rect)
+{
+	const int width = paintImage.width();
+	const int height = paintImage.height();
+	const uchar *source = paintImage.constBits();
+	const int bytesPerLine = paintImage.bytesPerLine();
+	const float toCell = 1.0f / cell;
+	const float reach = dt * cell;
+	uchar *target = nextPaint.bits();
+
+	ParallelBands::forEach(rect.top(), rect.bottom() + 1, [&](int first, int last) {
+		for (int y = first; y < last; ++y) {
+			quint32 *out = reinterpret_cast<quint32 *>(target + y * bytesPerLine);
+			float cellY = (y + 0.5f) * toCell - 0.5f;
+			for (int x = rect.left(); x <= rect.right(); ++x) {
+				float cellX = (x + 0.5f) * toCell - 0.5f;
+				float fromX = x - reach * sample(u, cellX, cellY);
+				float fromY = y - reach * sample(v, cellX, cellY);
+
+				out[x] = MarblingOperators::sample(source, bytesPerLine, width, height, fromX, fromY);
+			}
+		}
+	});
+
+	// Outside rect the paint didn't move, keep both buffers the same
+	for (int y = rect.top(); y <= rect.bottom(); ++y)
+		memcpy(paintImage.scanLine(y) + rect.left() * 4,
+		       nextPaint.constScanLine(y) + rect.left() * 4, size_t(rect.width()) * 4);
+}
+
+// Pixels the flow moves paint into, grown by how far paint can travel
+// in one step so nothing at the edge of the flow gets left behind
+QRect MarblingBath::movingRect(float dt) const
+{
+	int left = columns, right = -1, top = rows, bottom = -1;
+	float fastest = 0;
+	for (int y = 0; y < rows; ++y) {
+		const float *uRow = u.constData() + y * columns;
+		const float *vRow = v.constData() + y * columns;
+		for (int x = 0; x < columns; ++x) {
+			float speed = qAbs(uRow[x]) + qAbs(vRow[x]);
+			if (speed > StillSpeed) {
+				left = qMin(left, x);
+				right = qMax(right, x);
+				top = qMin(top, y);
+				bottom = qMax(bottom, y);
+				fastest = qMax(fastest, speed);
+			}
+		}
+	}
+	if (right < 0)
+		return QRect();
+
+	int margin = qCeil(fastest * dt * cell) + cell;
+	return QRect(QPoint(left * cell, top * cell), QPoint((right + 1) * cell, (bottom + 1) * cell))
+		   .adjusted(-margin, -margin, margin, margin) & paintImage.rect();
+}
+
+// The tray walls hold the water in
+void MarblingBath::clearBorder(Field &field) const
+{
+	float *data = field.data();
+	for (int x = 0; x < columns; ++x) {
+		data[x] = 0;
+		data[(rows - 1) * columns + x] = 0;
+	}
+	for (int y = 0; y < rows; ++y) {
+		data[y * columns] = 0;
+		data[y * columns + columns - 1] = 0;
+	}
+}
+
+float MarblingBath::sample(const Field &field, float x, float y) const
+{
+	x = qBound(0.0f, x, columns - 1.001f);
+	y = qBound(0.0f, y, rows - 1.001f);
+	int x0 = int(x);
+	int y0 = int(y);
+	float fx = x - x0;
+	float fy = y - y0;
+	const float *top = field.constData() + y0 * columns + x0;
+	const float *bottom = top + columns;
+	return (top[0] * (1 - fx) + top[1] * fx) * (1 - fy) + (bottom[0] * (1 - fx) + bottom[1] * fx) * fy;
+}
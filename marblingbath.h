@@ -0,0 +1,74 @@
+#ifndef MARBLINGBATH_H
+#define MARBLINGBATH_H
+
+#include <QImage>
+#include <QPointF>
+#include <QRect>
+#include <QVector>
+
+// A stable fluids solver (advection, diffusion and pressure projection)
+// running on a grid a few pixels per cell over part of the canvas. Drags
+// push the water around and the paint on the canvas is carried along by
+// it. Every pass is split into row bands that run on the global thread
+// pool, the inner loops work on plain float rows so they vectorize
+class MarblingBath
+{
+	public:
+
+		MarblingBath();
+
+		// Pixels per simulation cell, larger cells are faster but
+		// show less detail in the flow
+		void setCellSize(int pixels);
+		int cellSize() const { return cell; }
+
+		// Starts the bath over area with paint as it is there now
+		void start(const QImage &paint, const QRect &area);
+		void stop();
+		bool isRunning() const { return !paintImage.isNull(); }
+
+		// The water follows the stylus from one point to the next, both
+		// in canvas coordinates. Applied on the next step
+		void drag(const QPointF &from, const QPointF &to, qreal radius);
+
+		// Advances the simulation by dt seconds and returns the part
+		// of the canvas where the paint moved
+		QRect step(qreal dt);
+
+		QRect area() const { return bathArea; }
+		const QImage &paint() const { return paintImage; }
+
+	private:
+
+		struct Drag
+		{
+				QPointF from;
+				QPointF to;
+				qreal radius;
+		};
+
+		typedef QVector<float> Field;
+
+		void applyDrags(float dt);
+		void diffuse(Field &field, float amount);
+		void project();
+		void advectVelocity(float dt);
+		void advectPaint(float dt, const QRect &rect);
+		QRect movingRect(float dt) const;
+		void clearBorder(Field &field) const;
+		float sample(const Field &field, float x, float y) const;
+
+		int cell;
+		int columns;
+		int rows;
+		QRect bathArea;
+		QImage paintImage;
+		QImage nextPaint;
+		Field u, v;
+		Field scratchU, scratchV;
+		Field pressure, scratchPressure, divergence;
+		Field diffuseStart;
+		QVector<Drag> drags;
+};
+
+#endif // MARBLINGBATH_H
@@ -0,0 +1,200 @@
+#include <QLineF>
+#include <QPolygonF>
+#include <QtMath>
+
+#include <cmath>
+
+#include "marblingoperators.h"
+#include "parallelbands.h"
+#include "tiledsurface.h"
+
+namespace {
+
+// The part of a tile one resampling job writes to
+struct TileJob
+{
+		uchar *bits;
+		int bytesPerLine;
+		QPoint origin;
+		QRect area;
+};
+
+// Steps of the exp(-d / sharpness) table per unit of d / sharpness
+const int FalloffSteps = 64;
+
+// Flattened copy of rect, drawn in parallel row bands
+QImage flatten(const TiledSurface &surface, const QRect &rect)
+{
+	QImage image(rect.size(), QImage::Format_ARGB32_Premultiplied);
+	uchar *bits = image.bits();
+	const int bytesPerLine = image.bytesPerLine();
+	ParallelBands::forEach(0, rect.height(), [&](int first, int last) {
+		QImage band(bits + first * bytesPerLine, rect.width(), last - first, bytesPerLine,
+			    QImage::Format_ARGB32_Premultiplied);
+		QPainter painter(&band);
+		painter.setCompositionMode(QPainter::CompositionMode_Source);
+		painter.translate(-rect.left(), -(rect.top() + first));
+		surface.render(painter, QRect(rect.left(), rect.top() + first, rect.width(), last - first));
+	}, 1);
+	return image;
+}
+
+// Takes every tile in rect for writing. Done up front on the calling
+// thread since allocating, loading and recording tiles isn't thread safe
+QVector<TileJob> tileJobs(TiledSurface &surface, const QRect &rect)
+{
+	QVector<TileJob> jobs;
+	QRect range = surface.tilesIn(rect);
+	for (int row = range.top(); row <= range.bottom(); ++row) {
+		for (int column = range.left(); column <= range.right(); ++column) {
+			QImage &tile = surface.tile(column, row);
+			QRect tileRect = surface.tileRect(column, row);
+			jobs.append(TileJob { tile.bits(), tile.bytesPerLine(), tileRect.topLeft(), tileRect & rect });
+		}
+	}
+	return jobs;
+}
+
+// Runs resample(x, y, line, count) for every row of every job on the
+// global thread pool, x and y being the surface coordinates of line[0]
+template <typename Resample>
+void resampleTiles(QVector<TileJob> jobs, Resample resample)
+{
+	QtConcurrent::blockingMap(jobs, [&resample](const TileJob &job) {
+		for (int y = job.area.top(); y <= job.area.bottom(); ++y) {
+			quint32 *line = reinterpret_cast<quint32 *>(job.bits + (y - job.origin.y()) * job.bytesPerLine);
+			resample(job.area.left(), y, line + (job.area.left() - job.origin.x()), job.area.width());
+		}
+	});
+}
+
+}
+
+QRect MarblingOperators::inkDropRect(const QRect &bounds, const QPointF &center, qreal radius)
+{
+	if (radius <= 0)
+		return QRect();
+	// Paint at distance d ends up sqrt(d^2 + r^2) away, less than
+	// half a pixel further once d is past r^2
+	qreal reach = qMax(radius + 1, radius * radius);
+	return QRectF(center.x() - reach, center.y() - reach, reach * 2, reach * 2).toAlignedRect() & bounds;
+}
+
+QRect MarblingOperators::inkDrop(TiledSurface &surface, const QPointF &center, qreal radius, const QColor &color)
+{
+	QRect rect = inkDropRect(QRect(QPoint(0, 0), surface.size()), center, radius);
+	if (rect.isEmpty())
+		return QRect();
+
+	// Paint only ever moves outwards, everything inside rect came
+	// from inside it
+	const QImage source = flatten(surface, rect);
+	const uchar *sourceBits = source.constBits();
+	const int sourceBytesPerLine = source.bytesPerLine();
+	const int sourceWidth = source.width();
+	const int sourceHeight = source.height();
+	const float left = rect.left() + 0.5f;
+	const float top = rect.top() + 0.5f;
+
+	const float centerX = float(center.x());
+	const float centerY = float(center.y());
+	const float radiusSquared = float(radius * radius);
+	const quint32 drop = qPremultiply(color.rgba());
+
+	resampleTiles(tileJobs(surface, rect), [&](int x, int y, quint32 *line, int count) {
+		float dy = y + 0.5f - centerY;
+		for (int i = 0; i < count; ++i) {
+			float dx = x + i + 0.5f - centerX;
+			float distanceSquared = dx * dx + dy * dy;
+			if (distanceSquared <= radiusSquared) {
+				line[i] = drop;
+				continue;
+			}
+			float scale = std::sqrt(1.0f - radiusSquared / distanceSquared);
+			line[i] = sample(sourceBits, sourceBytesPerLine, sourceWidth, sourceHeight,
+					 centerX + dx * scale - left, centerY + dy * scale - top);
+		}
+	});
+	return rect;
+}
+
+QRect MarblingOperators::tineRect(const QRect &bounds, const QPointF &from, const QPointF &to,
+				      qreal sharpness, qreal spacing)
+{
+	qreal length = QLineF(from, to).length();
+	if (length < 0.5 || sharpness <= 0)
+		return QRect();
+	// A comb has tines all across the surface
+	if (spacing > 0)
+		return bounds;
+	qreal halfWidth = sharpness * qLn(2 * length);
+
+	// The strip along the tine, as long as the surface is wide
+	QPointF direction = (to - from) / length;
+	QPointF normal(-direction.y(), direction.x());
+	qreal extent = qSqrt(qreal(bounds.width()) * bounds.width() + qreal(bounds.height()) * bounds.height())
+		       + QLineF(from, bounds.center()).length();
+	QPointF along = direction * extent;
+	QPointF across = normal * (halfWidth + 1);
+	QPolygonF strip;
+	strip << from - along - across << from + along - across << from + along + across << from - along + across;
+	return strip.boundingRect().toAlignedRect() & bounds;
+}
+
+QRect MarblingOperators::tine(TiledSurface &surface, const QPointF &from, const QPointF &to,
+				  qreal sharpness, qreal spacing)
+{
+	const QRect bounds(QPoint(0, 0), surface.size());
+	QRect rect = tineRect(bounds, from, to, sharpness, spacing);
+	if (rect.isEmpty())
+		return QRect();
+
+	const qreal length = QLineF(from, to).length();
+	const QPointF direction = (to - from) / length;
+
+	// Paint moves up to length pixels along the tine, so it can come
+	// from that far outside rect
+	int reach = qCeil(length) + 1;
+	QRect sourceRect = rect.adjusted(-reach, -reach, reach, reach) & bounds;
+	const QImage source = flatten(surface, sourceRect);
+	const uchar *sourceBits = source.constBits();
+	const int sourceBytesPerLine = source.bytesPerLine();
+	const int sourceWidth = source.width();
+	const int sourceHeight = source.height();
+	const float left = sourceRect.left() + 0.5f;
+	const float top = sourceRect.top() + 0.5f;
+
+	// The shift at distance d, looked up rather than calling exp for
+	// every pixel. Past the end of the table it is below half a pixel
+	const float cutoff = float(qLn(2 * length));
+	QVector<float> shifts(qCeil(cutoff * FalloffSteps) + 2);
+	for (int i = 0; i < shifts.size(); ++i)
+		shifts[i] = float(length * qExp(-qreal(i) / FalloffSteps));
+	shifts.last() = 0;
+	const float *shiftTable = shifts.constData();
+	const int lastShift = shifts.size() - 1;
+
+	const float directionX = float(direction.x());
+	const float directionY = float(direction.y());
+	// Signed distance from the tine through from, along its normal
+	const float normalX = -directionY;
+	const float normalY = directionX;
+	const float offset = -float(from.x()) * normalX - float(from.y()) * normalY;
+	const float toTable = float(FalloffSteps / sharpness);
+	const float period = float(spacing);
+
+	resampleTiles(tileJobs(surface, rect), [&](int x, int y, quint32 *line, int count) {
+		float py = y + 0.5f;
+		for (int i = 0; i < count; ++i) {
+			float px = x + i + 0.5f;
+			float distance = px * normalX + py * normalY + offset;
+			if (period > 0)
+				distance -= period * std::floor(distance / period + 0.5f);
+			int index = int(std::fabs(distance) * toTable);
+			float shift = shiftTable[index < lastShift ? index : lastShift];
+			line[i] = sample(sourceBits, sourceBytesPerLine, sourceWidth, sourceHeight,
+					 px - shift * directionX - left, py - shift * directionY - top);
+		}
+	});
+	return rect;
+}
@@ -0,0 +1,60 @@
+#ifndef MARBLINGOPERATORS_H
+#define MARBLINGOPERATORS_H
+
+#include <QColor>
+#include <QPointF>
+#include <QRect>
+
+class TiledSurface;
+
+// The closed form marbling transforms. Every pixel they change looks
+// up where its paint came from with the inverse of the transform and
+// samples the canvas there, so the paint is never torn apart. Pixels
+// the paint moves less than half a pixel in are left alone, which is
+// what keeps each operation to the region it really affects
+namespace MarblingOperators
+{
+	// Drops a circle of color that pushes everything around it
+	// outwards: p' = c + (p - c) * sqrt(1 + r^2 / |p - c|^2)
+	QRect inkDrop(TiledSurface &surface, const QPointF &center, qreal radius, const QColor &color);
+
+	// Drags a tine along the line from one point to the other. Paint
+	// next to the line moves the length of the drag in its direction,
+	// falling off as exp(-d / sharpness) with the distance d from it.
+	// A spacing above 0 makes it a comb with a tine every spacing pixels
+	QRect tine(TiledSurface &surface, const QPointF &from, const QPointF &to,
+		     qreal sharpness, qreal spacing = 0);
+
+	// Where the operations above would change the surface
+	QRect inkDropRect(const QRect &bounds, const QPointF &center, qreal radius);
+	QRect tineRect(const QRect &bounds, const QPointF &from, const QPointF &to,
+			   qreal sharpness, qreal spacing = 0);
+
+	// Bilinear blend of two premultiplied pixels, t out of 256
+	inline quint32 interpolate(quint32 a, quint32 b, uint t)
+	{
+		uint s = 256 - t;
+		quint32 redBlue = (((a & 0xff00ff) * s + (b & 0xff00ff) * t) >> 8) & 0xff00ff;
+		quint32 alphaGreen = (((a >> 8) & 0xff00ff) * s + ((b >> 8) & 0xff00ff) * t) & 0xff00ff00;
+		return redBlue | alphaGreen;
+	}
+
+	// Samples a premultiplied 32 bit image at x, y in pixel
+	// coordinates, clamping to its edges
+	inline quint32 sample(const uchar *bits, int bytesPerLine, int width, int height, float x, float y)
+	{
+		x = x < 0 ? 0 : x > width - 1.001f ? width - 1.001f : x;
+		y = y < 0 ? 0 : y > height - 1.001f ? height - 1.001f : y;
+		int x0 = int(x);
+		int y0 = int(y);
+		uint tx = uint((x - x0) * 256);
+		uint ty = uint((y - y0) * 256);
+		int x1 = x0 + 1 < width ? x0 + 1 : x0;
+		int y1 = y0 + 1 < height ? y0 + 1 : y0;
+		const quint32 *top = reinterpret_cast<const quint32 *>(bits + y0 * bytesPerLine);
+		const quint32 *bottom = reinterpret_cast<const quint32 *>(bits + y1 * bytesPerLine);
+		return interpolate(interpolate(top[x0], top[x1], tx), interpolate(bottom[x0], bottom[x1], tx), ty);
+	}
+}
+
+#endif // MARBLINGOPERATORS_H
@@ -0,0 +1,185 @@
+#include <QtMath>
+
+#include "dabkernels.h"
+#include "mippyramid.h"
+#include "parallelbands.h"
+
+#if defined(Q_PROCESSOR_X86)
+#include <immintrin.h>
+#endif
+
+#if defined(Q_PROCESSOR_X86) && defined(Q_CC_GNU)
+#define MIP_TARGET(features) __attribute__((target(features)))
+#else
+#define MIP_TARGET(features)
+#endif
+
+namespace
+{
+
+// Texels of a level with more pixels than this are averaged in bands
+// on the thread pool
+const int ParallelTexels = 128 * 128;
+
+inline quint32 average(quint32 a, quint32 b, quint32 c, quint32 d)
+{
+	quint32 result = 0;
+	for (int shift = 0; shift < 32; shift += 8) {
+		quint32 sum = ((a >> shift) & 0xff) + ((b >> shift) & 0xff)
+			      + ((c >> shift) & 0xff) + ((d >> shift) & 0xff);
+		result |= ((sum + 2) >> 2) << shift;
+	}
+	return result;
+}
+
+// One row of texels from columns first to last - 1, the last column
+// and row of an odd sized source are used twice
+void averageRowScalar(const quint32 *top, const quint32 *bottom, quint32 *target,
+		      int first, int last, int sourceWidth)
+{
+	for (int x = first; x < last; ++x) {
+		int left = 2 * x;
+		int right = qMin(left + 1, sourceWidth - 1);
+		target[x] = average(top[left], top[right], bottom[left], bottom[right]);
+	}
+}
+
+#if defined(Q_PROCESSOR_X86)
+
+// Sums two neighbouring pixels of a and b each, the results land in
+// the low and high halves of the 16 bit lanes
+MIP_TARGET("sse2")
+inline __m128i sumPairs(__m128i a, __m128i b)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i low = _mm_add_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero));
+	__m128i high = _mm_add_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero));
+	low = _mm_add_epi16(low, _mm_srli_si128(low, 8));
+	high = _mm_add_epi16(high, _mm_srli_si128(high, 8));
+	return _mm_unpacklo_epi64(low, high);
+}
+
+// Four texels from eight source pixels of both rows at a time, rounded
+// the same way as the scalar average
+MIP_TARGET("sse2")
+void averageRowSSE2(const quint32 *top, const quint32 *bottom, quint32 *target,
+		    int first, int last, int sourceWidth)
+{
+	const __m128i two = _mm_set1_epi16(2);
+	int x = first;
+	for (; x + 4 <= last && 2 * x + 8 <= sourceWidth; x += 4) {
+		const __m128i *t = reinterpret_cast<const __m128i *>(top + 2 * x);
+		const __m128i *b = reinterpret_cast<const __m128i *>(bottom + 2 * x);
+		__m128i low = sumPairs(_mm_loadu_si128(t), _mm_loadu_si128(b));
+		__m128i high = sumPairs(_mm_loadu_si128(t + 1), _mm_loadu_si128(b + 1));
+		low = _mm_srli_epi16(_mm_add_epi16(low, two), 2);
+		high = _mm_srli_epi16(_mm_add_epi16(high, two), 2);
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(target + x), _mm_packus_epi16(low, high));
+	}
+	averageRowScalar(top, bottom, target, x, last, sourceWidth);
+}
+
+#endif
+
+typedef void (*AverageRowFunction)(const quint32 *, const quint32 *, quint32 *, int, int, int);
+
+AverageRowFunction averageRow()
+{
+#if defined(Q_PROCESSOR_X86)
+	if (DabKernels::isSupported(DabKernels::SSE2))
+		return averageRowSSE2;
+#endif
+	return averageRowScalar;
+}
+
+}
+
+MipPyramid::MipPyramid()
+{
+}
+
+void MipPyramid::clear()
+{
+	baseSize = QSize();
+	levels.clear();
+	dirty = QRegion();
+}
+
+void MipPyramid::invalidate(const QRect &rect)
+{
+	dirty += rect;
+}
+
+void MipPyramid::invalidate(const QRegion &region)
+{
+	dirty += region;
+}
+
+void MipPyramid::update(const QImage &base)
+{
+	if (base.size() != baseSize) {
+		baseSize = base.size();
+		levels.clear();
+		QSize size = baseSize;
+		while (size.width() > MinimumSize || size.height() > MinimumSize) {
+			size = QSize((size.width() + 1) / 2, (size.height() + 1) / 2);
+			levels.append(QImage(size, QImage::Format_ARGB32_Premultiplied));
+		}
+		dirty = QRect(QPoint(0, 0), baseSize);
+	}
+	if (dirty.isEmpty() || levels.isEmpty())
+		return;
+
+	// Every changed pixel of a level touches the texel above it
+	QRegion changed = dirty & QRect(QPoint(0, 0), baseSize);
+	const QImage *source = &base;
+	for (QImage &target : levels) {
+		QRegion parents;
+		for (const QRect &rect : changed)
+			parents += QRect(QPoint(rect.left() / 2, rect.top() / 2),
+					 QPoint(rect.right() / 2, rect.bottom() / 2));
+		for (const QRect &rect : parents)
+			downsample(*source, target, rect);
+		changed = parents;
+		source = &target;
+	}
+	dirty = QRegion();
+}
+
+int MipPyramid::levelFor(qreal scale) const
+{
+	if (scale >= 1)
+		return 0;
+	int level = qFloor(std::log2(1 / scale));
+	return qBound(0, level, levelCount() - 1);
+}
+
+void MipPyramid::downsample(const QImage &source, QImage &target, const QRect &rect)
+{
+	QRect area = rect & target.rect();
+	if (area.isEmpty())
+		return;
+
+	static const AverageRowFunction averageRowOf = averageRow();
+	const uchar *sourceBits = source.constBits();
+	int sourceBytesPerLine = source.bytesPerLine();
+	int sourceHeight = source.height();
+	int sourceWidth = source.width();
+	uchar *targetBits = target.bits();
+	int targetBytesPerLine = target.bytesPerLine();
+
+	auto averageRows = [&](int first, int last) {
+		for (int y = first; y < last; ++y) {
+			int top = 2 * y;
+			int bottom = qMin(top + 1, sourceHeight - 1);
+			averageRowOf(reinterpret_cast<const quint32 *>(sourceBits + qsizetype(top) * sourceBytesPerLine),
+				     reinterpret_cast<const quint32 *>(sourceBits + qsizetype(bottom) * sourceBytesPerLine),
+				     reinterpret_cast<quint32 *>(targetBits + qsizetype(y) * targetBytesPerLine),
+				     area.left(), area.right() + 1, sourceWidth);
+		}
+	};
+	if (area.width() * area.height() > ParallelTexels)
+		ParallelBands::forEach(area.top(), area.bottom() + 1, averageRows);
+	else
+		averageRows(area.top(), area.bottom() + 1);
+}
@@ -0,0 +1,50 @@
+#ifndef MIPPYRAMID_H
+#define MIPPYRAMID_H
+
+#include <QImage>
+#include <QRegion>
+#include <QSize>
+#include <QVector>
+
+// Halved copies of a premultiplied ARGB32 image, down to a few pixels.
+// Level 0 is the image itself and isn't held here. Each texel of a
+// level is the 2 x 2 box average of the level below, so after the base
+// changes only the texels above the changed pixels are averaged again
+class MipPyramid
+{
+	public:
+
+		MipPyramid();
+
+		// The next update rebuilds every level
+		void clear();
+
+		// Pixels of the base that changed since the last update
+		void invalidate(const QRect &rect);
+		void invalidate(const QRegion &region);
+
+		// Brings every level up to date with base
+		void update(const QImage &base);
+
+		// Level 1 and up, level 0 being the base
+		int levelCount() const { return levels.size() + 1; }
+		const QImage &level(int index) const { return levels.at(index - 1); }
+
+		// Smallest level still showing at least one texel per pixel
+		// when the base is drawn scaled by scale
+		int levelFor(qreal scale) const;
+
+		// Averages 2 x 2 blocks of source into the texels of rect in
+		// target. Public for the benchmarks
+		static void downsample(const QImage &source, QImage &target, const QRect &rect);
+
+	private:
+
+		enum { MinimumSize = 16 };
+
+		QSize baseSize;
+		QVector<QImage> levels;
+		QRegion dirty;
+};
+
+#endif // MIPPYRAMID_H
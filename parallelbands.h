@@ -0,0 +1,38 @@
+#ifndef PARALLELBANDS_H
+#define PARALLELBANDS_H
+
+#include <QThread>
+#include <QVector>
+#include <QtConcurrent>
+
+namespace ParallelBands
+{
+	struct Band
+	{
+			int first;
+			int last;
+	};
+
+	// Splits the rows first to last - 1 into a few bands per core and
+	// runs fn(first, last) for each of them on the global thread pool,
+	// returning once all of them are done
+	template <typename Function>
+	void forEach(int first, int last, Function fn, int bandsPerThread = 4)
+	{
+		int count = last - first;
+		if (count <= 0)
+			return;
+		int bandCount = qMin(count, QThread::idealThreadCount() * bandsPerThread);
+		if (bandCount <= 1) {
+			fn(first, last);
+			return;
+		}
+		QVector<Band> bands;
+		bands.reserve(bandCount);
+		for (int i = 0; i < bandCount; ++i)
+			bands.append(Band { first + count * i / bandCount, first + count * (i + 1) / bandCount });
+		QtConcurrent::blockingMap(bands, [&fn](const Band &band) { fn(band.first, band.last); });
+	}
+}
+
+#endif // PARALLELBANDS_H
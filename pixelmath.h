@@ -0,0 +1,30 @@
+#ifndef PIXELMATH_H
+#define PIXELMATH_H
+
+#include <QtGlobal>
+
+// Arithmetic on premultiplied ARGB32 pixels shared by the dab and
+// blend kernels, so all of them round the same way
+namespace PixelMath
+{
+	// x / 255 rounded, for x up to 255 * 255
+	inline quint32 div255(quint32 x)
+	{
+		x += 128;
+		return (x + (x >> 8)) >> 8;
+	}
+
+	// Multiplies all four channels of x by a / 255, rounded the same
+	// way as div255()
+	inline quint32 byteMul(quint32 x, quint32 a)
+	{
+		quint32 t = (x & 0xff00ff) * a + 0x800080;
+		t = ((t + ((t >> 8) & 0xff00ff)) >> 8) & 0xff00ff;
+
+		x = ((x >> 8) & 0xff00ff) * a + 0x800080;
+		x = (x + ((x >> 8) & 0xff00ff)) & 0xff00ff00;
+		return x | t;
+	}
+}
+
+#endif // PIXELMATH_H
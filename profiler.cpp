@@ -0,0 +1,234 @@
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QMutex>
+#include <QTextStream>
+#include <QThread>
+
+#include "profiler.h"
+
+QAtomicInteger<int> Profiler::enabled(0);
+
+struct Profiler::ThreadData
+{
+		enum { EventCapacity = 8192 };
+
+		ThreadData(int threadId, const QString &threadName)
+			: id(threadId), name(threadName), events(EventCapacity) {}
+
+		int id;
+		QString name;
+
+		// Bumped by clear, the thread zeroes its counters the next
+		// time it records
+		QAtomicInteger<int> generation;
+
+		QAtomicInteger<quint64> count[SectionCount];
+		QAtomicInteger<quint64> nsecs[SectionCount];
+		QAtomicInteger<quint64> maxNsecs[SectionCount];
+
+		QVector<Event> events;
+		QAtomicInteger<quint64> written;
+};
+
+struct Profiler::Registry
+{
+		Registry() { clock.start(); }
+		~Registry() { qDeleteAll(threads); }
+
+		QElapsedTimer clock;
+		QMutex mutex;
+		QVector<ThreadData *> threads;
+		QAtomicInteger<int> generation;
+		QAtomicInteger<qint64> clearedAt;
+};
+
+Profiler::Registry &Profiler::registry()
+{
+	static Registry instance;
+	return instance;
+}
+
+void Profiler::setEnabled(bool enable)
+{
+	enabled.storeRelaxed(enable);
+}
+
+qint64 Profiler::now()
+{
+	return registry().clock.nsecsElapsed();
+}
+
+QString Profiler::sectionName(Section section)
+{
+	switch (section) {
+		case InputEvent:
+			return QStringLiteral("Input event");
+		case UpdateBrush:
+			return QStringLiteral("Update brush");
+		case Rasterize:
+			return QStringLiteral("Rasterize");
+		case Composite:
+			return QStringLiteral("Composite");
+		case Paint:
+			return QStringLiteral("Paint");
+		default:
+			return QString();
+	}
+}
+
+// Registers the calling thread the first time it records
+Profiler::ThreadData *Profiler::threadData()
+{
+	static thread_local ThreadData *data = nullptr;
+	if (data)
+		return data;
+
+	Registry &r = registry();
+	QMutexLocker locker(&r.mutex);
+	QThread *thread = QThread::currentThread();
+	QString name = thread->objectName();
+	if (name.isEmpty()) {
+		if (QCoreApplication::instance() && thread == QCoreApplication::instance()->thread())
+			name = QStringLiteral("GUI");
+		else
+			name = QStringLiteral("Thread %1").arg(r.threads.size());
+	}
+	data = new ThreadData(r.threads.size(), name);
+	data->generation.storeRelaxed(r.generation.loadRelaxed());
+	r.threads.append(data);
+	return data;
+}
+
+void Profiler::record(Section section, qint64 start, qint64 end)
+{
+	ThreadData *data = threadData();
+	int generation = registry().generation.loadRelaxed();
+	if (data->generation.loadRelaxed() != generation) {
+		for (int i = 0; i < SectionCount; ++i) {
+			data->count[i].storeRelaxed(0);
+			data->nsecs[i].storeRelaxed(0);
+			data->maxNsecs[i].storeRelaxed(0);
+		}
+		data->generation.storeRelaxed(generation);
+	}
+
+	quint64 elapsed = quint64(end - start);
+	data->count[section].storeRelaxed(data->count[section].loadRelaxed() + 1);
+	data->nsecs[section].storeRelaxed(data->nsecs[section].loadRelaxed() + elapsed);
+	if (elapsed > data->maxNsecs[section].loadRelaxed())
+		data->maxNsecs[section].storeRelaxed(elapsed);
+
+	quint64 written = data->written.loadRelaxed();
+	data->events[int(written % ThreadData::EventCapacity)] = Event { start, qint64(elapsed), section };
+	data->written.storeRelease(written + 1);
+}
+
+Profiler::Totals Profiler::totals(Section section)
+{
+	Totals totals = { 0, 0, 0 };
+	int generation = registry().generation.loadRelaxed();
+	for (const ThreadData *data : threads()) {
+		if (data->generation.loadRelaxed() != generation)
+			continue;
+		totals.count += data->count[section].loadRelaxed();
+		totals.nsecs += data->nsecs[section].loadRelaxed();
+		totals.maxNsecs = qMax(totals.maxNsecs, quint64(data->maxNsecs[section].loadRelaxed()));
+	}
+	return totals;
+}
+
+void Profiler::clear()
+{
+	Registry &r = registry();
+	r.clearedAt.storeRelaxed(now());
+	r.generation.fetchAndAddRelaxed(1);
+}
+
+QVector<Profiler::ThreadData *> Profiler::threads()
+{
+	Registry &r = registry();
+	QMutexLocker locker(&r.mutex);
+	return r.threads;
+}
+
+// Oldest first, leaving out those from before the last clear
+QVector<Profiler::Event> Profiler::events(const ThreadData *data)
+{
+	qint64 since = registry().clearedAt.loadRelaxed();
+	quint64 written = data->written.loadAcquire();
+	quint64 first = written > quint64(ThreadData::EventCapacity) ? written - ThreadData::EventCapacity : 0;
+
+	QVector<Event> recorded;
+	recorded.reserve(int(written - first));
+	for (quint64 i = first; i < written; ++i) {
+		const Event &event = data->events.at(int(i % ThreadData::EventCapacity));
+		if (event.start >= since)
+			recorded.append(event);
+	}
+	return recorded;
+}
+
+bool Profiler::writeChromeTrace(const QString &fileName, QString *error)
+{
+	QJsonArray traceEvents;
+	for (const ThreadData *data : threads()) {
+		QJsonObject name;
+		name.insert("name", "thread_name");
+		name.insert("ph", "M");
+		name.insert("pid", 1);
+		name.insert("tid", data->id);
+		name.insert("args", QJsonObject { { "name", data->name } });
+		traceEvents.append(name);
+
+		for (const Event &recorded : events(data)) {
+			QJsonObject event;
+			event.insert("name", sectionName(Section(recorded.section)));
+			event.insert("ph", "X");
+			event.insert("pid", 1);
+			event.insert("tid", data->id);
+			event.insert("ts", recorded.start / 1000.0);
+			event.insert("dur", recorded.nsecs / 1000.0);
+			traceEvents.append(event);
+		}
+	}
+
+	QJsonObject trace;
+	trace.insert("traceEvents", traceEvents);
+	trace.insert("displayTimeUnit", "ms");
+
+	QFile file(fileName);
+	if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+		*error = file.errorString();
+		return false;
+	}
+	file.write(QJsonDocument(trace).toJson(QJsonDocument::Compact));
+	return true;
+}
+
+bool Profiler::writeCsv(const QString &fileName, QString *error)
+{
+	QFile file(fileName);
+	if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate | QIODevice::Text)) {
+		*error = file.errorString();
+		return false;
+	}
+	QTextStream out(&file);
+	out << "thread,section,start_us,duration_us\n";
+	for (const ThreadData *data : threads()) {
+		for (const Event &event : events(data))
+			out << '"' << data->name << "\","
+			    << sectionName(Section(event.section)) << ','
+			    << QString::number(event.start / 1000.0, 'f', 3) << ','
+			    << QString::number(event.nsecs / 1000.0, 'f', 3) << '\n';
+	}
+	out.flush();
+	if (file.error() != QFile::NoError) {
+		*error = file.errorString();
+		return false;
+	}
+	return true;
+}
@@ -0,0 +1,96 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <QAtomicInteger>
+#include <QString>
+#include <QVector>
+
+// Scoped timers around the hot paths of painting. They are always
+// compiled in, while profiling is off a Scope costs a relaxed atomic
+// load and nothing else.
+//
+// Every thread that records gets its own counters and a ring of its
+// latest events. Only that thread ever writes them so recording takes
+// no lock. Readers may catch an event while it is being overwritten,
+// that is good enough for a profile
+class Profiler
+{
+	public:
+
+		enum Section
+		{
+			InputEvent,
+			UpdateBrush,
+			Rasterize,
+			Composite,
+			Paint,
+			SectionCount
+		};
+
+		// Times from construction to destruction
+		class Scope
+		{
+			public:
+
+				explicit Scope(Section section)
+					: mySection(section), start(isEnabled() ? now() : -1) {}
+				~Scope() { if (start >= 0) record(mySection, start, now()); }
+
+			private:
+
+				Q_DISABLE_COPY(Scope)
+
+				Section mySection;
+				qint64 start;
+		};
+
+		struct Totals
+		{
+				quint64 count;
+				quint64 nsecs;
+				quint64 maxNsecs;
+		};
+
+		static void setEnabled(bool enable);
+		static bool isEnabled() { return enabled.loadRelaxed(); }
+
+		// Nanoseconds on the profiler's own clock
+		static qint64 now();
+
+		static QString sectionName(Section section);
+
+		// Summed over every thread since the last clear
+		static Totals totals(Section section);
+
+		// Counts and events before this are left out from now on
+		static void clear();
+
+		// Every event still in the rings, as a Chrome trace (load it in
+		// chrome://tracing or Perfetto) or as one CSV row per event
+		static bool writeChromeTrace(const QString &fileName, QString *error);
+		static bool writeCsv(const QString &fileName, QString *error);
+
+	private:
+
+		struct Event
+		{
+				qint64 start;
+				qint64 nsecs;
+				int section;
+		};
+
+		struct ThreadData;
+		struct Registry;
+
+		static Registry &registry();
+		static void record(Section section, qint64 start, qint64 end);
+		static ThreadData *threadData();
+
+		// Registered threads and the events each still holds
+		static QVector<ThreadData *> threads();
+		static QVector<Event> events(const ThreadData *data);
+
+		static QAtomicInteger<int> enabled;
+};
+
+#endif // PROFILER_H
@@ -0,0 +1,104 @@
+#include <QPainter>
+
+#include "profileroverlay.h"
+
+static const int Margin = 8;
+static const int LineHeight = 14;
+static const int HistogramHeight = 40;
+static const int OverlayWidth = 232;
+
+ProfilerOverlay::ProfilerOverlay()
+	: nextFrame(0)
+	, framesSinceSample(0)
+	, framesPerSecond(0)
+	, samplesPerSecond(0)
+{
+	for (int i = 0; i < Profiler::SectionCount; ++i) {
+		lastTotals[i] = Profiler::Totals { 0, 0, 0 };
+		meanMsecs[i] = 0;
+	}
+	frameTimes.reserve(KeptFrames);
+}
+
+void ProfilerOverlay::frameShown()
+{
+	++framesSinceSample;
+	if (!frameClock.isValid()) {
+		frameClock.start();
+		return;
+	}
+	float msecs = frameClock.nsecsElapsed() / 1e6f;
+	frameClock.restart();
+	if (frameTimes.size() < KeptFrames) {
+		frameTimes.append(msecs);
+	} else {
+		frameTimes[nextFrame] = msecs;
+		nextFrame = (nextFrame + 1) % KeptFrames;
+	}
+}
+
+void ProfilerOverlay::sample()
+{
+	qint64 elapsed = sampleClock.isValid() ? sampleClock.restart() : 0;
+	if (!sampleClock.isValid())
+		sampleClock.start();
+
+	for (int i = 0; i < Profiler::SectionCount; ++i) {
+		Profiler::Totals totals = Profiler::totals(Profiler::Section(i));
+		// Counts start over after Profiler::clear
+		Profiler::Totals last = totals.count < lastTotals[i].count ? Profiler::Totals { 0, 0, 0 } : lastTotals[i];
+		quint64 count = totals.count - last.count;
+		meanMsecs[i] = count ? (totals.nsecs - last.nsecs) / 1e6 / count : 0;
+		if (i == Profiler::Rasterize && elapsed > 0)
+			samplesPerSecond = count * 1000.0 / elapsed;
+		lastTotals[i] = totals;
+	}
+	if (elapsed > 0)
+		framesPerSecond = framesSinceSample * 1000.0 / elapsed;
+	framesSinceSample = 0;
+}
+
+QRect ProfilerOverlay::rect() const
+{
+	int lines = 1 + Profiler::SectionCount;
+	return QRect(Margin, Margin, OverlayWidth, 3 * Margin + lines * LineHeight + HistogramHeight);
+}
+
+void ProfilerOverlay::paint(QPainter &painter) const
+{
+	QRect area = rect();
+	painter.save();
+	painter.setRenderHint(QPainter::Antialiasing, false);
+	painter.fillRect(area, QColor(0, 0, 0, 176));
+	painter.setPen(Qt::white);
+
+	QRect line(area.left() + Margin, area.top() + Margin, area.width() - 2 * Margin, LineHeight);
+	painter.drawText(line, Qt::AlignLeft | Qt::AlignVCenter,
+			     QStringLiteral("%1 fps   %2 samples/s")
+				     .arg(framesPerSecond, 0, 'f', 1).arg(samplesPerSecond, 0, 'f', 0));
+	for (int i = 0; i < Profiler::SectionCount; ++i) {
+		line.translate(0, LineHeight);
+		painter.drawText(line, Qt::AlignLeft | Qt::AlignVCenter, Profiler::sectionName(Profiler::Section(i)));
+		painter.drawText(line, Qt::AlignRight | Qt::AlignVCenter,
+				     QStringLiteral("%1 ms").arg(meanMsecs[i], 0, 'f', 3));
+	}
+
+	// Frame times in 4 ms buckets, the last one taking everything slower
+	int counts[Buckets] = {};
+	int highest = 1;
+	for (float msecs : frameTimes) {
+		int bucket = qMin(int(msecs / BucketMsecs), int(Buckets) - 1);
+		highest = qMax(highest, ++counts[bucket]);
+	}
+	QRect histogram(area.left() + Margin, line.bottom() + 1 + Margin,
+			    area.width() - 2 * Margin, HistogramHeight);
+	int barWidth = histogram.width() / Buckets;
+	for (int i = 0; i < Buckets; ++i) {
+		int height = counts[i] * histogram.height() / highest;
+		// Frames slower than a 60 Hz refresh stand out
+		QColor color = (i + 1) * BucketMsecs <= 16 ? QColor(96, 208, 96) : QColor(232, 96, 64);
+		painter.fillRect(histogram.left() + i * barWidth, histogram.bottom() + 1 - height,
+				     barWidth - 1, height, color);
+	}
+	painter.restore();
+}
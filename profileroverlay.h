@@ -0,0 +1,47 @@
+#ifndef PROFILEROVERLAY_H
+#define PROFILEROVERLAY_H
+
+#include <QElapsedTimer>
+#include <QRect>
+#include <QVector>
+
+#include "profiler.h"
+
+class QPainter;
+
+// Heads up display in the corner of the canvas with the frame rate, a
+// histogram of recent frame times, the samples rasterized per second
+// and the mean time of every profiled section
+class ProfilerOverlay
+{
+	public:
+
+		ProfilerOverlay();
+
+		// Called at the end of every paintEvent
+		void frameShown();
+
+		// Takes the rates over the time since it was last called
+		void sample();
+
+		// Where the overlay goes, in widget coordinates
+		QRect rect() const;
+		void paint(QPainter &painter) const;
+
+	private:
+
+		enum { KeptFrames = 240, Buckets = 16, BucketMsecs = 4 };
+
+		QElapsedTimer frameClock;
+		QVector<float> frameTimes;
+		int nextFrame;
+		int framesSinceSample;
+
+		QElapsedTimer sampleClock;
+		Profiler::Totals lastTotals[Profiler::SectionCount];
+		qreal framesPerSecond;
+		qreal samplesPerSecond;
+		qreal meanMsecs[Profiler::SectionCount];
+};
+
+#endif // PROFILEROVERLAY_H
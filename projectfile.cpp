@@ -0,0 +1,298 @@
+#include <QDataStream>
+#include <QFileInfo>
+#include <QMutex>
+#include <QPainter>
+
+#include <climits>
+#include <cstring>
+
+#include "projectfile.h"
+
+static const char ProjectMagic[4] = { 'E', 'B', 'R', 'U' };
+
+// Callers that don't care why pass no error string
+static void setError(QString *error, const QString &message)
+{
+	if (error)
+		*error = message;
+}
+
+const ProjectFile::Entry *ProjectFile::Index::entry(int layer, int column, int row) const
+{
+	if (layer >= layers.size() || column >= columns || row >= rows)
+		return nullptr;
+	return &layers.at(layer).at(row * columns + column);
+}
+
+int ProjectFile::Index::find(int layerId) const
+{
+	return layerIds.indexOf(layerId);
+}
+
+bool ProjectFile::isProjectFile(const QString &fileName)
+{
+	return QFileInfo(fileName).suffix().compare(QLatin1String("ebru"), Qt::CaseInsensitive) == 0;
+}
+
+ProjectFile::ProjectFile(const QString &fileName)
+	: file(fileName)
+	, data(nullptr)
+	, mappedSize(0)
+{
+}
+
+// Only the header and the index are read, so opening takes the
+// same time no matter how many tiles there are behind them
+QSharedPointer<ProjectFile> ProjectFile::open(const QString &fileName, QString *error)
+{
+	QSharedPointer<ProjectFile> project(new ProjectFile(fileName));
+	if (!project->file.open(QIODevice::ReadOnly)) {
+		setError(error, project->file.errorString());
+		return QSharedPointer<ProjectFile>();
+	}
+	project->mappedSize = project->file.size();
+	if (project->mappedSize >= HeaderSize)
+		project->data = project->file.map(0, project->mappedSize);
+	if (!project->data) {
+		setError(error, QObject::tr("The file could not be mapped"));
+		return QSharedPointer<ProjectFile>();
+	}
+
+	QDataStream header(QByteArray::fromRawData(reinterpret_cast<const char *>(project->data), HeaderSize));
+	char magic[4];
+	header.readRawData(magic, 4);
+	quint32 version, width, height, tileSize, columns, rows, layerCount;
+	quint64 indexOffset;
+	header >> version >> width >> height >> tileSize >> columns >> rows >> layerCount >> indexOffset;
+	if (memcmp(magic, ProjectMagic, 4) != 0 || version < 1 || version > Version) {
+		setError(error, QObject::tr("Not an Ebru project"));
+		return QSharedPointer<ProjectFile>();
+	}
+	// The field was reserved before there were layers
+	if (version == 1)
+		layerCount = 1;
+	// Sizes are checked against what is left after an offset, so a
+	// crafted offset can't wrap the sum around past the end
+	const quint64 size = quint64(project->mappedSize);
+	if (tileSize != TiledSurface::TileSize || layerCount < 1 || layerCount > MaxLayers
+	    || columns != (width + tileSize - 1) / tileSize || rows != (height + tileSize - 1) / tileSize
+	    || indexOffset > size || quint64(columns) * rows * EntrySize * layerCount > size - indexOffset) {
+		setError(error, QObject::tr("The project file is damaged"));
+		return QSharedPointer<ProjectFile>();
+	}
+
+	Index &index = project->tileIndex;
+	index.fileName = QFileInfo(fileName).absoluteFilePath();
+	index.columns = int(columns);
+	index.rows = int(rows);
+	index.layers.resize(int(layerCount));
+	QDataStream stream(QByteArray::fromRawData(reinterpret_cast<const char *>(project->data + indexOffset),
+								 int(qMin(project->mappedSize - qint64(indexOffset), qint64(INT_MAX)))));
+	for (int layer = 0; layer < int(layerCount); ++layer) {
+		LayerStack::Layer settings;
+		QColor background(Qt::white);
+		if (version == 1) {
+			settings.name = QObject::tr("Paper");
+		} else {
+			double opacity;
+			quint32 blendMode, color;
+			quint8 visible;
+			stream >> settings.name >> opacity >> blendMode >> visible >> color;
+			settings.opacity = qBound(0.0, opacity, 1.0);
+			if (blendMode <= quint32(QPainter::CompositionMode_Exclusion))
+				settings.blendMode = QPainter::CompositionMode(blendMode);
+			settings.visible = visible != 0;
+			background = QColor::fromRgba(color);
+		}
+		project->layerSettings.append(settings);
+		project->layerBackgrounds.append(background);
+
+		QVector<Entry> &entries = index.layers[layer];
+		entries.resize(int(columns * rows));
+		for (Entry &entry : entries) {
+			stream >> entry.offset >> entry.size;
+			entry.imageKey = 0;
+			if (stream.status() != QDataStream::Ok || entry.offset > size || entry.size > size - entry.offset) {
+				setError(error, QObject::tr("The project file is damaged"));
+				return QSharedPointer<ProjectFile>();
+			}
+		}
+	}
+	project->surfaceSize = QSize(int(width), int(height));
+	return project;
+}
+
+QVector<LayerStack::Layer> ProjectFile::layers() const
+{
+	QVector<LayerStack::Layer> result = layerSettings;
+	for (int layer = 0; layer < result.size(); ++layer) {
+		TiledSurface *surface = new TiledSurface;
+		surface->setBackgroundColor(layerBackgrounds.at(layer));
+		surface->resize(surfaceSize);
+		surface->setSource(QSharedPointer<const TileSource>(new LayerTiles(sharedFromThis(), layer)));
+		result[layer].surface.reset(surface);
+	}
+	return result;
+}
+
+bool ProjectFile::hasTile(int layer, int column, int row) const
+{
+	const Entry *entry = tileIndex.entry(layer, column, row);
+	return entry && entry->size > 0;
+}
+
+QByteArray ProjectFile::chunk(int layer, int column, int row) const
+{
+	const Entry *entry = tileIndex.entry(layer, column, row);
+	if (!entry || entry->size == 0)
+		return QByteArray();
+	return QByteArray::fromRawData(reinterpret_cast<const char *>(data + entry->offset), int(entry->size));
+}
+
+QImage ProjectFile::loadTile(int layer, int column, int row) const
+{
+	const Entry *entry = tileIndex.entry(layer, column, row);
+	if (!entry || entry->size == 0)
+		return QImage();
+
+	QByteArray pixels = qUncompress(data + entry->offset, int(entry->size));
+	QImage image(TiledSurface::TileSize, TiledSurface::TileSize, QImage::Format_ARGB32_Premultiplied);
+	if (pixels.size() != image.sizeInBytes())
+		return QImage();
+	memcpy(image.bits(), pixels.constData(), size_t(pixels.size()));
+	return image;
+}
+
+QByteArray ProjectFile::compressTile(const QImage &tile)
+{
+	return qCompress(tile.constBits(), int(tile.sizeInBytes()), 1);
+}
+
+bool ProjectFile::save(const LayerStack &layers, const QString &fileName,
+			     const Index &previous, Index *saved, QString *error,
+			     const std::function<void(int)> &progress)
+{
+	// Two saves appending to the same file would trip over each other
+	static QMutex saveMutex;
+	QMutexLocker saveLocker(&saveMutex);
+
+	QString absolutePath = QFileInfo(fileName).absoluteFilePath();
+	const ProjectFile *opened = nullptr;
+	for (int layer = 0; layer < layers.count(); ++layer) {
+		const LayerTiles *tiles = dynamic_cast<const LayerTiles *>(layers.layer(layer).surface->tileSource().data());
+		if (tiles && tiles->project->tileIndex.fileName == absolutePath)
+			opened = tiles->project.data();
+	}
+
+	// Truncating the file the tiles are mapped from would lose them,
+	// so a save to it is always incremental
+	const Index *base = nullptr;
+	if (previous.fileName == absolutePath && QFile::exists(absolutePath))
+		base = &previous;
+	else if (opened)
+		base = &opened->tileIndex;
+
+	QFile out(fileName);
+	if (!out.open(base ? QIODevice::ReadWrite : QIODevice::WriteOnly | QIODevice::Truncate)) {
+		setError(error, out.errorString());
+		return false;
+	}
+	qint64 end = base ? out.size() : HeaderSize;
+	if (!base)
+		out.write(QByteArray(HeaderSize, 0));
+	out.seek(end);
+
+	const QSize size = layers.size();
+	Index index;
+	index.fileName = absolutePath;
+	index.columns = (size.width() + TiledSurface::TileSize - 1) / TiledSurface::TileSize;
+	index.rows = (size.height() + TiledSurface::TileSize - 1) / TiledSurface::TileSize;
+	index.layerIds.resize(layers.count());
+	index.layers.resize(layers.count());
+
+	auto append = [&](const QByteArray &chunk, qint64 imageKey) -> Entry {
+		Entry entry = { quint64(end), quint32(chunk.size()), imageKey };
+		out.write(chunk);
+		end += chunk.size();
+		return entry;
+	};
+
+	int rowsWritten = 0;
+	for (int layer = 0; layer < layers.count(); ++layer) {
+		const TiledSurface &surface = *layers.layer(layer).surface;
+		const LayerTiles *tiles = dynamic_cast<const LayerTiles *>(surface.tileSource().data());
+		// Tiles only match what was saved for the same layer
+		int baseLayer = base ? base->find(layers.layer(layer).id) : -1;
+		QRect backgroundRect(QPoint(0, 0), surface.background().size());
+
+		index.layerIds[layer] = layers.layer(layer).id;
+		QVector<Entry> &entries = index.layers[layer];
+		entries.resize(index.columns * index.rows);
+
+		for (int row = 0; row < index.rows; ++row) {
+			for (int column = 0; column < index.columns; ++column) {
+				QImage image = surface.tileImage(column, row);
+				const Entry *old = baseLayer >= 0 ? base->entry(baseLayer, column, row) : nullptr;
+				Entry &entry = entries[row * index.columns + column];
+
+				if (old && old->imageKey == image.cacheKey()) {
+					entry = *old;
+				} else if (!image.isNull()) {
+					entry = append(compressTile(image), image.cacheKey());
+				} else if (tiles && tiles->hasTile(column, row)) {
+					// Never looked at since it was opened, the chunk is
+					// copied or kept without decompressing it
+					if (tiles->project.data() == opened)
+						entry = *opened->tileIndex.entry(tiles->layer, column, row);
+					else
+						entry = append(tiles->project->chunk(tiles->layer, column, row), 0);
+				} else if (backgroundRect.intersects(surface.tileRect(column, row))) {
+					QImage tile(TiledSurface::TileSize, TiledSurface::TileSize, QImage::Format_ARGB32_Premultiplied);
+					QPainter painter(&tile);
+					painter.setCompositionMode(QPainter::CompositionMode_Source);
+					painter.translate(-column * TiledSurface::TileSize, -row * TiledSurface::TileSize);
+					surface.render(painter, surface.tileRect(column, row));
+					painter.end();
+					entry = append(compressTile(tile), 0);
+				} else {
+					entry = Entry { 0, 0, 0 };
+				}
+			}
+			if (progress)
+				progress(++rowsWritten * 100 / (index.rows * layers.count()));
+		}
+	}
+
+	// The new index goes after the chunks, the header is only pointed
+	// at it once everything it refers to has been written
+	qint64 indexOffset = end;
+	{
+		QDataStream stream(&out);
+		for (int layer = 0; layer < layers.count(); ++layer) {
+			const LayerStack::Layer &settings = layers.layer(layer);
+			stream << settings.name << double(settings.opacity) << quint32(settings.blendMode)
+			       << quint8(settings.visible) << quint32(settings.surface->backgroundColor().rgba());
+			for (const Entry &entry : index.layers.at(layer))
+				stream << entry.offset << quint32(entry.size);
+		}
+	}
+	out.flush();
+
+	out.seek(0);
+	{
+		QDataStream header(&out);
+		header.writeRawData(ProjectMagic, 4);
+		header << quint32(Version) << quint32(size.width()) << quint32(size.height())
+		       << quint32(TiledSurface::TileSize) << quint32(index.columns) << quint32(index.rows)
+		       << quint32(layers.count()) << quint64(indexOffset);
+	}
+	out.flush();
+
+	if (out.error() != QFileDevice::NoError) {
+		setError(error, out.errorString());
+		return false;
+	}
+	if (saved)
+		*saved = index;
+	return true;
+}
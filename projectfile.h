@@ -0,0 +1,123 @@
+#ifndef PROJECTFILE_H
+#define PROJECTFILE_H
+
+#include <QColor>
+#include <QEnableSharedFromThis>
+#include <QFile>
+#include <QSharedPointer>
+#include <QSize>
+#include <QString>
+#include <QVector>
+
+#include <functional>
+
+#include "layerstack.h"
+#include "tiledsurface.h"
+
+// Ebru project files keep every tile of every layer as its own
+// compressed chunk:
+//
+//   header   "EBRU", version, width, height, tile size, columns,
+//            rows, number of layers and the offset of the index
+//   chunks   qCompress'd premultiplied ARGB32 tile pixels
+//   index    for every layer from the bottom up its name, opacity,
+//            blend mode, visibility and background color, then the
+//            offset and size of the chunk of every tile, row by row
+//
+// Chunks are only ever appended, saving again to the same file writes
+// the tiles that changed and a new index, then points the header at it.
+// Opened files are memory mapped and used as the tile source of the
+// layers, so a tile is only decompressed once it is needed. Version 1
+// files hold a single layer and no layer settings
+class ProjectFile : public QEnableSharedFromThis<ProjectFile>
+{
+	public:
+
+		struct Entry
+		{
+				quint64 offset;
+
+				// 0 for tiles that only show the background
+				quint32 size;
+
+				// QImage::cacheKey of the tile when it was saved,
+				// 0 if it wasn't allocated. Only kept in memory
+				qint64 imageKey;
+		};
+
+		struct Index
+		{
+				Index() : columns(0), rows(0) {}
+				const Entry *entry(int layer, int column, int row) const;
+
+				// Position of the layer with the given LayerStack id, -1
+				// if it wasn't saved
+				int find(int layerId) const;
+
+				QString fileName;
+				int columns;
+				int rows;
+				QVector<int> layerIds;
+				QVector<QVector<Entry> > layers;
+		};
+
+		// The tiles of one layer of an opened project
+		class LayerTiles : public TileSource
+		{
+			public:
+
+				LayerTiles(const QSharedPointer<const ProjectFile> &projectFile, int layerIndex)
+					: project(projectFile), layer(layerIndex) {}
+
+				bool hasTile(int column, int row) const override { return project->hasTile(layer, column, row); }
+				QImage loadTile(int column, int row) const override { return project->loadTile(layer, column, row); }
+
+				QSharedPointer<const ProjectFile> project;
+				int layer;
+		};
+
+		static bool isProjectFile(const QString &fileName);
+
+		// Maps the file and reads its index, no tile is decompressed.
+		// error and saved below may be null
+		static QSharedPointer<ProjectFile> open(const QString &fileName, QString *error);
+
+		// Writes the layers to fileName. If previous is what was last
+		// saved to the same file only the tiles that changed since are
+		// written. The caller owns the layers, no lock is taken
+		static bool save(const LayerStack &layers, const QString &fileName,
+				     const Index &previous, Index *saved, QString *error,
+				     const std::function<void(int)> &progress = std::function<void(int)>());
+
+		QString fileName() const { return file.fileName(); }
+		QSize size() const { return surfaceSize; }
+		const Index &index() const { return tileIndex; }
+
+		// Layers with their settings, their surfaces use the file as
+		// their tile source
+		QVector<LayerStack::Layer> layers() const;
+
+		bool hasTile(int layer, int column, int row) const;
+		QImage loadTile(int layer, int column, int row) const;
+
+		// The compressed chunk of a tile, pointing into the mapping
+		QByteArray chunk(int layer, int column, int row) const;
+
+	private:
+
+		enum { Version = 2, HeaderSize = 40, EntrySize = 12, MaxLayers = 1024 };
+
+		ProjectFile(const QString &fileName);
+
+		static QByteArray compressTile(const QImage &tile);
+
+		QFile file;
+		const uchar *data;
+		qint64 mappedSize;
+		QSize surfaceSize;
+		Index tileIndex;
+		QVector<LayerStack::Layer> layerSettings;
+		QVector<QColor> layerBackgrounds;
+};
+
+#endif // PROJECTFILE_H
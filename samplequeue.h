@@ -0,0 +1,59 @@
+#ifndef SAMPLEQUEUE_H
+#define SAMPLEQUEUE_H
+
+#include <QAtomicInteger>
+
+// Lock-free ring buffer for exactly one producer thread
+// and one consumer thread. Capacity must be a power of two
+template <typename T, int Capacity>
+class SampleQueue
+{
+		static_assert((Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+
+	public:
+
+		SampleQueue()
+			: writeIndex(0)
+			, readIndex(0)
+		{
+		}
+
+		// Producer side, returns false when the queue is full
+		bool push(const T &value)
+		{
+			quint32 head = writeIndex.loadRelaxed();
+			if (head - readIndex.loadAcquire() == quint32(Capacity))
+				return false;
+			buffer[head & (Capacity - 1)] = value;
+			writeIndex.storeRelease(head + 1);
+			return true;
+		}
+
+		// Consumer side, returns false when the queue is empty
+		bool pop(T &value)
+		{
+			quint32 tail = readIndex.loadRelaxed();
+			if (tail == writeIndex.loadAcquire())
+				return false;
+			value = buffer[tail & (Capacity - 1)];
+			readIndex.storeRelease(tail + 1);
+			return true;
+		}
+
+		bool isEmpty() const
+		{
+			return readIndex.loadAcquire() == writeIndex.loadAcquire();
+		}
+
+	private:
+
+		// Padded onto separate cache lines so the two threads
+		// don't keep stealing the line from each other
+		QAtomicInteger<quint32> writeIndex;
+		char writePadding[64 - sizeof(quint32)];
+		QAtomicInteger<quint32> readIndex;
+		char readPadding[64 - sizeof(quint32)];
+		T buffer[Capacity];
+};
+
+#endif // SAMPLEQUEUE_H
@@ -7,49 +7,160 @@
 #endif
 #endif
 
+#include "bandrenderer.h"
+#include "imagesaver.h"
+#include "marblingoperators.h"
+#include "profiler.h"
 #include "scribblearea.h"
 
 ScribbleArea::ScribbleArea()
 	: QWidget(nullptr)
+	, nextPointer(1)
 	, myColor(Qt::red)
-	, myBrush(myColor)
-	, myPen(myBrush, 1.0, Qt::SolidLine, Qt::RoundCap, Qt::RoundJoin)
-	, deviceDown(false)
+	, storeZoom(0)
+	, zoom(1)
+	, panning(false)
+	, canvasGeneration(0)
 	, alphaChannelValuator(TangentialPressureValuator)
 	, colorSaturationValuator(NoValuator)
 	, lineWidthValuator(PressureValuator)
+	, brushSpacing(0.15)
+	, marblingTool(BrushTool)
+	, inkDropRadius(24)
+	, tineSharpness(12)
+	, combSpacing(48)
+	, predictedPointer(-1)
+	, compositedSamples(0)
+	, predicting(false)
+	, showingProfiler(false)
+	, hasTabletCursor(false)
+	, rasterizer(layers.currentSurface())
 {
 	// Roots the widget to the top left even if resized
 	setAttribute(Qt::WA_StaticContents);
 	resize(500, 500);
 	setAutoFillBackground(true);
 	setAttribute(Qt::WA_TabletTracking);
+	setAttribute(Qt::WA_AcceptTouchEvents);
 
 	modified = false;
 	scribbling = false;
 	myPenWidth = 1;
 	myColor = Qt::blue;
 	clearImage();
+
+	// Tablet strokes are painted on the rasterizer thread, we
+	// only composite what it reports back
+	connect(&rasterizer, &StrokeRasterizer::painted, this,
+		  &ScribbleArea::scheduleFrame, Qt::QueuedConnection);
+	connect(&rasterizer, &StrokeRasterizer::strokeFinished, this,
+		  &ScribbleArea::commitFinishedStrokes, Qt::QueuedConnection);
+	connect(&replayer, &StrokeReplayer::sample, this, &ScribbleArea::queueReplayedSample);
+
+	// Frames of the marbling bath, at most one per display refresh
+	bathTimer.setInterval(16);
+	connect(&bathTimer, &QTimer::timeout, this, &ScribbleArea::stepBath);
+
+	// What the rasterizer painted is picked up at most once per
+	// display refresh
+	frameTimer.setSingleShot(true);
+	frameTimer.setTimerType(Qt::PreciseTimer);
+	connect(&frameTimer, &QTimer::timeout, this, &ScribbleArea::compositePaintedRegion);
+	frameClock.start();
+
+	profilerTimer.setInterval(250);
+	connect(&profilerTimer, &QTimer::timeout, this, &ScribbleArea::refreshProfilerOverlay);
+	rasterizer.start();
 }
 
-// Used to load the image and place it in the widget
-bool ScribbleArea::openImage(const QString &fileName)
+ScribbleArea::~ScribbleArea()
 {
+	rasterizer.stop();
+	for (ImageSaver *saver : findChildren<ImageSaver *>())
+		saver->wait();
+}
 
-	bool success = imageMap.load(fileName);
+// Used to load the image and place it in the widget, it becomes
+// the paper under a fresh paint layer so only the tiles we paint
+// on afterwards get allocated
+bool ScribbleArea::openImage(const QString &fileName, QString *error)
+{
+	setMarbling(false);
+	QString reason;
+	if (ProjectFile::isProjectFile(fileName)) {
+		if (openProject(fileName, &reason))
+			return true;
+		if (error)
+			*error = reason;
+		return false;
+	}
 
-	if (success) {
-		modified = false;
-		update();
-		return true;
+	QImageReader reader(fileName);
+	QImage loadedImage = reader.read();
+	if (loadedImage.isNull()) {
+		if (error)
+			*error = reader.errorString();
+		return false;
 	}
-	return false;
+
+	finishStrokes();
+	layers.reset(loadedImage);
+	useCurrentLayer();
+	resetHistory();
+	resizeImage(loadedImage.size().expandedTo(size()));
+	modified = false;
+	updateCanvas();
+	return true;
+}
+
+// Projects are mapped and become the tile source of the layers,
+// tiles are only decompressed when they are drawn or painted on
+bool ScribbleArea::openProject(const QString &fileName, QString *error)
+{
+	setMarbling(false);
+	QSharedPointer<ProjectFile> project = ProjectFile::open(fileName, error);
+	if (!project)
+		return false;
+
+	finishStrokes();
+	QVector<LayerStack::Layer> projectLayers = project->layers();
+	layers.setLayers(projectLayers, projectLayers.size() - 1);
+	useCurrentLayer();
+	resizeImage(project->size().expandedTo(size()));
+	resetHistory();
+	savedProject = project->index();
+	modified = false;
+	updateCanvas();
+	return true;
 }
 
 // Save the current image
 bool ScribbleArea::saveImage(const QString &fileName)
 {
-	return imageMap.save(fileName);
+	if (ProjectFile::isProjectFile(fileName)) {
+		QString error;
+		return ProjectFile::save(layers.snapshot(), fileName, savedProject, &savedProject, &error);
+	}
+	return layers.toImage().save(fileName);
+}
+
+// Only the tile handles are copied here, the saver flattens and
+// encodes on its own thread while painting carries on
+void ScribbleArea::saveImageInBackground(const QString &fileName, int scale)
+{
+	ImageSaver *saver = new ImageSaver(layers.snapshot(), fileName, this);
+	saver->setScale(scale);
+	saver->setPreviousIndex(savedProject);
+	int generation = canvasGeneration;
+	connect(saver, &ImageSaver::saved, this, [this, saver, generation]() {
+		if (generation == canvasGeneration && ProjectFile::isProjectFile(saver->fileName()))
+			savedProject = saver->savedIndex();
+	});
+	connect(saver, &ImageSaver::progress, this, &ScribbleArea::saveProgress);
+	connect(saver, &ImageSaver::saved, this, &ScribbleArea::saveFinished);
+	connect(saver, &ImageSaver::failed, this, &ScribbleArea::saveFailed);
+	connect(saver, &QThread::finished, saver, &QObject::deleteLater);
+	saver->start(QThread::LowPriority);
 }
 
 // Used to change the pen color
@@ -64,38 +175,58 @@ void ScribbleArea::setPenWidth(int newWidth)
 	myPenWidth = newWidth;
 }
 
-// Color the image area with white
+// Every layer goes, a blank one is left over the paper
 void ScribbleArea::clearImage()
 {
-	imageMap.fill(Qt::white);
-	QImage backgroundImage(":/images/images/watercolorpaper.jpg");
-	backgroundImage = backgroundImage.scaled(this->size(), Qt::AspectRatioMode::KeepAspectRatioByExpanding);
-	imageMap = backgroundImage;
-
+	setMarbling(false);
+	QImage paper = paperTexture(layers.size().expandedTo(size()));
 
-	for(int i = 0; i < imageMap.width(); i++)
-	{
-		for(int j = 0; j < imageMap.height();j++)
-		{
-			if(i == j)
-			{
-				imageMap.setPixelColor(i,j, Qt::black);
-			}
-		}
-	}
+	// Fresh layers bring back the paper underneath, the tiles share
+	// the texture until they are painted on
+	finishStrokes();
+	layers.reset(paper);
+	useCurrentLayer();
+	resetHistory();
+	resizeImage(layers.size().expandedTo(paper.size()));
 
 	modified = true;
-	update();
+	updateCanvas();
+}
+
+// The watercolor paper covering the canvas. The paper layer holds
+// canvas pixels, so the texture is decoded straight at that size and
+// the full size image is never kept. It is decoded again only when the
+// canvas has grown past it
+QImage ScribbleArea::paperTexture(const QSize &canvasSize)
+{
+	if (!paperScaled.isNull() && paperScaled.width() >= canvasSize.width()
+	    && paperScaled.height() >= canvasSize.height())
+		return paperScaled;
+
+	QImageReader reader(QStringLiteral(":/images/images/watercolorpaper.jpg"));
+	QSize decoded = reader.size();
+	if (decoded.isValid()) {
+		decoded.scale(canvasSize, Qt::KeepAspectRatioByExpanding);
+		reader.setScaledSize(decoded);
+	}
+	paperScaled = reader.read().convertToFormat(QImage::Format_ARGB32_Premultiplied);
+	return paperScaled;
 }
 
 // If a mouse button is pressed check if it was the
-// left button and if so store the current position
+// left button and if so start a stroke at the current position
 // Set that we are currently drawing
 void ScribbleArea::mousePressEvent(QMouseEvent *event)
 {
+	Profiler::Scope profile(Profiler::InputEvent);
+	if (event->button() == Qt::MiddleButton) {
+		panning = true;
+		lastPanPoint = event->localPos();
+		return;
+	}
 	if (event->button() == Qt::LeftButton) {
-		lastPoint = event->pos();
 		scribbling = true;
+		queueSample(mouseSample(StrokeSample::Press, event));
 	}
 }
 
@@ -104,33 +235,43 @@ void ScribbleArea::setTabletDevice(QTabletEvent *event)
 	updateCursor(event);
 }
 
-// When the mouse moves if the left button is clicked
-// we call the drawline function which draws a line
-// from the last position to the current
+// When the mouse moves if the left button is clicked the
+// rasterizer draws a line from the last position to the current
 void ScribbleArea::mouseMoveEvent(QMouseEvent *event)
 {
+	Profiler::Scope profile(Profiler::InputEvent);
+	if (panning) {
+		setPan(pan + event->localPos() - lastPanPoint);
+		lastPanPoint = event->localPos();
+		return;
+	}
 	if ((event->buttons() & Qt::LeftButton) && scribbling)
-		drawLineTo(event->pos());
+		queueSample(mouseSample(StrokeSample::Move, event));
 }
 
 // If the button is released we set variables to stop drawing
 void ScribbleArea::mouseReleaseEvent(QMouseEvent *event)
 {
+	Profiler::Scope profile(Profiler::InputEvent);
+	if (event->button() == Qt::MiddleButton) {
+		panning = false;
+		return;
+	}
 	if (event->button() == Qt::LeftButton && scribbling) {
-		drawLineTo(event->pos());
+		queueSample(mouseSample(StrokeSample::Move, event));
+		queueSample(mouseSample(StrokeSample::Release, event));
 		scribbling = false;
 	}
 }
 
 void ScribbleArea::tabletEvent(QTabletEvent *event)
 {
+	Profiler::Scope profile(Profiler::InputEvent);
 	switch (event->type()) {
 		case QEvent::TabletPress:
-			if (!deviceDown) {
-				deviceDown = true;
-				lastTabletPoint.pos = event->posF();
-				lastTabletPoint.pressure = event->pressure();
-				lastTabletPoint.rotation = event->rotation();
+			if (!tabletsDown.contains(tabletPointer(event))) {
+				tabletsDown.insert(tabletPointer(event));
+				queueSample(strokeSample(StrokeSample::Press, event));
 			}
 			break;
 		case QEvent::TabletMove:
@@ -138,18 +279,16 @@ void ScribbleArea::tabletEvent(QTabletEvent *event)
 			if (event->device() == QTabletEvent::RotationStylus)
 				updateCursor(event);
 #endif
-			if (deviceDown) {
-				updateBrush(event);
-				QPainter painter(&imageMap);
-				paintPixmap(painter, event);
-				lastTabletPoint.pos = event->posF();
-				lastTabletPoint.pressure = event->pressure();
-				lastTabletPoint.rotation = event->rotation();
+			if (tabletsDown.contains(tabletPointer(event))) {
+				reportUnsupportedDevice(event);
+				queueSample(strokeSample(StrokeSample::Move, event));
 			}
 			break;
 		case QEvent::TabletRelease:
-			if (deviceDown && event->buttons() == Qt::NoButton)
-				deviceDown = false;
+			if (tabletsDown.contains(tabletPointer(event)) && event->buttons() == Qt::NoButton) {
+				tabletsDown.remove(tabletPointer(event));
+				queueSample(strokeSample(StrokeSample::Release, event));
+			}
 			update();
 			break;
 		default:
@@ -158,265 +297,862 @@ void ScribbleArea::tabletEvent(QTabletEvent *event)
 	event->accept();
 }
 
-qreal ScribbleArea::pressureToWidth(qreal pressure)
+// Each tool keeps its number for as long as the canvas lives
+int ScribbleArea::tabletPointer(const QTabletEvent *event)
 {
-	return pressure * 10 + 1;
+	int &pointer = tabletPointers[event->uniqueId()];
+	if (pointer == 0)
+		pointer = nextPointer++;
+	return pointer;
 }
 
-void ScribbleArea::updateCursor(const QTabletEvent *event)
+bool ScribbleArea::event(QEvent *event)
 {
-	QCursor cursor;
-	if (event->type() != QEvent::TabletLeaveProximity) {
-		if (event->pointerType() == QTabletEvent::Eraser) {
-			cursor = QCursor(QPixmap(":/images/cursor-eraser.png"), 3, 28);
+	switch (event->type()) {
+		case QEvent::TouchBegin:
+		case QEvent::TouchUpdate:
+		case QEvent::TouchEnd:
+		case QEvent::TouchCancel:
+			touchEvent(static_cast<QTouchEvent *>(event));
+			return true;
+		default:
+			return QWidget::event(event);
+	}
+}
+
+// Fingers paint like a stylus. Points that are cancelled or let go
+// finish their strokes where they were last seen
+void ScribbleArea::touchEvent(QTouchEvent *event)
+{
+	Profiler::Scope profile(Profiler::InputEvent);
+	if (event->type() == QEvent::TouchCancel) {
+		for (QHash<int, int>::const_iterator it = touchPointers.constBegin(); it != touchPointers.constEnd(); ++it) {
+			StrokeSample sample = touchSample(StrokeSample::Release, event, QTouchEvent::TouchPoint(it.key()));
+			sample.pos = touchPositions.value(it.key());
+			queueSample(sample);
+		}
+		touchPointers.clear();
+		touchPositions.clear();
+		event->accept();
+		return;
+	}
+
+	for (const QTouchEvent::TouchPoint &point : event->touchPoints()) {
+		if (point.state() == Qt::TouchPointPressed && !touchPointers.contains(point.id())) {
+			touchPointers.insert(point.id(), nextPointer++);
+			touchPositions.insert(point.id(), toCanvas(point.pos()));
+			queueSample(touchSample(StrokeSample::Press, event, point));
+		} else if (!touchPointers.contains(point.id())) {
+			continue;
+		} else if (point.state() == Qt::TouchPointMoved) {
+			touchPositions.insert(point.id(), toCanvas(point.pos()));
+			queueSample(touchSample(StrokeSample::Move, event, point));
+		} else if (point.state() == Qt::TouchPointReleased) {
+			queueSample(touchSample(StrokeSample::Move, event, point));
+			queueSample(touchSample(StrokeSample::Release, event, point));
+			touchPointers.remove(point.id());
+			touchPositions.remove(point.id());
+		}
+	}
+	event->accept();
+}
+
+StrokeSample ScribbleArea::touchSample(StrokeSample::Type type, const QTouchEvent *event,
+					 const QTouchEvent::TouchPoint &point)
+{
+	bool hasPressure = event->device() && (event->device()->capabilities() & QTouchDevice::Pressure);
+
+	StrokeSample sample;
+	sample.type = type;
+	sample.pointer = touchPointers.value(point.id());
+	sample.timestamp = event->timestamp();
+	sample.pos = toCanvas(point.pos());
+	sample.pressure = hasPressure ? point.pressure() : 0.5;
+	sample.tangentialPressure = 0.0;
+	sample.rotation = point.rotation();
+	sample.xTilt = 0.0;
+	sample.yTilt = 0.0;
+	sample.device = QTabletEvent::Stylus;
+	sample.pointerType = QTabletEvent::Pen;
+	sample.color = myColor;
+	sample.alphaChannelValuator = alphaChannelValuator;
+	sample.colorSaturationValuator = colorSaturationValuator;
+	sample.lineWidthValuator = lineWidthValuator;
+	sample.spacing = brushSpacing;
+	sample.penWidth = myPenWidth;
+	return sample;
+}
+
+// Copies everything the rasterizer needs out of the event
+StrokeSample ScribbleArea::strokeSample(StrokeSample::Type type, const QTabletEvent *event)
+{
+	StrokeSample sample;
+	sample.type = type;
+	sample.pointer = tabletPointer(event);
+	sample.timestamp = event->timestamp();
+	sample.pos = toCanvas(event->posF());
+	sample.pressure = event->pressure();
+	sample.tangentialPressure = event->tangentialPressure();
+	sample.rotation = event->rotation();
+	sample.xTilt = event->xTilt();
+	sample.yTilt = event->yTilt();
+	sample.device = event->device();
+	sample.pointerType = event->pointerType();
+	sample.color = myColor;
+	sample.alphaChannelValuator = alphaChannelValuator;
+	sample.colorSaturationValuator = colorSaturationValuator;
+	sample.lineWidthValuator = lineWidthValuator;
+	sample.spacing = brushSpacing;
+	sample.penWidth = myPenWidth;
+	return sample;
+}
+
+// Mouse samples go down the same path as tablet samples
+StrokeSample ScribbleArea::mouseSample(StrokeSample::Type type, const QMouseEvent *event) const
+{
+	StrokeSample sample;
+	sample.type = type;
+	sample.pointer = 0;
+	sample.timestamp = event->timestamp();
+	sample.pos = toCanvas(event->localPos());
+	sample.pressure = 1.0;
+	sample.tangentialPressure = 0.0;
+	sample.rotation = 0.0;
+	sample.xTilt = 0.0;
+	sample.yTilt = 0.0;
+	sample.device = QTabletEvent::NoDevice;
+	sample.pointerType = QTabletEvent::UnknownPointer;
+	sample.color = myColor;
+	sample.alphaChannelValuator = alphaChannelValuator;
+	sample.colorSaturationValuator = colorSaturationValuator;
+	sample.lineWidthValuator = lineWidthValuator;
+	sample.spacing = brushSpacing;
+	sample.penWidth = myPenWidth;
+	return sample;
+}
+
+// Everything that reaches the rasterizer also goes into the
+// stroke log while one is being recorded
+void ScribbleArea::queueSample(const StrokeSample &sample)
+{
+	if (bath.isRunning()) {
+		dragBath(sample);
+		return;
+	}
+	if (marblingTool != BrushTool) {
+		applyMarblingTool(sample);
+		return;
+	}
+	strokeLog.record(sample);
+	if (!sample.isMouse())
+		trackSample(sample);
+	rasterizer.enqueue(sample);
+}
+
+// Numbers the sample the way the rasterizer is about to, so the frame
+// that shows it can be told apart, and feeds the stroke prediction
+void ScribbleArea::trackSample(const StrokeSample &sample)
+{
+	quint64 sequence = rasterizer.queuedSamples();
+	latency.sampleQueued(sequence, sample.timestamp);
+
+	// What an eraser uncovers can't be drawn ahead of it
+	if (sample.type == StrokeSample::Press)
+		predictedPointer = sample.pointerType == QTabletEvent::Eraser ? -1 : sample.pointer;
+	if (sample.pointer != predictedPointer) {
+		scheduleFrame();
+		return;
+	}
+
+	switch (sample.type) {
+		case StrokeSample::Press:
+			predictor.reset();
+			unpaintedPoints.clear();
+			predictedPen = QPen(sample.color, StrokeRasterizer::penWidth(sample), Qt::SolidLine,
+					    Qt::RoundCap, Qt::RoundJoin);
+			Q_FALLTHROUGH();
+		case StrokeSample::Move:
+			predictor.addSample(sample.pos, sample.timestamp);
+			unpaintedPoints.append(QueuedPoint { sequence, sample.pos });
+			predictedPen.setWidthF(StrokeRasterizer::penWidth(sample));
+			break;
+		case StrokeSample::Release:
+			// The rest of the stroke is still shown until it is painted,
+			// only nothing is guessed past its end
+			predictor.reset();
+			break;
+	}
+	scheduleFrame();
+}
+
+void ScribbleArea::setProfilerOverlay(bool show)
+{
+	showingProfiler = show;
+	if (show) {
+		profilerOverlay.sample();
+		profilerTimer.start();
+	} else {
+		profilerTimer.stop();
+	}
+	update(profilerOverlay.rect());
+}
+
+// The overlay is redrawn a few times a second even while nothing
+// else changes
+void ScribbleArea::refreshProfilerOverlay()
+{
+	profilerOverlay.sample();
+	update(profilerOverlay.rect());
+}
+
+void ScribbleArea::setStrokePrediction(bool predict)
+{
+	predicting = predict;
+	updatePrediction();
+}
+
+// As far ahead as the input is behind, within reason
+qreal ScribbleArea::predictionHorizon() const
+{
+	if (latency.measurements() == 0)
+		return 16;
+	return qBound(qreal(4), latency.percentile(0.5), qreal(48));
+}
+
+// The tail covers the samples the rasterizer hasn't got to yet and
+// then where the stroke is heading
+void ScribbleArea::updatePrediction()
+{
+	QRect oldRect = predictedRect;
+	predictedTail.clear();
+	predictedRect = QRect();
+
+	if (predicting && !unpaintedPoints.isEmpty()) {
+		for (const QueuedPoint &point : unpaintedPoints)
+			predictedTail << point.pos;
+		predictedTail += predictor.predict(predictionHorizon());
+		if (predictedTail.size() > 1) {
+			int margin = qCeil(predictedPen.widthF() / 2) + 2;
+			predictedRect = predictedTail.boundingRect().toAlignedRect()
+					.adjusted(-margin, -margin, margin, margin);
 		} else {
-			switch (event->device()) {
-				case QTabletEvent::Stylus:
-					cursor = QCursor(QPixmap(":/images/cursor-pencil.png"), 0, 0);
-					break;
-				case QTabletEvent::Airbrush:
-					cursor = QCursor(QPixmap(":/images/cursor-airbrush.png"), 3, 4);
-					break;
-				case QTabletEvent::RotationStylus: {
-					QImage origImg(QLatin1String(":/images/cursor-felt-marker.png"));
-					QImage img(32, 32, QImage::Format_ARGB32);
-					QColor solid = myColor;
-					solid.setAlpha(255);
-					img.fill(solid);
-					QPainter painter(&img);
-					QTransform transform = painter.transform();
-					transform.translate(16, 16);
-					transform.rotate(event->rotation());
-					painter.setTransform(transform);
-					painter.setCompositionMode(QPainter::CompositionMode_DestinationIn);
-					painter.drawImage(-24, -24, origImg);
-					painter.setCompositionMode(QPainter::CompositionMode_HardLight);
-					painter.drawImage(-24, -24, origImg);
-					painter.end();
-					cursor = QCursor(QPixmap::fromImage(img), 16, 16);
-				} break;
-				default:
-					break;
-			}
+			predictedTail.clear();
 		}
 	}
-	setCursor(cursor);
+
+	if (!oldRect.isNull())
+		update(toWidget(oldRect));
+	if (!predictedRect.isNull())
+		update(toWidget(predictedRect));
 }
 
-void ScribbleArea::initPixmap()
+// Strokes push the water, harder pressure stirs a wider area
+void ScribbleArea::dragBath(const StrokeSample &sample)
 {
-	qreal dpr = devicePixelRatioF();
-	QPixmap newPixmap = QPixmap(width() * (int)dpr, height() *(int) dpr);
-	newPixmap.setDevicePixelRatio(dpr);
-	newPixmap.fill(Qt::white);
-	QPainter painter(&newPixmap);
-	if (!imageMap.isNull())
+	if (sample.type == StrokeSample::Move)
+		bath.drag(lastDragPoints.value(sample.pointer, sample.pos), sample.pos, 16 + sample.pressure * 48);
+	if (sample.type == StrokeSample::Release)
+		lastDragPoints.remove(sample.pointer);
+	else
+		lastDragPoints.insert(sample.pointer, sample.pos);
+}
+
+// Each drop or tine is its own undo step. The rasterizer is let finish
+// first so the operation moves the paint of every stroke before it
+void ScribbleArea::applyMarblingTool(const StrokeSample &sample)
+{
+	if (sample.type == StrokeSample::Press)
+		toolPressPoints.insert(sample.pointer, sample.pos);
+	if (sample.type != (marblingTool == InkDropTool ? StrokeSample::Press : StrokeSample::Release))
+		return;
+	QPointF toolPressPoint = toolPressPoints.take(sample.pointer);
+
+	rasterizer.waitUntilIdle();
+	TiledSurface &surface = *layers.currentSurface();
+	QRect changed;
+	TiledSurface::TileSet tiles;
 	{
-		painter.drawPixmap(0, 0, newPixmap);
+		QWriteLocker locker(&surface.lock());
+		surface.beginRecording();
+		switch (marblingTool) {
+			case InkDropTool:
+				changed = MarblingOperators::inkDrop(surface, sample.pos, inkDropRadius, sample.color);
+				break;
+			case TineTool:
+				changed = MarblingOperators::tine(surface, toolPressPoint, sample.pos, tineSharpness);
+				break;
+			case CombTool:
+				changed = MarblingOperators::tine(surface, toolPressPoint, sample.pos, tineSharpness, combSpacing);
+				break;
+			default:
+				break;
+		}
+		tiles = surface.endRecording();
 	}
+	if (changed.isEmpty())
+		return;
 
-	painter.end();
-	imageMap = newPixmap.toImage();
+	history.push(layers.currentSurface(), tiles);
+	emitHistoryChanged();
+	modified = true;
+	updateCanvas(changed);
 }
 
-void ScribbleArea::paintPixmap(QPainter &painter, QTabletEvent *event)
+// The bath takes over the visible part of the canvas, everything it
+// does until it is turned off again is undone as one step
+void ScribbleArea::setMarbling(bool marbling)
 {
-	static qreal maxPenRadius = pressureToWidth(1.0);
-	painter.setRenderHint(QPainter::Antialiasing);
+	if (marbling == bath.isRunning())
+		return;
 
-	switch (event->device()) {
-		case QTabletEvent::Airbrush:
+	if (marbling) {
+		rasterizer.waitUntilIdle();
+		TiledSurface &surface = *layers.currentSurface();
+		QRect area = visibleCanvas() & QRect(QPoint(0, 0), surface.size());
+		if (area.isEmpty())
+			return;
+		QImage paint(area.size(), QImage::Format_ARGB32_Premultiplied);
 		{
-			painter.setPen(Qt::NoPen);
-			QRadialGradient grad(lastTabletPoint.pos, myPen.widthF() * 10.0);
-			QColor color = myBrush.color();
-			color.setAlphaF(color.alphaF() * 0.25);
-			grad.setColorAt(0, myBrush.color());
-			grad.setColorAt(0.5, Qt::transparent);
-			painter.setBrush(grad);
-			qreal radius = grad.radius();
-			painter.drawEllipse(event->posF(), radius, radius);
-			update(QRect(event->pos() - QPoint(radius, radius), QSize(radius * 2, radius * 2)));
+			QWriteLocker locker(&surface.lock());
+			QPainter painter(&paint);
+			painter.setCompositionMode(QPainter::CompositionMode_Source);
+			painter.translate(-area.topLeft());
+			surface.render(painter, area);
+			surface.beginRecording();
 		}
-			break;
-		case QTabletEvent::RotationStylus:
+		bath.start(paint, area);
+		bathClock.start();
+		bathTimer.start();
+	} else {
+		bathTimer.stop();
+		bath.stop();
+		TiledSurface &surface = *layers.currentSurface();
+		TiledSurface::TileSet tiles;
 		{
-			myBrush.setStyle(Qt::SolidPattern);
-			painter.setPen(Qt::NoPen);
-			painter.setBrush(myBrush);
-			QPolygonF poly;
-			qreal halfWidth = pressureToWidth(lastTabletPoint.pressure);
-			QPointF brushAdjust(qSin(qDegreesToRadians(-lastTabletPoint.rotation)) * halfWidth,
-						  qCos(qDegreesToRadians(-lastTabletPoint.rotation)) * halfWidth);
-			poly << lastTabletPoint.pos + brushAdjust;
-			poly << lastTabletPoint.pos - brushAdjust;
-			halfWidth = myPen.widthF();
-			brushAdjust = QPointF(qSin(qDegreesToRadians(-event->rotation())) * halfWidth,
-						    qCos(qDegreesToRadians(-event->rotation())) * halfWidth);
-			poly << event->posF() - brushAdjust;
-			poly << event->posF() + brushAdjust;
-			painter.drawConvexPolygon(poly);
-			update(poly.boundingRect().toRect());
+			QWriteLocker locker(&surface.lock());
+			tiles = surface.endRecording();
 		}
-			break;
+		history.push(layers.currentSurface(), tiles);
+		emitHistoryChanged();
+	}
+	emit marblingChanged(marbling);
+}
+
+// Copies the paint the flow moved back into the surface tiles
+void ScribbleArea::stepBath()
+{
+	qreal seconds = qMin(bathClock.restart() / 1000.0, 0.1);
+	QRect changed = bath.step(seconds);
+	if (changed.isEmpty())
+		return;
+
+	{
+		TiledSurface &surface = *layers.currentSurface();
+		QWriteLocker locker(&surface.lock());
+		const QImage &paint = bath.paint();
+		QRect source = changed.translated(-bath.area().topLeft());
+		surface.paint(changed, [&](QPainter &painter) {
+			painter.setCompositionMode(QPainter::CompositionMode_Source);
+			painter.drawImage(changed.topLeft(), paint, source);
+		});
+	}
+	modified = true;
+	updateCanvas(changed);
+}
+
+bool ScribbleArea::startRecording(const QString &fileName, QString *error)
+{
+	return strokeLog.startRecording(fileName, layers.size(), error);
+}
+
+void ScribbleArea::stopRecording()
+{
+	strokeLog.stopRecording();
+}
+
+// Plays a stroke log onto the canvas as if it was drawn again
+bool ScribbleArea::replayStrokes(const QString &fileName, bool realTime, QString *error)
+{
+	QSize canvasSize;
+	QVector<StrokeSample> samples;
+	if (!StrokeLog::read(fileName, &canvasSize, &samples, error))
+		return false;
+
+	resizeImage(canvasSize.expandedTo(layers.size()));
+	replayPointers.clear();
+	replayer.start(samples, realTime);
+	return true;
+}
+
+// Replayed samples go down the same path as live ones. Every stroke of
+// the log gets a pointer number of its own that live input never uses,
+// and is stamped with our clock for the latency meter
+void ScribbleArea::queueReplayedSample(const StrokeSample &sample)
+{
+	StrokeSample replayed = sample;
+	if (sample.type == StrokeSample::Press || !replayPointers.contains(sample.pointer))
+		replayPointers.insert(sample.pointer, nextPointer++);
+	replayed.pointer = replayPointers.value(sample.pointer);
+	if (sample.type == StrokeSample::Release)
+		replayPointers.remove(sample.pointer);
+	replayed.timestamp = quint64(QElapsedTimer::msecsSinceReference());
+	queueSample(replayed);
+}
+
+// Status tips can only be sent from the GUI thread so devices
+// we can't paint with are reported here instead of while painting
+void ScribbleArea::reportUnsupportedDevice(const QTabletEvent *event)
+{
+	QString error;
+	switch (event->device()) {
+		case QTabletEvent::Stylus:
+		case QTabletEvent::Airbrush:
+		case QTabletEvent::RotationStylus:
+			return;
 		case QTabletEvent::Puck:
 		case QTabletEvent::FourDMouse:
-		{
-			const QString error(tr("This input device is not supported by the example."));
-#if QT_CONFIG(statustip)
-			QStatusTipEvent status(error);
-			QApplication::sendEvent(this, &status);
-#else
-			qWarning() << error;
-#endif
-		}
+			error = tr("This input device is not supported by the example.");
 			break;
 		default:
-		{
-			const QString error(tr("Unknown tablet device - treating as stylus"));
+			error = tr("Unknown tablet device - treating as stylus");
+			break;
+	}
 #if QT_CONFIG(statustip)
-			QStatusTipEvent status(error);
-			QApplication::sendEvent(this, &status);
+	QStatusTipEvent status(error);
+	QApplication::sendEvent(this, &status);
 #else
-			qWarning() << error;
+	qWarning() << error;
 #endif
-		}
-			Q_FALLTHROUGH();
-		case QTabletEvent::Stylus:
-			painter.setPen(myPen);
-			painter.drawLine(lastTabletPoint.pos, event->posF());
-			update(QRect(lastTabletPoint.pos.toPoint(), event->pos()).normalized()
-				 .adjusted(-maxPenRadius, -maxPenRadius, maxPenRadius, maxPenRadius));
-			break;
-	}
 }
 
+// Tablet moves come in by the hundred per second, the cursor is only
+// set again once the pen, the color or the rotation step changes
+void ScribbleArea::updateCursor(const QTabletEvent *event)
+{
+	CursorCache::Key key = CursorCache::key(event, myColor);
+	if (hasTabletCursor && key == tabletCursor)
+		return;
+	tabletCursor = key;
+	hasTabletCursor = true;
+	setCursor(cursors.cursor(key));
+}
 
 // QPainter provides functions to draw on the widget
 // The QPaintEvent is sent to widgets that need to
 // update themselves
 void ScribbleArea::paintEvent(QPaintEvent *event)
 {
-	if(imageMap.isNull())
+	Profiler::Scope profile(Profiler::Paint);
+	if(layers.size().isEmpty())
 	{
-		initPixmap();
+		resizeImage(size());
 	}
+	refreshDisplay();
+
 	QPainter painter(this);
+	drawView(painter, QRectF(event->rect()));
 
-	QRect pixmapPortion = QRect(event->rect().topLeft() * devicePixelRatioF(),
-					    event->rect().size() * devicePixelRatioF());
-	QPixmap pixmap = QPixmap::fromImage(imageMap);
-	painter.drawPixmap(event->rect().topLeft(), pixmap, pixmapPortion);
-	imageMap = pixmap.toImage();
+	// Replaced by the real stroke as the rasterizer catches up
+	if (!predictedTail.isEmpty() && toWidget(predictedRect).intersects(event->rect())) {
+		painter.save();
+		painter.setTransform(viewTransform());
+		painter.setRenderHint(QPainter::Antialiasing);
+		painter.setPen(predictedPen);
+		painter.drawPolyline(predictedTail);
+		painter.restore();
+	}
+	latency.frameShown(compositedSamples);
+
+	if (showingProfiler) {
+		profilerOverlay.frameShown();
+		if (profilerOverlay.rect().intersects(event->rect()))
+			profilerOverlay.paint(painter);
+	}
 }
 
-void ScribbleArea::updateBrush(const QTabletEvent *event)
+// The display store already shows the view at the resolution of the
+// screen, only the exposed part of it is copied. Around the canvas is
+// the dark of the palette
+void ScribbleArea::drawView(QPainter &painter, const QRectF &exposed)
 {
-	int hue, saturation, value, alpha;
-	myColor.getHsv(&hue, &saturation, &value, &alpha);
+	QRectF canvas = viewTransform().mapRect(QRectF(QPointF(0, 0), QSizeF(layers.size())));
+	QRectF visible = exposed & canvas;
+	if (visible != exposed) {
+		QPainterPath outside;
+		outside.addRect(exposed);
+		QPainterPath shown;
+		shown.addRect(visible);
+		painter.fillPath(outside - shown, palette().dark());
+	}
+	if (visible.isEmpty())
+		return;
 
-	int vValue = int(((event->yTilt() + 60.0) / 120.0) * 255);
-	int hValue = int(((event->xTilt() + 60.0) / 120.0) * 255);
+	qreal ratio = displayStore.devicePixelRatio();
+	painter.drawImage(visible, displayStore, QRectF(visible.topLeft() * ratio, visible.size() * ratio));
+}
 
-	switch (alphaChannelValuator) {
-		case PressureValuator:
-			myColor.setAlphaF(event->pressure());
-			break;
-		case TangentialPressureValuator:
-			if (event->device() == QTabletEvent::Airbrush)
-				myColor.setAlphaF(qMax(0.01, (event->tangentialPressure() + 1.0) / 2.0));
-			else
-				myColor.setAlpha(255);
-			break;
-		case TiltValuator:
-			myColor.setAlpha(maximum(abs(vValue - 127), abs(hValue - 127)));
-			break;
-		default:
-			myColor.setAlpha(255);
-	}
-	switch (colorSaturationValuator) {
-		case VTiltValuator:
-			myColor.setHsv(hue, vValue, value, alpha);
-			break;
-		case HTiltValuator:
-			myColor.setHsv(hue, hValue, value, alpha);
-			break;
-		case PressureValuator:
-			myColor.setHsv(hue, int(event->pressure() * 255.0), value, alpha);
-			break;
-		default:
-			;
+// Panning by whole screen pixels only ever scrolls the display store
+QPointF ScribbleArea::snapToScreen(const QPointF &offset) const
+{
+	qreal ratio = devicePixelRatioF();
+	return QPointF(qRound(offset.x() * ratio) / ratio, qRound(offset.y() * ratio) / ratio);
+}
+
+QTransform ScribbleArea::viewTransform() const
+{
+	return QTransform(zoom, 0, 0, zoom, pan.x(), pan.y());
+}
+
+QPointF ScribbleArea::toCanvas(const QPointF &widgetPos) const
+{
+	return (widgetPos - pan) / zoom;
+}
+
+QRect ScribbleArea::toWidget(const QRect &canvasRect) const
+{
+	if (zoom == 1 && pan.isNull())
+		return canvasRect;
+	return viewTransform().mapRect(QRectF(canvasRect)).toAlignedRect().adjusted(-1, -1, 1, 1);
+}
+
+// The part of the canvas the widget shows
+QRect ScribbleArea::visibleCanvas() const
+{
+	return viewTransform().inverted().mapRect(QRectF(rect())).toAlignedRect();
+}
+
+void ScribbleArea::setZoom(qreal factor, const QPointF &anchor)
+{
+	factor = qBound(qreal(1) / 64, factor, qreal(16));
+	if (factor == zoom)
+		return;
+	QPointF canvasAnchor = toCanvas(anchor);
+	zoom = factor;
+	pan = snapToScreen(anchor - canvasAnchor * zoom);
+	update();
+	emit zoomChanged(zoom);
+}
+
+void ScribbleArea::setPan(const QPointF &offset)
+{
+	QPointF snapped = snapToScreen(offset);
+	if (snapped == pan)
+		return;
+	pan = snapped;
+	update();
+}
+
+// Steps of a power of two's square root, so every second step lands
+// on a power of two
+void ScribbleArea::zoomIn()
+{
+	setZoom(zoom * M_SQRT2, QRectF(rect()).center());
+}
+
+void ScribbleArea::zoomOut()
+{
+	setZoom(zoom / M_SQRT2, QRectF(rect()).center());
+}
+
+void ScribbleArea::resetZoom()
+{
+	setZoom(1, QRectF(rect()).center());
+	setPan(QPointF());
+}
+
+// The whole canvas in the middle of the widget, never magnified
+void ScribbleArea::zoomToFit()
+{
+	QSizeF canvas(layers.size());
+	if (canvas.isEmpty())
+		return;
+	qreal factor = qMin(qreal(1), qMin(width() / canvas.width(), height() / canvas.height()));
+	setZoom(factor, QPointF());
+	setPan(QPointF((width() - canvas.width() * zoom) / 2, (height() - canvas.height() * zoom) / 2));
+}
+
+void ScribbleArea::wheelEvent(QWheelEvent *event)
+{
+	if (event->modifiers() & Qt::ControlModifier) {
+		qreal steps = event->angleDelta().y() / 120.0;
+		setZoom(zoom * qPow(M_SQRT2, steps), event->position());
+	} else {
+		QPointF delta = event->pixelDelta().isNull() ? QPointF(event->angleDelta()) / 120 * 48
+							     : QPointF(event->pixelDelta());
+		if (event->modifiers() & Qt::ShiftModifier)
+			delta = QPointF(delta.y(), delta.x());
+		setPan(pan + delta);
 	}
-	switch (lineWidthValuator) {
-		case PressureValuator:
-			myPen.setWidthF(pressureToWidth(event->pressure()));
-			break;
-		case TiltValuator:
-			myPen.setWidthF(maximum(abs(vValue - 127), abs(hValue - 127)) / 12);
-			break;
-		default:
-			myPen.setWidthF(1);
+	event->accept();
+}
+
+void ScribbleArea::updateCanvas(const QRect &rect)
+{
+	staleRegion += rect;
+	update(toWidget(rect));
+}
+
+void ScribbleArea::updateCanvas(const QRegion &region)
+{
+	staleRegion += region;
+	for (const QRect &rect : region)
+		update(toWidget(rect));
+}
+
+// Straight away if the last frame is a refresh interval behind,
+// otherwise once it is
+void ScribbleArea::scheduleFrame()
+{
+	if (frameTimer.isActive())
+		return;
+	qreal refreshRate = screen() ? screen()->refreshRate() : 60;
+	qint64 interval = qMax(1, qRound(1000 / refreshRate));
+	frameTimer.start(int(qMax(qint64(0), interval - frameClock.elapsed())));
+}
+
+// Picks up whatever the rasterizer painted since the last frame, and
+// moves the predicted tail along with the samples that came in
+void ScribbleArea::compositePaintedRegion()
+{
+	frameClock.restart();
+	QRegion painted = rasterizer.takePaintedRegion(&compositedSamples);
+	if (!painted.isEmpty()) {
+		// Set that the image hasn't been saved
+		modified = true;
+		updateCanvas(painted);
 	}
-	if (event->pointerType() == QTabletEvent::Eraser) {
-		myBrush.setColor(Qt::white);
-		myPen.setColor(Qt::white);
-		myPen.setWidthF(event->pressure() * 10 + 1);
-	} else {
-		myBrush.setColor(myColor);
-		myPen.setColor(myColor);
+
+	while (unpaintedPoints.size() > 1 && unpaintedPoints.at(1).sequence < compositedSamples)
+		unpaintedPoints.removeFirst();
+	updatePrediction();
+}
+
+// Tablet strokes are recorded on the rasterizer thread and
+// handed over here once they are finished. Each is undone on the
+// layer it was painted on, which needn't be the current one any
+// more. One whose layer was removed or replaced while it was down
+// can't be undone, like the rest of that layer's strokes
+void ScribbleArea::commitFinishedStrokes()
+{
+	for (const StrokeRasterizer::FinishedStroke &stroke : rasterizer.takeFinishedStrokes()) {
+		if (layers.indexOf(stroke.surface) >= 0)
+			history.push(stroke.surface, stroke.tiles);
 	}
+	emitHistoryChanged();
+}
 
+// Only the tiles of the stroke are swapped back in, so the cost
+// doesn't depend on the size of the canvas. Samples still queued
+// are painted and committed first, they would land on top of the
+// restored tiles otherwise. Nothing is undone while a stroke is
+// still down, it is recording the tiles that would be swapped
+void ScribbleArea::undo()
+{
+	finishStrokes();
+	if (rasterizer.isStroking())
+		return;
+	QRegion changed = history.undo();
+	for (const QRect &rect : changed)
+		updateCanvas(rect);
+	modified = true;
+	emitHistoryChanged();
 }
 
-// Resize the image to slightly larger then the main window
-// to cut down on the need to resize the image
-void ScribbleArea::resizeEvent(QResizeEvent *event)
+void ScribbleArea::redo()
+{
+	finishStrokes();
+	if (rasterizer.isStroking())
+		return;
+	QRegion changed = history.redo();
+	for (const QRect &rect : changed)
+		updateCanvas(rect);
+	modified = true;
+	emitHistoryChanged();
+}
+
+// The tiles in the history and in the last saved project
+// belong to the old canvas
+void ScribbleArea::resetHistory()
+{
+	history.clear();
+	savedProject = ProjectFile::Index();
+	++canvasGeneration;
+	emitHistoryChanged();
+}
+
+// Strokes still being painted land on the layer they were started
+// on, and are undone there
+void ScribbleArea::finishStrokes()
+{
+	setMarbling(false);
+	rasterizer.waitUntilIdle();
+	commitFinishedStrokes();
+}
+
+void ScribbleArea::useCurrentLayer()
+{
+	rasterizer.setSurface(layers.currentSurface());
+	emit layersChanged();
+}
+
+void ScribbleArea::addLayer()
+{
+	finishStrokes();
+	layers.addLayer(tr("Layer %1").arg(layers.count()));
+	useCurrentLayer();
+	modified = true;
+}
+
+// Strokes on the layer can't be undone once it is gone
+void ScribbleArea::removeLayer()
 {
-	if (width() > imageMap.width() || height() > imageMap.height()) {
-		int newWidth = qMax(width() + 128, imageMap.width());
-		int newHeight = qMax(height() + 128, imageMap.height());
-		QPixmap pixmap = QPixmap::fromImage(imageMap);
-		resizeImage(&pixmap, QSize(newWidth, newHeight));
-		imageMap = pixmap.toImage();
-		update();
+	finishStrokes();
+	QSharedPointer<TiledSurface> removed = layers.currentSurface();
+	layers.removeLayer(layers.currentIndex());
+	if (layers.currentSurface() != removed) {
+		history.removeSurface(removed);
+		emitHistoryChanged();
 	}
-	QWidget::resizeEvent(event);
+	useCurrentLayer();
+	modified = true;
+	updateCanvas();
 }
 
-void ScribbleArea::drawLineTo(const QPoint &endPoint)
+void ScribbleArea::raiseLayer()
 {
-	// Used to draw on the widget
-	QPainter painter(&imageMap);
+	finishStrokes();
+	layers.moveLayer(layers.currentIndex(), layers.currentIndex() + 1);
+	useCurrentLayer();
+	modified = true;
+	updateCanvas();
+}
 
-	// Set the current settings for the pen
-	painter.setPen(QPen(myColor, myPenWidth, Qt::SolidLine, Qt::RoundCap,
-				  Qt::RoundJoin));
+void ScribbleArea::lowerLayer()
+{
+	finishStrokes();
+	layers.moveLayer(layers.currentIndex(), layers.currentIndex() - 1);
+	useCurrentLayer();
+	modified = true;
+	updateCanvas();
+}
 
-	// Draw a line from the last registered point to the current
-	painter.drawLine(lastPoint, endPoint);
+void ScribbleArea::setCurrentLayer(int index)
+{
+	finishStrokes();
+	layers.setCurrentIndex(index);
+	useCurrentLayer();
+}
 
-	// Set that the image hasn't been saved
+void ScribbleArea::setLayerOpacity(qreal opacity)
+{
+	layers.setOpacity(layers.currentIndex(), opacity);
 	modified = true;
+	emit layersChanged();
+	updateCanvas();
+}
 
-	int rad = (myPenWidth / 2) + 2;
+void ScribbleArea::setLayerBlendMode(QPainter::CompositionMode mode)
+{
+	layers.setBlendMode(layers.currentIndex(), mode);
+	modified = true;
+	emit layersChanged();
+	updateCanvas();
+}
 
-	// Call to update the rectangular space where we drew
-	update(QRect(lastPoint, endPoint).normalized()
-		 .adjusted(-rad, -rad, +rad, +rad));
+void ScribbleArea::setLayerVisible(bool visible)
+{
+	layers.setVisible(layers.currentIndex(), visible);
+	modified = true;
+	emit layersChanged();
+	updateCanvas();
+}
 
-	// Update the last position where we left off drawing
-	lastPoint = endPoint;
+void ScribbleArea::emitHistoryChanged()
+{
+	emit canUndoChanged(history.canUndo());
+	emit canRedoChanged(history.canRedo());
+}
+
+// Only what is in view goes stale, the rest of the canvas is
+// composited once it is panned or zoomed into view. Opening a large
+// project only decompresses the tiles of the first frame
+void ScribbleArea::updateCanvas()
+{
+	staleRegion += visibleCanvas() & QRect(QPoint(0, 0), layers.size());
+	update();
+}
+
+// Composites the changed parts of the layers into the display store,
+// everything else is left as it was drawn in an earlier frame. Only the
+// visible part of the canvas is ever composited, so neither memory nor
+// a frame depends on the size of the canvas
+void ScribbleArea::refreshDisplay()
+{
+	Profiler::Scope profile(Profiler::Composite);
+
+	// Store pixels per canvas pixel, and the canvas point the top
+	// left store pixel shows
+	qreal screenRatio = devicePixelRatioF();
+	qreal ratio = zoom * screenRatio;
+	QPointF origin = -pan / zoom;
+	QSize storeSize = size() * screenRatio;
+	if (displayStore.size() != storeSize || displayStore.devicePixelRatio() != screenRatio
+	    || storeZoom != zoom) {
+		// Scaled or resized, everything in view is composited again
+		if (displayStore.size() != storeSize) {
+			displayStore = QImage(storeSize, QImage::Format_ARGB32_Premultiplied);
+			displayStore.fill(Qt::transparent);
+		}
+		displayStore.setDevicePixelRatio(screenRatio);
+		staleRegion = visibleCanvas();
+	} else if (storePan != pan) {
+		// Panned by whole screen pixels, what is still in view moves
+		// along and only what scrolled into view is composited
+		QPoint delta = ((pan - storePan) * screenRatio).toPoint();
+		LayerStack::scrollImage(displayStore, delta);
+		QRegion exposed = QRegion(displayStore.rect()) - displayStore.rect().translated(delta);
+		for (const QRect &rect : exposed)
+			staleRegion += LayerStack::fromImage(rect, ratio, origin);
+	}
+	storeZoom = zoom;
+	storePan = pan;
+
+	staleRegion &= visibleCanvas() & QRect(QPoint(0, 0), layers.size());
+	if (staleRegion.isEmpty())
+		return;
+
+	// Large regions are composited on every core
+	layers.composite(displayStore, ratio, origin, staleRegion, Qt::white);
+	staleRegion = QRegion();
+}
+
+// The canvas grows by at least half again whenever the window outgrows
+// it, so dragging a window edge only reallocates a handful of times.
+// What is already painted stays, only the new area gets composited
+void ScribbleArea::resizeEvent(QResizeEvent *event)
+{
+	QSize current = layers.size();
+	if (width() > current.width() || height() > current.height()) {
+		int newWidth = current.width();
+		if (width() > current.width())
+			newWidth = qMax(width(), current.width() + current.width() / 2);
+		int newHeight = current.height();
+		if (height() > current.height())
+			newHeight = qMax(height(), current.height() + current.height() / 2);
+		resizeImage(QSize(newWidth, newHeight));
+	}
+	QWidget::resizeEvent(event);
 }
 
-// When the app is resized create a new image using
-// the changes made to the image
-void ScribbleArea::resizeImage(QPixmap *givenPixmap, const QSize &newSize)
+// When the app is resized grow the tile grid, the tiles
+// we already painted on are kept as they are
+void ScribbleArea::resizeImage(const QSize &newSize)
 {
-	// Check if we need to redraw the image
-	if (givenPixmap->size() == newSize)
+	// Check if we need to resize the layers
+	if (layers.size() == newSize)
 		return;
 
-	initPixmap();
+	layers.resize(newSize);
 }
 
 // Print the image
@@ -430,16 +1166,19 @@ void ScribbleArea::print()
 
 	// Open printer dialog and print if asked
 	QPrintDialog printDialog(&printer, this);
+	// The canvas is scaled to the printer's resolution a band at a
+	// time and each band goes straight to the printer
 	if (printDialog.exec() == QDialog::Accepted) {
 		QPainter painter(&printer);
 		QRect rect = painter.viewport();
-		QPixmap pixmap = QPixmap::fromImage(imageMap);
-		QSize size = pixmap.size();
+		QSize size = layers.size();
 		size.scale(rect.size(), Qt::KeepAspectRatio);
-		painter.setViewport(rect.x(), rect.y(), size.width(), size.height());
-		painter.setWindow(pixmap.rect());
-		painter.drawPixmap(0, 0, pixmap);
-		imageMap = pixmap.toImage();
+		LayerStack snapshot = layers.snapshot();
+		BandRenderer renderer(snapshot, size, Qt::white);
+		renderer.render([&painter, &rect](const QImage &band, int top) {
+			painter.drawImage(rect.topLeft() + QPoint(0, top), band);
+			return true;
+		});
 	}
 #endif // QT_CONFIG(printdialog)
 }
@@ -7,6 +7,27 @@
 #include <QWidget>
 #include <QPen>
 #include <QBrush>
+#include <QPixmap>
+#include <QPolygonF>
+#include <QRegion>
+#include <QElapsedTimer>
+#include <QHash>
+#include <QSet>
+#include <QTimer>
+
+#include "cursorcache.h"
+#include "latencymeter.h"
+#include "layerstack.h"
+#include "marblingbath.h"
+#include "profileroverlay.h"
+#include "projectfile.h"
+#include "strokelog.h"
+#include "strokepredictor.h"
+#include "strokerasterizer.h"
+#include "strokereplayer.h"
+#include "strokesample.h"
+#include "tiledsurface.h"
+#include "undohistory.h"
 
 class ScribbleArea : public QWidget
 {
@@ -28,12 +49,73 @@ class ScribbleArea : public QWidget
 		};
 		Q_ENUM(Valuator)
 
+		// What a stroke does while the bath is off
+		enum MarblingTool
+		{
+			BrushTool,
+			InkDropTool,
+			TineTool,
+			CombTool
+		};
+		Q_ENUM(MarblingTool)
+
 		ScribbleArea();
+		~ScribbleArea() override;
 
 
 		// Handles all events
-		bool openImage(const QString &fileName);
+		// Says why in error when the file can't be opened
+		bool openImage(const QString &fileName, QString *error = nullptr);
 		bool saveImage(const QString &fileName);
+
+		// Pixels per cell of the marbling simulation
+		void setMarblingCellSize(int pixels){ bath.setCellSize(pixels); }
+		int marblingCellSize() const { return bath.cellSize(); }
+		bool isMarbling() const { return bath.isRunning(); }
+
+		// Ink drops land where the stylus touches down, tines and combs
+		// are dragged from there to where it is lifted
+		void setMarblingTool(MarblingTool tool){ marblingTool = tool; }
+		MarblingTool getMarblingTool() const { return marblingTool; }
+		void setInkDropRadius(int radius){ inkDropRadius = radius; }
+		int getInkDropRadius() const { return inkDropRadius; }
+		void setTineSharpness(int pixels){ tineSharpness = pixels; }
+		int getTineSharpness() const { return tineSharpness; }
+		void setCombSpacing(int pixels){ combSpacing = pixels; }
+		int getCombSpacing() const { return combSpacing; }
+
+		// Logs every input sample until recording is stopped
+		bool startRecording(const QString &fileName, QString *error);
+		void stopRecording();
+		bool isRecording() const { return strokeLog.isRecording(); }
+
+		// Replays a log either with its recorded timing or as fast
+		// as the rasterizer can take it
+		bool replayStrokes(const QString &fileName, bool realTime, QString *error);
+
+		// Draws the stroke on ahead of the rasterizer to where the
+		// stylus is expected to be by the time the frame is shown
+		void setStrokePrediction(bool predict);
+		bool getStrokePrediction() const { return predicting; }
+		qreal predictionHorizon() const;
+
+		// Milliseconds from a tablet event to the frame showing it,
+		// the given fraction of recent samples being quicker
+		qreal inputLatency(qreal fraction) const { return latency.percentile(fraction); }
+		int inputLatencyMeasurements() const { return latency.measurements(); }
+
+		// Frame rate, frame times and section timings over the canvas,
+		// the timings only count while Profiler is enabled
+		void setProfilerOverlay(bool show);
+		bool isProfilerOverlayShown() const { return showingProfiler; }
+
+		// Returns once the rasterizer has painted every stroke so far
+		void waitForStrokes() { rasterizer.waitUntilIdle(); }
+
+		// Returns straight away, the outcome comes back through
+		// saveFinished or saveFailed. Images are written scale times
+		// the canvas size
+		void saveImageInBackground(const QString &fileName, int scale = 1);
 		void setPenColor(const QColor &newColor);
 		void setPenWidth(int newWidth);
 		void setAlphaChannelValuator(Valuator valType){ alphaChannelValuator = valType; }
@@ -48,11 +130,91 @@ class ScribbleArea : public QWidget
 		void setColor(QColor val){ myColor = val; }
 		int penWidth() const { return myPenWidth; }
 
+		// Widget pixels per canvas pixel, and where the canvas origin
+		// is on the widget. Zooming keeps the canvas point under anchor
+		// where it is
+		qreal getZoom() const { return zoom; }
+		void setZoom(qreal factor, const QPointF &anchor);
+		QPointF getPan() const { return pan; }
+		void setPan(const QPointF &offset);
+		QPointF toCanvas(const QPointF &widgetPos) const;
+		QRect toWidget(const QRect &canvasRect) const;
+
+		// Marks part of the surface as changed and schedules a repaint
+		void updateCanvas(const QRect &rect);
+		void updateCanvas(const QRegion &region);
+		void updateCanvas();
+
+		// Distance between brush dabs as a fraction of their diameter
+		void setBrushSpacing(qreal spacing){ brushSpacing = spacing; }
+		qreal getBrushSpacing() const { return brushSpacing; }
+
+		// Memory the undo history may use before it starts
+		// compressing and dropping the oldest strokes
+		void setUndoMemoryLimit(qint64 bytes){ history.setMaxBytes(bytes); }
+		qint64 undoMemoryLimit() const { return history.maxBytes(); }
+		bool canUndo() const { return history.canUndo(); }
+		bool canRedo() const { return history.canRedo(); }
+
+		// Strokes go onto the current layer, the others are only
+		// composited
+		const LayerStack &layerStack() const { return layers; }
+
+		// Stale regions of more pixels than this are composited on
+		// every core
+		void setCompositeThreshold(int pixels){ layers.setParallelThreshold(pixels); }
+		int compositeThreshold() const { return layers.parallelThreshold(); }
+
 	public slots:
 
 		// Events to handle
 		void clearImage();
 		void print();
+		void undo();
+		void redo();
+
+		// In marbling mode strokes stir a fluid bath that carries
+		// the paint along instead of painting
+		void setMarbling(bool marbling);
+
+		// New layers go above the current one. The settings below
+		// change the current layer
+		void addLayer();
+		void removeLayer();
+		void raiseLayer();
+		void lowerLayer();
+		void setCurrentLayer(int index);
+		void setLayerOpacity(qreal opacity);
+		void setLayerBlendMode(QPainter::CompositionMode mode);
+		void setLayerVisible(bool visible);
+
+		// Around the middle of the widget
+		void zoomIn();
+		void zoomOut();
+		void resetZoom();
+		void zoomToFit();
+
+	signals:
+
+		void layersChanged();
+		void zoomChanged(qreal zoom);
+
+		void canUndoChanged(bool canUndo);
+		void canRedoChanged(bool canRedo);
+		void marblingChanged(bool marbling);
+
+		void saveProgress(int percent);
+		void saveFinished(const QString &fileName);
+		void saveFailed(const QString &fileName, const QString &error);
+
+	private slots:
+
+		void scheduleFrame();
+		void compositePaintedRegion();
+		void commitFinishedStrokes();
+		void queueReplayedSample(const StrokeSample &sample);
+		void stepBath();
+		void refreshProfilerOverlay();
 
 	protected:
 		void mousePressEvent(QMouseEvent* event) override;
@@ -61,6 +223,13 @@ class ScribbleArea : public QWidget
 
 		void tabletEvent(QTabletEvent* event) override;
 
+		// Touch points are taken up here, each one strokes on its own
+		bool event(QEvent* event) override;
+		void touchEvent(QTouchEvent* event);
+
+		// Ctrl zooms around the pointer, otherwise the view is panned
+		void wheelEvent(QWheelEvent* event) override;
+
 		// Updates the scribble area where we are painting
 		void paintEvent(QPaintEvent* event) override;
 
@@ -70,43 +239,145 @@ class ScribbleArea : public QWidget
 
 	private:
 
-		void initPixmap();
-		void paintPixmap(QPainter &painter, QTabletEvent* event);
 		Qt::BrushStyle brushPattern(qreal value);
-		static qreal pressureToWidth(qreal pressure);
-		void updateBrush(const QTabletEvent* event);
+		StrokeSample strokeSample(StrokeSample::Type type, const QTabletEvent* event);
+		StrokeSample mouseSample(StrokeSample::Type type, const QMouseEvent* event) const;
+		StrokeSample touchSample(StrokeSample::Type type, const QTouchEvent* event,
+					 const QTouchEvent::TouchPoint &point);
+		int tabletPointer(const QTabletEvent* event);
+		void queueSample(const StrokeSample &sample);
+		void trackSample(const StrokeSample &sample);
+		void updatePrediction();
+		void dragBath(const StrokeSample &sample);
+		void applyMarblingTool(const StrokeSample &sample);
+		void reportUnsupportedDevice(const QTabletEvent* event);
 		void updateCursor(const QTabletEvent* event);
 
-		void drawLineTo(const QPoint &endPoint);
-		void resizeImage(QPixmap *givenPixmap, const QSize &newSize);
+		void refreshDisplay();
+		void drawView(QPainter &painter, const QRectF &exposed);
+		QPointF snapToScreen(const QPointF &offset) const;
+		QTransform viewTransform() const;
+		QRect visibleCanvas() const;
+		QImage paperTexture(const QSize &canvasSize);
+		void resizeImage(const QSize &newSize);
+		bool openProject(const QString &fileName, QString *error);
+		void resetHistory();
+		void finishStrokes();
+		void useCurrentLayer();
+		void emitHistoryChanged();
 
 		// Will be marked true or false depending on if
 		// we have saved after a change
 		bool modified;
 
 		// Marked true or false depending on if the user
-		// is drawing
+		// is drawing with the mouse
 		bool scribbling;
 
+		// Every tablet tool and touch point gets a pointer number of
+		// its own so their strokes don't get mixed up. The mouse is
+		// pointer 0. Touch points and replayed strokes get a new
+		// number every time
+		QHash<qint64, int> tabletPointers;
+		QSet<int> tabletsDown;
+		QHash<int, int> touchPointers;
+		// Where each touch point was last seen on the canvas, since a
+		// cancelled touch event comes without its points
+		QHash<int, QPointF> touchPositions;
+		int nextPointer;
+
 		// Holds the current pen width & color
 		int myPenWidth;
 		QColor myColor;
-		QImage imageMap;
-		QBrush myBrush;
-		QPen myPen;
-		bool deviceDown;
 
-		// Stores the location at the current mouse event
-		QPoint lastPoint;
+		// Paper and paint layers, each a tiled image
+		LayerStack layers;
+
+		// Paper decoded to cover the canvas, shared with the paper layer
+		QImage paperScaled;
+
+		// What is on screen at the resolution of the screen, kept
+		// between frames and only refreshed inside the region of the
+		// canvas that changed. It is as big as the widget, the zoom
+		// and pan it was composited at tell what it shows
+		QImage displayStore;
+		QRegion staleRegion;
+		qreal storeZoom;
+		QPointF storePan;
+
+		// View onto the canvas, the pan always lands on a whole
+		// screen pixel. The middle button drags the view
+		qreal zoom;
+		QPointF pan;
+		bool panning;
+		QPointF lastPanPoint;
+
+		// Paces picking up the painted region to the display
+		QTimer frameTimer;
+		QElapsedTimer frameClock;
+
+		// What was last written to the project file, bumping the
+		// generation forgets saves still running for an older canvas
+		ProjectFile::Index savedProject;
+		int canvasGeneration;
+
+		// Tiles each stroke painted over, for undo and redo
+		UndoHistory history;
+
 		Valuator alphaChannelValuator;
 		Valuator colorSaturationValuator;
 		Valuator lineWidthValuator;
+		qreal brushSpacing;
+
+		// Marbling bath over the visible part of the canvas
+		MarblingBath bath;
+		QTimer bathTimer;
+		QElapsedTimer bathClock;
+		QHash<int, QPointF> lastDragPoints;
+
+		// Closed form marbling operations
+		MarblingTool marblingTool;
+		int inkDropRadius;
+		int tineSharpness;
+		int combSpacing;
+		QHash<int, QPointF> toolPressPoints;
+
+		StrokeLog strokeLog;
+		StrokeReplayer replayer;
+		// Pointers of the log being replayed and the live pointer
+		// numbers their strokes were given
+		QHash<int, int> replayPointers;
 
-		struct TabletPoint {
+		// Tablet samples queued but not yet composited, numbered
+		// like the rasterizer counts them. The first one is the
+		// last that was painted, the predicted tail starts there.
+		// Only the stroke that started last is predicted
+		struct QueuedPoint
+		{
+				quint64 sequence;
 				QPointF pos;
-				qreal pressure;
-				qreal rotation;
-		} lastTabletPoint;
+		};
+		QVector<QueuedPoint> unpaintedPoints;
+		int predictedPointer;
+		quint64 compositedSamples;
+		StrokePredictor predictor;
+		bool predicting;
+		QPolygonF predictedTail;
+		QPen predictedPen;
+		QRect predictedRect;
+		LatencyMeter latency;
+
+		ProfilerOverlay profilerOverlay;
+		QTimer profilerTimer;
+		bool showingProfiler;
+
+		// Decoded cursors and the one last set
+		CursorCache cursors;
+		CursorCache::Key tabletCursor;
+		bool hasTabletCursor;
+
+		// Paints the strokes on its own thread
+		StrokeRasterizer rasterizer;
 };
 
 #endif
@@ -0,0 +1,179 @@
+#include "strokelog.h"
+
+static const quint32 LogMagic = 0x4542524c; // "EBRL"
+
+StrokeLog::StrokeLog()
+	: hasPrevious(false)
+{
+}
+
+bool StrokeLog::startRecording(const QString &fileName, const QSize &canvasSize, QString *error)
+{
+	stopRecording();
+	file.setFileName(fileName);
+	if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+		*error = file.errorString();
+		return false;
+	}
+	stream.setDevice(&file);
+	stream << LogMagic << quint32(Version) << qint32(canvasSize.width()) << qint32(canvasSize.height());
+	hasPrevious = false;
+	return true;
+}
+
+void StrokeLog::stopRecording()
+{
+	if (!file.isOpen())
+		return;
+	stream.setDevice(nullptr);
+	file.close();
+}
+
+bool StrokeLog::sameSettings(const StrokeSample &a, const StrokeSample &b)
+{
+	return a.device == b.device && a.pointerType == b.pointerType && a.color == b.color
+	       && a.alphaChannelValuator == b.alphaChannelValuator
+	       && a.colorSaturationValuator == b.colorSaturationValuator
+	       && a.lineWidthValuator == b.lineWidthValuator
+	       && a.spacing == b.spacing && a.penWidth == b.penWidth;
+}
+
+void StrokeLog::record(const StrokeSample &sample)
+{
+	if (!file.isOpen())
+		return;
+
+	quint8 changed = AllChanged;
+	quint32 elapsed = 0;
+	if (hasPrevious) {
+		changed = 0;
+		if (sample.pressure != previous.pressure)
+			changed |= PressureChanged;
+		if (sample.tangentialPressure != previous.tangentialPressure)
+			changed |= TangentialPressureChanged;
+		if (sample.rotation != previous.rotation)
+			changed |= RotationChanged;
+		if (sample.xTilt != previous.xTilt)
+			changed |= XTiltChanged;
+		if (sample.yTilt != previous.yTilt)
+			changed |= YTiltChanged;
+		if (!sameSettings(sample, previous))
+			changed |= SettingsChanged;
+		if (sample.pointer != previous.pointer)
+			changed |= PointerChanged;
+		// Mouse and tablet timestamps may go backwards between strokes
+		if (sample.timestamp > previous.timestamp)
+			elapsed = quint32(qMin(sample.timestamp - previous.timestamp, quint64(0xffffffff)));
+	}
+
+	stream << quint8(sample.type) << changed << elapsed << double(sample.pos.x()) << double(sample.pos.y());
+	if (changed & PressureChanged)
+		stream << double(sample.pressure);
+	if (changed & TangentialPressureChanged)
+		stream << double(sample.tangentialPressure);
+	if (changed & RotationChanged)
+		stream << double(sample.rotation);
+	if (changed & XTiltChanged)
+		stream << double(sample.xTilt);
+	if (changed & YTiltChanged)
+		stream << double(sample.yTilt);
+	if (changed & SettingsChanged) {
+		stream << qint8(sample.device) << qint8(sample.pointerType) << sample.color
+		       << sample.alphaChannelValuator << sample.colorSaturationValuator
+		       << sample.lineWidthValuator << double(sample.spacing) << qint32(sample.penWidth);
+	}
+	if (changed & PointerChanged)
+		stream << qint32(sample.pointer);
+
+	previous = sample;
+	hasPrevious = true;
+}
+
+// Timestamps in the samples read back start at 0
+bool StrokeLog::read(const QString &fileName, QSize *canvasSize,
+			   QVector<StrokeSample> *samples, QString *error)
+{
+	QFile file(fileName);
+	if (!file.open(QIODevice::ReadOnly)) {
+		*error = file.errorString();
+		return false;
+	}
+
+	QDataStream stream(&file);
+	quint32 magic = 0, version = 0;
+	qint32 width = 0, height = 0;
+	stream >> magic >> version >> width >> height;
+	if (magic != LogMagic || version < 1 || version > Version) {
+		*error = QObject::tr("Not an Ebru stroke log");
+		return false;
+	}
+	*canvasSize = QSize(width, height);
+
+	// Version 1 had no pointers
+	quint8 allChanged = version == 1 ? quint8(AllChanged & ~PointerChanged) : quint8(AllChanged);
+
+	samples->clear();
+	StrokeSample sample;
+	sample.timestamp = 0;
+	sample.pointer = 0;
+	while (!stream.atEnd()) {
+		quint8 type, changed;
+		quint32 elapsed;
+		double x, y;
+		stream >> type >> changed >> elapsed >> x >> y;
+		if (samples->isEmpty() && changed != allChanged)
+			break;
+
+		sample.type = StrokeSample::Type(type);
+		sample.timestamp += elapsed;
+		sample.pos = QPointF(x, y);
+		double value;
+		if (changed & PressureChanged) {
+			stream >> value;
+			sample.pressure = value;
+		}
+		if (changed & TangentialPressureChanged) {
+			stream >> value;
+			sample.tangentialPressure = value;
+		}
+		if (changed & RotationChanged) {
+			stream >> value;
+			sample.rotation = value;
+		}
+		if (changed & XTiltChanged) {
+			stream >> value;
+			sample.xTilt = value;
+		}
+		if (changed & YTiltChanged) {
+			stream >> value;
+			sample.yTilt = value;
+		}
+		if (changed & SettingsChanged) {
+			qint8 device, pointerType;
+			double spacing;
+			qint32 penWidth;
+			stream >> device >> pointerType >> sample.color
+			       >> sample.alphaChannelValuator >> sample.colorSaturationValuator
+			       >> sample.lineWidthValuator >> spacing >> penWidth;
+			sample.device = QTabletEvent::TabletDevice(device);
+			sample.pointerType = QTabletEvent::PointerType(pointerType);
+			sample.spacing = spacing;
+			sample.penWidth = penWidth;
+		}
+		if (changed & PointerChanged) {
+			qint32 pointer;
+			stream >> pointer;
+			sample.pointer = pointer;
+		}
+		if (stream.status() != QDataStream::Ok)
+			break;
+		samples->append(sample);
+	}
+
+	// A log cut short by a crash still replays up to its last whole sample
+	if (stream.status() == QDataStream::ReadCorruptData || (samples->isEmpty() && !stream.atEnd())) {
+		*error = QObject::tr("The stroke log is damaged");
+		return false;
+	}
+	return true;
+}
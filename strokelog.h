@@ -0,0 +1,56 @@
+#ifndef STROKELOG_H
+#define STROKELOG_H
+
+#include <QDataStream>
+#include <QFile>
+#include <QSize>
+#include <QString>
+#include <QVector>
+
+#include "strokesample.h"
+
+// Binary log of the input samples of a session. After a small header
+// with the canvas size every sample is stored as its type, a mask of
+// the values that changed since the previous sample, the time since
+// the previous sample, its position and then only the changed values.
+// Values are kept at full precision so replays paint the same pixels.
+// Version 1 logs are still read, all their samples come from pointer 0
+class StrokeLog
+{
+	public:
+
+		StrokeLog();
+
+		bool startRecording(const QString &fileName, const QSize &canvasSize, QString *error);
+		void stopRecording();
+		bool isRecording() const { return file.isOpen(); }
+		void record(const StrokeSample &sample);
+
+		static bool read(const QString &fileName, QSize *canvasSize,
+				     QVector<StrokeSample> *samples, QString *error);
+
+	private:
+
+		enum { Version = 2 };
+
+		enum Changed
+		{
+			PressureChanged = 0x01,
+			TangentialPressureChanged = 0x02,
+			RotationChanged = 0x04,
+			XTiltChanged = 0x08,
+			YTiltChanged = 0x10,
+			SettingsChanged = 0x20,
+			PointerChanged = 0x40,
+			AllChanged = 0x7f
+		};
+
+		static bool sameSettings(const StrokeSample &a, const StrokeSample &b);
+
+		QFile file;
+		QDataStream stream;
+		StrokeSample previous;
+		bool hasPrevious;
+};
+
+#endif // STROKELOG_H
@@ -0,0 +1,74 @@
+#include <QtMath>
+
+#include "strokepredictor.h"
+
+const qreal StrokePredictor::MinimumSpan = 4;
+
+StrokePredictor::StrokePredictor()
+{
+	history.reserve(HistorySize + 1);
+}
+
+void StrokePredictor::reset()
+{
+	history.clear();
+}
+
+void StrokePredictor::addSample(const QPointF &pos, quint64 timestamp)
+{
+	// Timestamps going backwards means a new stroke from another device
+	if (!history.isEmpty() && timestamp < history.last().timestamp)
+		history.clear();
+	history.append(Point { pos, timestamp });
+	if (history.size() > HistorySize)
+		history.removeFirst();
+}
+
+bool StrokePredictor::velocity(int first, int last, QPointF *result) const
+{
+	qreal span = qreal(history.at(last).timestamp - history.at(first).timestamp);
+	if (span < MinimumSpan)
+		return false;
+	*result = (history.at(last).pos - history.at(first).pos) / span;
+	return true;
+}
+
+// Second order extrapolation. The acceleration term is never allowed
+// to outgrow half of the velocity term, so a stroke coming to a stop
+// or turning sharply isn't thrown far off its path
+QVector<QPointF> StrokePredictor::predict(qreal milliseconds) const
+{
+	QVector<QPointF> points;
+	int last = history.size() - 1;
+	if (last < 2 || milliseconds <= 0)
+		return points;
+
+	int middle = last - 1;
+	while (middle > 0 && qreal(history.at(last).timestamp - history.at(middle).timestamp) < MinimumSpan)
+		--middle;
+
+	QPointF recent;
+	if (!velocity(middle, last, &recent))
+		return points;
+
+	QPointF acceleration;
+	QPointF earlier;
+	if (middle > 0 && velocity(0, middle, &earlier)) {
+		qreal between = qreal(history.at(last).timestamp - history.at(0).timestamp) / 2;
+		acceleration = (recent - earlier) / between;
+	}
+
+	points.reserve(PredictedPoints);
+	const QPointF &start = history.at(last).pos;
+	for (int i = 1; i <= PredictedPoints; ++i) {
+		qreal t = milliseconds * i / PredictedPoints;
+		QPointF moved = recent * t;
+		QPointF bent = acceleration * (t * t / 2);
+		qreal movedLength = qSqrt(QPointF::dotProduct(moved, moved));
+		qreal bentLength = qSqrt(QPointF::dotProduct(bent, bent));
+		if (bentLength > movedLength / 2)
+			bent *= movedLength / 2 / bentLength;
+		points.append(start + moved + bent);
+	}
+	return points;
+}
@@ -0,0 +1,44 @@
+#ifndef STROKEPREDICTOR_H
+#define STROKEPREDICTOR_H
+
+#include <QPointF>
+#include <QVector>
+
+// Guesses where the stylus is now from the last few samples of a
+// stroke, so the stroke can be shown ahead of what was painted. The
+// velocity and its change are taken over a few milliseconds of samples
+// since event timestamps only have millisecond resolution
+class StrokePredictor
+{
+	public:
+
+		StrokePredictor();
+
+		void reset();
+		void addSample(const QPointF &pos, quint64 timestamp);
+
+		// Points the stroke is expected to pass through during the
+		// given milliseconds after the last sample, empty while there
+		// isn't enough to go by
+		QVector<QPointF> predict(qreal milliseconds) const;
+
+	private:
+
+		struct Point
+		{
+				QPointF pos;
+				quint64 timestamp;
+		};
+
+		enum { HistorySize = 8, PredictedPoints = 4 };
+
+		// Samples closer together than this are too noisy to
+		// take a velocity from
+		static const qreal MinimumSpan;
+
+		bool velocity(int first, int last, QPointF *result) const;
+
+		QVector<Point> history;
+};
+
+#endif // STROKEPREDICTOR_H
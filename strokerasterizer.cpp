@@ -0,0 +1,546 @@
+#include <QtConcurrent>
+#include <QtWidgets>
+
+#include <algorithm>
+#include <functional>
+
+#include "profiler.h"
+#include "strokerasterizer.h"
+#include "scribblearea.h"
+#include "tiledsurface.h"
+
+StrokeRasterizer::StrokeRasterizer(const QSharedPointer<TiledSurface> &surface, QObject *parent)
+	: QThread(parent)
+	, surface(surface)
+	, stopping(0)
+	, pending(0)
+	, queued(0)
+	, processed(0)
+	, paintedSamples(0)
+	, activeStrokes(0)
+	, dabMasks(new DabMaskCache)
+{
+	setObjectName(QStringLiteral("Stroke rasterizer"));
+}
+
+StrokeRasterizer::StrokeRasterizer(TiledSurface *surface, QObject *parent)
+	: StrokeRasterizer(QSharedPointer<TiledSurface>(surface, [](TiledSurface *) {}), parent)
+{
+}
+
+StrokeRasterizer::~StrokeRasterizer()
+{
+	stop();
+	qDeleteAll(pointers);
+}
+
+StrokeRasterizer::PointerState::PointerState()
+	: color(Qt::red)
+	, brush(color)
+	, pen(brush, 1.0, Qt::SolidLine, Qt::RoundCap, Qt::RoundJoin)
+	, down(false)
+	, lastTabletPoint { QPointF(), 0, 0, 1.0 }
+{
+}
+
+StrokeRasterizer::PointerState *StrokeRasterizer::pointerState(int pointer)
+{
+	PointerState *&state = pointers[pointer];
+	if (!state) {
+		state = new PointerState;
+		state->brushEngine.setMaskCache(dabMasks);
+	}
+	return state;
+}
+
+// Never drops a sample, if the rasterizer falls a whole
+// queue behind the GUI thread waits for it to catch up
+void StrokeRasterizer::enqueue(const StrokeSample &sample)
+{
+	pending.ref();
+	++queued;
+	while (!queue.push(sample))
+		QThread::yieldCurrentThread();
+	available.release();
+}
+
+void StrokeRasterizer::waitUntilIdle()
+{
+	QMutexLocker locker(&idleMutex);
+	while (isRunning() && !stopping.loadAcquire()
+			&& pending.loadAcquire() > 0)
+		idle.wait(&idleMutex);
+}
+
+void StrokeRasterizer::setSurface(const QSharedPointer<TiledSurface> &newSurface)
+{
+	QMutexLocker locker(&surfaceMutex);
+	surface = newSurface;
+}
+
+void StrokeRasterizer::stop()
+{
+	if (!isRunning())
+		return;
+	stopping.storeRelease(1);
+	available.release();
+	wait();
+}
+
+QRegion StrokeRasterizer::takePaintedRegion(quint64 *samples)
+{
+	QMutexLocker locker(&paintedMutex);
+	if (samples)
+		*samples = paintedSamples;
+	QRegion region = paintedRegion;
+	paintedRegion = QRegion();
+	return region;
+}
+
+QList<StrokeRasterizer::FinishedStroke> StrokeRasterizer::takeFinishedStrokes()
+{
+	QMutexLocker locker(&paintedMutex);
+	QList<FinishedStroke> strokes;
+	strokes.swap(finishedStrokes);
+	return strokes;
+}
+
+void StrokeRasterizer::run()
+{
+	forever {
+		available.acquire();
+		if (stopping.loadAcquire())
+			break;
+		// Whatever else came in meanwhile is painted in the same pass
+		int count = 1;
+		int more = qMin(available.available(), MaxBatch - 1);
+		if (more > 0 && available.tryAcquire(more))
+			count += more;
+		paintBatch(count);
+		if (stopping.loadAcquire())
+			break;
+	}
+	QMutexLocker locker(&idleMutex);
+	idle.wakeAll();
+}
+
+// One published region for the whole batch, every sample in it
+// still gets painted
+void StrokeRasterizer::paintBatch(int count)
+{
+	QVector<StrokeSample> samples;
+	samples.reserve(count);
+	StrokeSample sample;
+	while (samples.size() < count && queue.pop(sample))
+		samples.append(sample);
+
+	QRegion dirty = paintLocked(samples);
+	processed += quint64(samples.size());
+	publish(dirty);
+	// Taking the mutex makes sure a waiter that just saw samples
+	// pending is already waiting when it is woken
+	if (pending.fetchAndSubRelease(samples.size()) == samples.size()) {
+		QMutexLocker locker(&idleMutex);
+		idle.wakeAll();
+	}
+}
+
+void StrokeRasterizer::rasterize(const StrokeSample &sample)
+{
+	publish(paintLocked(QVector<StrokeSample>() << sample));
+}
+
+// Locks every surface the samples may paint on for writing, the one
+// new strokes go onto and the ones of the strokes still down. Always
+// in the same order, so two batches can't each wait for the other
+QRegion StrokeRasterizer::paintLocked(const QVector<StrokeSample> &samples)
+{
+	{
+		QMutexLocker locker(&surfaceMutex);
+		pressSurface = surface;
+	}
+
+	// Held until the batch is done, a layer removed meanwhile stays
+	// alive until its strokes are finished
+	QVector<QSharedPointer<TiledSurface>> surfaces;
+	surfaces.append(pressSurface);
+	for (const PointerState *state : qAsConst(pointers)) {
+		if (state->surface && !surfaces.contains(state->surface))
+			surfaces.append(state->surface);
+	}
+	std::sort(surfaces.begin(), surfaces.end(), [](const QSharedPointer<TiledSurface> &a, const QSharedPointer<TiledSurface> &b) {
+		return std::less<TiledSurface *>()(a.data(), b.data());
+	});
+
+	for (const QSharedPointer<TiledSurface> &target : qAsConst(surfaces))
+		target->lock().lockForWrite();
+	QRegion dirty = paintSamples(samples);
+	for (int i = surfaces.size() - 1; i >= 0; --i)
+		surfaces.at(i)->lock().unlock();
+	return dirty;
+}
+
+// Called with the surfaces locked for writing. The samples are cut into
+// runs that end where the last stroke down on a surface finishes, so
+// recording only ever starts or stops between them
+QRegion StrokeRasterizer::paintSamples(const QVector<StrokeSample> &samples)
+{
+	QRegion dirty;
+	int first = 0;
+	while (first < samples.size()) {
+		QSharedPointer<TiledSurface> finished;
+		int last = first;
+		while (last < samples.size()) {
+			const StrokeSample &sample = samples.at(last++);
+			PointerState *state = pointerState(sample.pointer);
+			if (sample.type == StrokeSample::Press && !state->down) {
+				state->down = true;
+				state->surface = pressSurface;
+				activeStrokes.ref();
+				if (strokesOn[state->surface.data()]++ == 0)
+					state->surface->beginRecording();
+			} else if (sample.type == StrokeSample::Release && state->down) {
+				state->down = false;
+				activeStrokes.deref();
+				if (--strokesOn[state->surface.data()] == 0) {
+					finished = state->surface;
+					break;
+				}
+			}
+		}
+
+		dirty += paintRun(samples, first, last);
+		if (finished) {
+			strokesOn.remove(finished.data());
+			finishStroke(finished);
+		}
+		for (PointerState *state : qAsConst(pointers)) {
+			if (!state->down)
+				state->surface.clear();
+		}
+		first = last;
+	}
+	dropIdlePointers();
+	return dirty;
+}
+
+// Each pointer's samples go into a cluster covering the tiles they can
+// reach, clusters that could touch the same tile are merged. More than
+// one left and they are painted in parallel
+QRegion StrokeRasterizer::paintRun(const QVector<StrokeSample> &samples, int first, int last)
+{
+	QVector<Cluster> clusters;
+	QHash<int, int> clusterOf;
+	QHash<int, QPointF> lastPos;
+	for (int i = first; i < last; ++i) {
+		const StrokeSample &sample = samples.at(i);
+		// Only moves paint, from where the pointer last was
+		QPointF from = sample.type != StrokeSample::Move ? sample.pos
+			       : lastPos.value(sample.pointer, pointers.value(sample.pointer)->lastTabletPoint.pos);
+		TiledSurface *target = surfaceOf(*pointers.value(sample.pointer));
+		QRect tiles = target->tilesIn(reach(from, sample));
+		lastPos.insert(sample.pointer, sample.pos);
+
+		int index = clusterOf.value(sample.pointer, -1);
+		if (index < 0) {
+			index = clusters.size();
+			clusterOf.insert(sample.pointer, index);
+			clusters.append(Cluster { target, tiles, QVector<int>(), QRegion() });
+		}
+		clusters[index].tiles |= tiles;
+		clusters[index].samples.append(i);
+	}
+
+	for (int i = 0; i < clusters.size(); ++i) {
+		for (int j = i + 1; j < clusters.size(); ++j) {
+			// Strokes on different layers never share a tile
+			if (clusters.at(i).surface != clusters.at(j).surface
+					|| !clusters.at(i).tiles.intersects(clusters.at(j).tiles))
+				continue;
+			clusters[i].tiles |= clusters.at(j).tiles;
+			clusters[i].samples += clusters.at(j).samples;
+			clusters.remove(j);
+			// The grown cluster may reach ones it was checked against
+			j = i;
+		}
+	}
+
+	if (clusters.size() == 1) {
+		QRegion dirty;
+		for (int i = first; i < last; ++i)
+			dirty += paintSample(*pointers.value(samples.at(i).pointer), samples.at(i));
+		return dirty;
+	}
+
+	QSet<TiledSurface *> detached;
+	for (const Cluster &cluster : qAsConst(clusters)) {
+		if (!detached.contains(cluster.surface)) {
+			cluster.surface->detach();
+			detached.insert(cluster.surface);
+		}
+	}
+	QtConcurrent::blockingMap(clusters, [this, &samples](Cluster &cluster) {
+		std::sort(cluster.samples.begin(), cluster.samples.end());
+		for (int i : cluster.samples)
+			cluster.painted += paintSample(*pointers.value(samples.at(i).pointer), samples.at(i));
+	});
+	QRegion dirty;
+	for (const Cluster &cluster : clusters)
+		dirty += cluster.painted;
+	return dirty;
+}
+
+// Everything painting the sample may touch, however its brush turns
+// out. The widest dab is an airbrush at full pressure
+QRect StrokeRasterizer::reach(const QPointF &from, const StrokeSample &sample)
+{
+	qreal radius;
+	if (sample.isMouse())
+		radius = sample.penWidth / 2 + 2;
+	else
+		radius = (sample.device == QTabletEvent::Airbrush ? 5 : 1) * pressureToWidth(1.0) + 2;
+	return QRectF(from, sample.pos).normalized().adjusted(-radius, -radius, radius, radius).toAlignedRect();
+}
+
+// The surface a sample of the pointer paints on, a pointer that isn't
+// down goes onto the one new strokes go onto
+TiledSurface *StrokeRasterizer::surfaceOf(const PointerState &state) const
+{
+	return state.surface ? state.surface.data() : pressSurface.data();
+}
+
+// Paints one sample with its pointer's brush. Only touches the tiles
+// reach() gives and the state of that pointer
+QRect StrokeRasterizer::paintSample(PointerState &state, const StrokeSample &sample)
+{
+	Profiler::Scope profile(Profiler::Rasterize);
+	TiledSurface &target = *surfaceOf(state);
+	QRect rect;
+	switch (sample.type) {
+		case StrokeSample::Press:
+			if (!sample.isMouse())
+				updateBrush(state, sample);
+			// The tool doesn't change during a stroke
+			state.brushEngine.setBlendMode(blendMode(target, sample));
+			state.brushEngine.beginStroke();
+			rememberPoint(state, sample);
+			break;
+		case StrokeSample::Move:
+			if (sample.isMouse()) {
+				rect = drawLineTo(state, target, sample);
+			} else {
+				updateBrush(state, sample);
+				rect = paintPixmap(state, target, sample);
+			}
+			rememberPoint(state, sample);
+			break;
+		case StrokeSample::Release:
+			break;
+	}
+	return rect;
+}
+
+// The tiles of the target as they were before the strokes on it
+// that just ended
+void StrokeRasterizer::finishStroke(const QSharedPointer<TiledSurface> &target)
+{
+	TiledSurface::TileSet tiles = target->endRecording();
+	if (tiles.isEmpty())
+		return;
+
+	bool wasEmpty;
+	{
+		QMutexLocker locker(&paintedMutex);
+		wasEmpty = finishedStrokes.isEmpty();
+		finishedStrokes.append(FinishedStroke { target, tiles });
+	}
+	if (wasEmpty)
+		emit strokeFinished();
+}
+
+// A touch gets a new pointer every time, their brushes aren't kept
+// once there are more than a few
+void StrokeRasterizer::dropIdlePointers()
+{
+	if (pointers.size() <= MaxKeptPointers)
+		return;
+	for (auto it = pointers.begin(); it != pointers.end() && pointers.size() > MaxKeptPointers;) {
+		if (it.value()->down) {
+			++it;
+		} else {
+			delete it.value();
+			it = pointers.erase(it);
+		}
+	}
+}
+
+void StrokeRasterizer::rememberPoint(PointerState &state, const StrokeSample &sample)
+{
+	state.lastTabletPoint.pos = sample.pos;
+	state.lastTabletPoint.pressure = sample.pressure;
+	state.lastTabletPoint.rotation = sample.rotation;
+	state.lastTabletPoint.width = state.pen.widthF();
+}
+
+// Collect the painted region, the GUI thread only needs to
+// be woken up when there was nothing waiting for it yet
+void StrokeRasterizer::publish(const QRegion &region)
+{
+	if (region.isEmpty())
+		return;
+
+	bool wasEmpty;
+	{
+		QMutexLocker locker(&paintedMutex);
+		wasEmpty = paintedRegion.isEmpty();
+		paintedRegion += region;
+		// A fast stroke leaves a trail of small overlapping dabs,
+		// compositing their bounds is cheaper than every one of them
+		if (paintedRegion.rectCount() > MaxPaintedRects)
+			paintedRegion = paintedRegion.boundingRect();
+		paintedSamples = processed;
+	}
+	if (wasEmpty)
+		emit painted();
+}
+
+// The eraser takes paint away as far as its alpha goes. On a surface
+// with something under the tiles, such as the paper, it uncovers that
+// instead of leaving a hole
+BlendKernels::Mode StrokeRasterizer::blendMode(const TiledSurface &target, const StrokeSample &sample)
+{
+	if (sample.pointerType != QTabletEvent::Eraser)
+		return BlendKernels::Normal;
+	if (target.background().isNull() && target.backgroundColor().alpha() == 0)
+		return BlendKernels::Erase;
+	return BlendKernels::PaperErase;
+}
+
+qreal StrokeRasterizer::pressureToWidth(qreal pressure)
+{
+	return pressure * 10 + 1;
+}
+
+// Paints the segment from the last tablet point to the sample
+// as a row of dabs and returns the painted rect
+QRect StrokeRasterizer::paintPixmap(PointerState &state, TiledSurface &target, const StrokeSample &sample)
+{
+	state.brushEngine.setSpacing(sample.spacing);
+
+	BrushEngine::Dab from;
+	BrushEngine::Dab to;
+	from.pos = state.lastTabletPoint.pos;
+	to.pos = sample.pos;
+
+	switch (sample.device) {
+		case QTabletEvent::Airbrush:
+			// Soft dabs fading out over half of the old gradient radius
+			from.radius = state.lastTabletPoint.width * 5.0;
+			to.radius = state.pen.widthF() * 5.0;
+			from.aspectRatio = to.aspectRatio = 1.0;
+			from.angle = to.angle = 0.0;
+			from.hardness = to.hardness = 0.0;
+			return state.brushEngine.strokeSegment(target, from, to, state.brush.color());
+		case QTabletEvent::RotationStylus:
+			// A flat felt tip, the long axis follows the pen rotation
+			from.radius = pressureToWidth(state.lastTabletPoint.pressure);
+			to.radius = state.pen.widthF();
+			from.aspectRatio = to.aspectRatio = 0.25;
+			from.angle = state.lastTabletPoint.rotation + 90.0;
+			to.angle = sample.rotation + 90.0;
+			from.hardness = to.hardness = 1.0;
+			return state.brushEngine.strokeSegment(target, from, to, state.brush.color());
+		case QTabletEvent::Puck:
+		case QTabletEvent::FourDMouse:
+			// Reported on the GUI thread, nothing to paint
+			return QRect();
+		default:
+		case QTabletEvent::Stylus:
+			from.radius = state.lastTabletPoint.width / 2;
+			to.radius = state.pen.widthF() / 2;
+			from.aspectRatio = to.aspectRatio = 1.0;
+			from.angle = to.angle = 0.0;
+			from.hardness = to.hardness = 1.0;
+			return state.brushEngine.strokeSegment(target, from, to, state.pen.color());
+	}
+}
+
+// Mouse strokes are plain lines from the last point
+QRect StrokeRasterizer::drawLineTo(PointerState &state, TiledSurface &target, const StrokeSample &sample)
+{
+	QPoint lastPoint = state.lastTabletPoint.pos.toPoint();
+	QPoint endPoint = sample.pos.toPoint();
+	int rad = (sample.penWidth / 2) + 2;
+	QRect rect = QRect(lastPoint, endPoint).normalized()
+			 .adjusted(-rad, -rad, +rad, +rad);
+
+	target.paint(rect, [&](QPainter &painter) {
+		painter.setPen(QPen(sample.color, sample.penWidth, Qt::SolidLine, Qt::RoundCap,
+					  Qt::RoundJoin));
+		painter.drawLine(lastPoint, endPoint);
+	});
+	return rect;
+}
+
+void StrokeRasterizer::updateBrush(PointerState &state, const StrokeSample &sample)
+{
+	Profiler::Scope profile(Profiler::UpdateBrush);
+	state.color = sample.color;
+
+	int hue, saturation, value, alpha;
+	state.color.getHsv(&hue, &saturation, &value, &alpha);
+
+	int vValue = int(((sample.yTilt + 60.0) / 120.0) * 255);
+	int hValue = int(((sample.xTilt + 60.0) / 120.0) * 255);
+
+	switch (sample.alphaChannelValuator) {
+		case ScribbleArea::PressureValuator:
+			state.color.setAlphaF(sample.pressure);
+			break;
+		case ScribbleArea::TangentialPressureValuator:
+			if (sample.device == QTabletEvent::Airbrush)
+				state.color.setAlphaF(qMax(0.01, (sample.tangentialPressure + 1.0) / 2.0));
+			else
+				state.color.setAlpha(255);
+			break;
+		case ScribbleArea::TiltValuator:
+			state.color.setAlpha(qMax(abs(vValue - 127), abs(hValue - 127)));
+			break;
+		default:
+			state.color.setAlpha(255);
+	}
+	switch (sample.colorSaturationValuator) {
+		case ScribbleArea::VTiltValuator:
+			state.color.setHsv(hue, vValue, value, alpha);
+			break;
+		case ScribbleArea::HTiltValuator:
+			state.color.setHsv(hue, hValue, value, alpha);
+			break;
+		case ScribbleArea::PressureValuator:
+			state.color.setHsv(hue, int(sample.pressure * 255.0), value, alpha);
+			break;
+		default:
+			;
+	}
+	state.pen.setWidthF(penWidth(sample));
+	state.brush.setColor(state.color);
+	state.pen.setColor(state.color);
+}
+
+qreal StrokeRasterizer::penWidth(const StrokeSample &sample)
+{
+	if (sample.pointerType == QTabletEvent::Eraser)
+		return pressureToWidth(sample.pressure);
+
+	switch (sample.lineWidthValuator) {
+		case ScribbleArea::PressureValuator:
+			return pressureToWidth(sample.pressure);
+		case ScribbleArea::TiltValuator: {
+			int vValue = int(((sample.yTilt + 60.0) / 120.0) * 255);
+			int hValue = int(((sample.xTilt + 60.0) / 120.0) * 255);
+			return qMax(abs(vValue - 127), abs(hValue - 127)) / 12;
+		}
+		default:
+			return 1;
+	}
+}
@@ -0,0 +1,190 @@
+#ifndef STROKERASTERIZER_H
+#define STROKERASTERIZER_H
+
+#include <QBrush>
+#include <QColor>
+#include <QHash>
+#include <QList>
+#include <QMutex>
+#include <QPen>
+#include <QRegion>
+#include <QSemaphore>
+#include <QSharedPointer>
+#include <QThread>
+#include <QVector>
+#include <QWaitCondition>
+
+#include "brushengine.h"
+#include "samplequeue.h"
+#include "strokesample.h"
+#include "tiledsurface.h"
+
+// Paints tablet, touch and mouse strokes onto the surface on its own
+// thread. The GUI thread queues samples and gets the painted
+// region back through the painted() signal.
+//
+// Every pointer keeps a brush of its own, so several strokes can be
+// in flight at once. Strokes in a batch whose tiles can't overlap are
+// painted in parallel on the global thread pool.
+//
+// A stroke stays on the surface it was started on even when another
+// one is set while it is down. While any stroke is down on a surface
+// that surface records, the strokes on it that overlap in time make
+// up one undo step
+class StrokeRasterizer : public QThread
+{
+		Q_OBJECT
+
+	public:
+
+		explicit StrokeRasterizer(const QSharedPointer<TiledSurface> &surface, QObject *parent = nullptr);
+		// For a surface the caller keeps alive as long as the rasterizer
+		explicit StrokeRasterizer(TiledSurface *surface, QObject *parent = nullptr);
+		~StrokeRasterizer() override;
+
+		// The tiles a stroke changed as they were before it, and the
+		// surface it was painted on
+		struct FinishedStroke
+		{
+				QSharedPointer<TiledSurface> surface;
+				TiledSurface::TileSet tiles;
+		};
+
+		// Called from the GUI thread for every tablet sample
+		void enqueue(const StrokeSample &sample);
+
+		// Samples are numbered from 0 in the order they are queued,
+		// this is the number the next one gets
+		quint64 queuedSamples() const { return queued; }
+		void stop();
+
+		// Blocks until every queued sample has been painted
+		void waitUntilIdle();
+
+		// Strokes started from the next sample on go onto newSurface,
+		// the ones already down stay where they are
+		void setSurface(const QSharedPointer<TiledSurface> &newSurface);
+
+		// Whether a stroke is down as far as the painted samples go,
+		// call waitUntilIdle() first for every queued one to count
+		bool isStroking() const { return activeStrokes.loadAcquire() > 0; }
+
+		// Paints the sample straight away on the calling thread,
+		// for replaying strokes without starting the thread
+		void rasterize(const StrokeSample &sample);
+
+		// Width of the line a tablet sample paints
+		static qreal penWidth(const StrokeSample &sample);
+
+		// Everything painted since the last call. Samples is set to
+		// how many of the queued samples are painted in it
+		QRegion takePaintedRegion(quint64 *samples = nullptr);
+
+		// Every stroke finished since the last call
+		QList<FinishedStroke> takeFinishedStrokes();
+
+	signals:
+
+		// Emitted once when the painted region stops being empty
+		void painted();
+
+		// Emitted once when a stroke ends and nobody took it yet
+		void strokeFinished();
+
+	protected:
+
+		void run() override;
+
+	private:
+
+		// Samples painted in one pass at most, so the GUI thread
+		// never waits long for the surface lock, how many rects the
+		// painted region may have before it is merged, and how many
+		// brushes of pointers that are up are kept for their next stroke
+		enum { MaxBatch = 64, MaxPaintedRects = 16, MaxKeptPointers = 4 };
+
+		// Brush state of one pointer
+		struct PointerState
+		{
+				PointerState();
+
+				QColor color;
+				QBrush brush;
+				QPen pen;
+				BrushEngine brushEngine;
+				bool down;
+
+				// What the stroke paints on, from its press until
+				// the run its release is in has been painted
+				QSharedPointer<TiledSurface> surface;
+
+				struct TabletPoint {
+						QPointF pos;
+						qreal pressure;
+						qreal rotation;
+						qreal width;
+				} lastTabletPoint;
+		};
+
+		// Samples of the pointers whose strokes may touch the same
+		// tiles, painted in the order they came in
+		struct Cluster
+		{
+				TiledSurface *surface;
+				QRect tiles;
+				QVector<int> samples;
+				QRegion painted;
+		};
+
+		void paintBatch(int count);
+		QRegion paintLocked(const QVector<StrokeSample> &samples);
+		QRegion paintSamples(const QVector<StrokeSample> &samples);
+		QRegion paintRun(const QVector<StrokeSample> &samples, int first, int last);
+		QRect paintSample(PointerState &state, const StrokeSample &sample);
+		void updateBrush(PointerState &state, const StrokeSample &sample);
+		QRect paintPixmap(PointerState &state, TiledSurface &target, const StrokeSample &sample);
+		QRect drawLineTo(PointerState &state, TiledSurface &target, const StrokeSample &sample);
+		void rememberPoint(PointerState &state, const StrokeSample &sample);
+		static BlendKernels::Mode blendMode(const TiledSurface &target, const StrokeSample &sample);
+		void finishStroke(const QSharedPointer<TiledSurface> &target);
+		void dropIdlePointers();
+		PointerState *pointerState(int pointer);
+		TiledSurface *surfaceOf(const PointerState &state) const;
+		void publish(const QRegion &region);
+		static QRect reach(const QPointF &from, const StrokeSample &sample);
+		static qreal pressureToWidth(qreal pressure);
+
+		// Set from the GUI thread, new strokes go onto the copy taken
+		// at the start of each batch
+		QMutex surfaceMutex;
+		QSharedPointer<TiledSurface> surface;
+		QSharedPointer<TiledSurface> pressSurface;
+
+		SampleQueue<StrokeSample, 4096> queue;
+		QSemaphore available;
+		QAtomicInt stopping;
+		QAtomicInt pending;
+		quint64 queued;
+		quint64 processed;
+
+		// Woken whenever pending drops to 0 or the thread ends
+		QMutex idleMutex;
+		QWaitCondition idle;
+
+		QMutex paintedMutex;
+		QRegion paintedRegion;
+		quint64 paintedSamples;
+		QList<FinishedStroke> finishedStrokes;
+
+		// Only touched while the surfaces are locked for writing. The
+		// pool threads get the states of their own pointers alone
+		QHash<int, PointerState *> pointers;
+		QHash<TiledSurface *, int> strokesOn;
+		QAtomicInt activeStrokes;
+
+		// Round dab masks for the brushes of every pointer, so a touch
+		// that comes and goes doesn't build up a cache of its own
+		QSharedPointer<DabMaskCache> dabMasks;
+};
+
+#endif // STROKERASTERIZER_H
@@ -0,0 +1,64 @@
+#include <QThread>
+
+#include "strokerasterizer.h"
+#include "strokereplayer.h"
+#include "tiledsurface.h"
+
+StrokeReplayer::StrokeReplayer(QObject *parent)
+	: QObject(parent)
+	, next(0)
+	, inRealTime(false)
+{
+	timer.setSingleShot(true);
+	connect(&timer, &QTimer::timeout, this, &StrokeReplayer::emitDueSamples);
+}
+
+void StrokeReplayer::start(const QVector<StrokeSample> &samples, bool realTime)
+{
+	replaySamples = samples;
+	next = 0;
+	inRealTime = realTime;
+	clock.start();
+	timer.start(0);
+}
+
+void StrokeReplayer::stop()
+{
+	timer.stop();
+	replaySamples.clear();
+	next = 0;
+}
+
+void StrokeReplayer::emitDueSamples()
+{
+	qint64 elapsed = clock.elapsed();
+	while (next < replaySamples.size()) {
+		StrokeSample due = replaySamples.at(next);
+		if (inRealTime && qint64(due.timestamp) > elapsed) {
+			timer.start(int(due.timestamp - elapsed));
+			return;
+		}
+		++next;
+		emit sample(due);
+	}
+	replaySamples.clear();
+	next = 0;
+	emit finished();
+}
+
+// Samples are painted one after another no matter how they are timed,
+// so both speeds paint exactly the same pixels
+void StrokeReplayer::replay(const QVector<StrokeSample> &samples, TiledSurface &surface, bool realTime)
+{
+	StrokeRasterizer rasterizer(&surface);
+	QElapsedTimer clock;
+	clock.start();
+	for (const StrokeSample &sample : samples) {
+		if (realTime && qint64(sample.timestamp) > clock.elapsed())
+			QThread::msleep(quint64(qint64(sample.timestamp) - clock.elapsed()));
+		rasterizer.rasterize(sample);
+		// Nobody undoes a replay, let go of the tiles kept for it
+		if (sample.type == StrokeSample::Release)
+			rasterizer.takeFinishedStrokes();
+	}
+}
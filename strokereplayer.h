@@ -0,0 +1,50 @@
+#ifndef STROKEREPLAYER_H
+#define STROKEREPLAYER_H
+
+#include <QElapsedTimer>
+#include <QObject>
+#include <QTimer>
+#include <QVector>
+
+#include "strokesample.h"
+
+class TiledSurface;
+
+// Plays recorded samples back, either spaced out the way they were
+// recorded or as fast as they can be taken
+class StrokeReplayer : public QObject
+{
+		Q_OBJECT
+
+	public:
+
+		explicit StrokeReplayer(QObject *parent = nullptr);
+
+		// Emits the samples from the event loop
+		void start(const QVector<StrokeSample> &samples, bool realTime);
+		void stop();
+		bool isRunning() const { return next < replaySamples.size(); }
+
+		// Paints the samples onto the surface on the calling thread
+		// through the same brush path the rasterizer thread uses
+		static void replay(const QVector<StrokeSample> &samples, TiledSurface &surface, bool realTime);
+
+	signals:
+
+		void sample(const StrokeSample &sample);
+		void finished();
+
+	private slots:
+
+		void emitDueSamples();
+
+	private:
+
+		QVector<StrokeSample> replaySamples;
+		int next;
+		bool inRealTime;
+		QElapsedTimer clock;
+		QTimer timer;
+};
+
+#endif // STROKEREPLAYER_H
@@ -0,0 +1,54 @@
+#ifndef STROKESAMPLE_H
+#define STROKESAMPLE_H
+
+#include <QColor>
+#include <QPointF>
+#include <QTabletEvent>
+
+// One input sample, copied out of the tablet, mouse or touch event on
+// the GUI thread so it can be rasterized on another thread. Mouse
+// samples have QTabletEvent::NoDevice as their device
+struct StrokeSample
+{
+		enum Type
+		{
+			Press,
+			Move,
+			Release
+		};
+
+		Type type;
+
+		// Which of the pointers down at the same time this came from,
+		// the mouse is always 0. Each pointer strokes on its own
+		int pointer;
+
+		// QTabletEvent::timestamp() in milliseconds
+		quint64 timestamp;
+
+		QPointF pos;
+		qreal pressure;
+		qreal tangentialPressure;
+		qreal rotation;
+		qreal xTilt;
+		qreal yTilt;
+		QTabletEvent::TabletDevice device;
+		QTabletEvent::PointerType pointerType;
+
+		// Brush settings at the time of the sample, the valuators
+		// hold ScribbleArea::Valuator values
+		QColor color;
+		qint8 alphaChannelValuator;
+		qint8 colorSaturationValuator;
+		qint8 lineWidthValuator;
+
+		// Dab spacing as a fraction of the dab diameter
+		qreal spacing;
+
+		// Width of the lines mouse strokes are drawn with
+		int penWidth;
+
+		bool isMouse() const { return device == QTabletEvent::NoDevice; }
+};
+
+#endif // STROKESAMPLE_H
@@ -0,0 +1,271 @@
+#include <QFileInfo>
+#include <QObject>
+#include <QtEndian>
+
+#include <limits>
+
+#include "bandrenderer.h"
+#include "tiffbandwriter.h"
+
+namespace
+{
+
+enum Type { Short = 3, Long = 4, Long8 = 16 };
+
+enum Tag
+{
+	ImageWidth = 256,
+	ImageLength = 257,
+	BitsPerSample = 258,
+	Compression = 259,
+	Photometric = 262,
+	StripOffsets = 273,
+	SamplesPerPixel = 277,
+	RowsPerStrip = 278,
+	StripByteCounts = 279,
+	PlanarConfiguration = 284,
+	ExtraSamples = 338
+};
+
+// Adobe deflate, RGB, chunky pixels and associated alpha
+enum { Deflate = 8, RGB = 2, Chunky = 1, AssociatedAlpha = 1 };
+
+// Room left for what deflate adds to incompressible strips, the
+// directory and the values it points at
+const quint64 Overhead = 1 << 20;
+
+template <typename T>
+void append(QByteArray &data, T value)
+{
+	value = qToLittleEndian(value);
+	data.append(reinterpret_cast<const char *>(&value), sizeof(T));
+}
+
+QByteArray shorts(std::initializer_list<quint16> values)
+{
+	QByteArray data;
+	for (quint16 value : values)
+		append<quint16>(data, value);
+	return data;
+}
+
+QByteArray longs(std::initializer_list<quint32> values)
+{
+	QByteArray data;
+	for (quint32 value : values)
+		append<quint32>(data, value);
+	return data;
+}
+
+}
+
+TiffBandWriter::TiffBandWriter(const QString &fileName)
+	: file(fileName)
+	, stripRows(0)
+	, rowsWritten(0)
+	, bigTiff(false)
+{
+}
+
+bool TiffBandWriter::canWrite(const QString &fileName)
+{
+	QString suffix = QFileInfo(fileName).suffix();
+	return suffix.compare("tif", Qt::CaseInsensitive) == 0
+	       || suffix.compare("tiff", Qt::CaseInsensitive) == 0;
+}
+
+bool TiffBandWriter::save(const BandRenderer &renderer, const QString &fileName, QString *error,
+			  const std::function<void(int rows)> &progress)
+{
+	TiffBandWriter writer(fileName);
+	bool written = writer.open(renderer.outputSize(), renderer.getBandHeight())
+		       && renderer.render([&writer, &progress](const QImage &band, int top) {
+			if (!writer.write(band))
+				return false;
+			if (progress)
+				progress(top + band.height());
+			return true;
+		})
+		       && writer.close();
+	if (!written && error)
+		*error = writer.errorString().isEmpty() ? QObject::tr("Not enough memory to render the image")
+							: writer.errorString();
+	return written;
+}
+
+bool TiffBandWriter::fail(const QString &message)
+{
+	error = message;
+	file.close();
+	return false;
+}
+
+// The offset of the directory is left 0 until close()
+bool TiffBandWriter::open(const QSize &size, int rowsPerStrip)
+{
+	if (size.isEmpty() || rowsPerStrip < 1)
+		return fail(QObject::tr("Can't write an empty image"));
+	if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+		return fail(file.errorString());
+
+	imageSize = size;
+	stripRows = qMin(rowsPerStrip, size.height());
+	rowsWritten = 0;
+	stripOffsets.clear();
+	stripSizes.clear();
+	quint64 pixelBytes = quint64(size.width()) * quint64(size.height()) * 4;
+	bigTiff = pixelBytes + pixelBytes / 64 + Overhead > 0xffffffffu;
+
+	QByteArray header("II");
+	if (bigTiff) {
+		append<quint16>(header, 43);
+		append<quint16>(header, 8);
+		append<quint16>(header, 0);
+		append<quint64>(header, 0);
+	} else {
+		append<quint16>(header, 42);
+		append<quint32>(header, 0);
+	}
+	if (file.write(header) != header.size())
+		return fail(file.errorString());
+	return true;
+}
+
+// The strip is turned from ARGB words into RGBA bytes row by row and
+// compressed whole. qCompress puts the size in front of the zlib
+// stream, the strip is only the stream
+bool TiffBandWriter::write(const QImage &band)
+{
+	if (!file.isOpen())
+		return false;
+	int rows = qMin(band.height(), imageSize.height() - rowsWritten);
+	bool last = rowsWritten + rows == imageSize.height();
+	if (band.width() != imageSize.width() || rows <= 0 || (rows != stripRows && !last)
+	    || band.format() != QImage::Format_ARGB32_Premultiplied)
+		return fail(QObject::tr("Band doesn't fit the image"));
+
+	int rowBytes = imageSize.width() * 4;
+	if (qint64(rowBytes) * rows > std::numeric_limits<int>::max() / 2)
+		return fail(QObject::tr("Bands of %1 rows are too large for a strip").arg(rows));
+	QByteArray pixels(rowBytes * rows, Qt::Uninitialized);
+	uchar *out = reinterpret_cast<uchar *>(pixels.data());
+	for (int y = 0; y < rows; ++y) {
+		const QRgb *in = reinterpret_cast<const QRgb *>(band.constScanLine(y));
+		for (int x = 0; x < imageSize.width(); ++x) {
+			QRgb pixel = in[x];
+			*out++ = uchar(qRed(pixel));
+			*out++ = uchar(qGreen(pixel));
+			*out++ = uchar(qBlue(pixel));
+			*out++ = uchar(qAlpha(pixel));
+		}
+	}
+	QByteArray compressed = qCompress(pixels, 6);
+	pixels.clear();
+
+	qint64 stripSize = compressed.size() - 4;
+	stripOffsets.append(quint64(file.pos()));
+	stripSizes.append(quint64(stripSize));
+	if (file.write(compressed.constData() + 4, stripSize) != stripSize)
+		return fail(file.errorString());
+	rowsWritten += rows;
+	return true;
+}
+
+// Values that don't fit into their entry are written first and the
+// entry points at them instead. Offsets are kept even as TIFF wants
+bool TiffBandWriter::close()
+{
+	if (!file.isOpen())
+		return false;
+	if (rowsWritten != imageSize.height())
+		return fail(QObject::tr("Only %1 of %2 rows were written").arg(rowsWritten).arg(imageSize.height()));
+
+	struct Entry
+	{
+			quint16 tag;
+			quint16 type;
+			quint64 count;
+			QByteArray values;
+	};
+
+	QByteArray offsets;
+	QByteArray sizes;
+	for (int i = 0; i < stripOffsets.size(); ++i) {
+		if (bigTiff) {
+			append<quint64>(offsets, stripOffsets.at(i));
+			append<quint64>(sizes, stripSizes.at(i));
+		} else {
+			append<quint32>(offsets, quint32(stripOffsets.at(i)));
+			append<quint32>(sizes, quint32(stripSizes.at(i)));
+		}
+	}
+	quint16 offsetType = bigTiff ? Long8 : Long;
+	quint64 strips = quint64(stripOffsets.size());
+	QVector<Entry> entries = {
+		{ ImageWidth, Long, 1, longs({ quint32(imageSize.width()) }) },
+		{ ImageLength, Long, 1, longs({ quint32(imageSize.height()) }) },
+		{ BitsPerSample, Short, 4, shorts({ 8, 8, 8, 8 }) },
+		{ Compression, Short, 1, shorts({ Deflate }) },
+		{ Photometric, Short, 1, shorts({ RGB }) },
+		{ StripOffsets, offsetType, strips, offsets },
+		{ SamplesPerPixel, Short, 1, shorts({ 4 }) },
+		{ RowsPerStrip, Long, 1, longs({ quint32(stripRows) }) },
+		{ StripByteCounts, offsetType, strips, sizes },
+		{ PlanarConfiguration, Short, 1, shorts({ Chunky }) },
+		{ ExtraSamples, Short, 1, shorts({ AssociatedAlpha }) }
+	};
+
+	int inlineBytes = bigTiff ? 8 : 4;
+	auto alignFile = [this]() {
+		if (file.pos() % 2)
+			file.write("", 1);
+	};
+	for (Entry &entry : entries) {
+		if (entry.values.size() <= inlineBytes)
+			continue;
+		alignFile();
+		quint64 offset = quint64(file.pos());
+		if (file.write(entry.values) != entry.values.size())
+			return fail(file.errorString());
+		entry.values.clear();
+		if (bigTiff)
+			append<quint64>(entry.values, offset);
+		else
+			append<quint32>(entry.values, quint32(offset));
+	}
+	alignFile();
+	quint64 directory = quint64(file.pos());
+	if (!bigTiff && directory > 0xffffffffu - 1024)
+		return fail(QObject::tr("The image doesn't fit into a TIFF"));
+
+	QByteArray ifd;
+	if (bigTiff)
+		append<quint64>(ifd, quint64(entries.size()));
+	else
+		append<quint16>(ifd, quint16(entries.size()));
+	for (const Entry &entry : qAsConst(entries)) {
+		append<quint16>(ifd, entry.tag);
+		append<quint16>(ifd, entry.type);
+		if (bigTiff)
+			append<quint64>(ifd, entry.count);
+		else
+			append<quint32>(ifd, quint32(entry.count));
+		ifd.append(entry.values);
+		ifd.append(QByteArray(inlineBytes - entry.values.size(), '\0'));
+	}
+	if (bigTiff)
+		append<quint64>(ifd, 0);
+	else
+		append<quint32>(ifd, 0);
+
+	QByteArray pointer;
+	if (bigTiff)
+		append<quint64>(pointer, directory);
+	else
+		append<quint32>(pointer, quint32(directory));
+	if (file.write(ifd) != ifd.size() || !file.seek(bigTiff ? 8 : 4)
+	    || file.write(pointer) != pointer.size())
+		return fail(file.errorString());
+	file.close();
+	return file.error() == QFileDevice::NoError || fail(file.errorString());
+}
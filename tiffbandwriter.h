@@ -0,0 +1,69 @@
+#ifndef TIFFBANDWRITER_H
+#define TIFFBANDWRITER_H
+
+#include <QFile>
+#include <QImage>
+#include <QSize>
+#include <QString>
+#include <QVector>
+
+#include <functional>
+
+class BandRenderer;
+
+// Writes an RGBA TIFF a band of rows at a time, for images too large
+// to be held in memory as a whole. Every band becomes a strip of its
+// own, deflate compressed as soon as it comes in:
+//
+//   header   byte order, version and the offset of the directory
+//   strips   the bands from the top down, 8 bits per channel with
+//            premultiplied alpha
+//   values   strip offsets and sizes and the other tag values too
+//            large for the directory
+//   IFD      a single image file directory
+//
+// The directory is only known once every strip is written, so it goes
+// at the end and the header is pointed at it. Images that may take
+// more than 4 GiB are written as BigTIFF
+class TiffBandWriter
+{
+	public:
+
+		explicit TiffBandWriter(const QString &fileName);
+
+		// Whether the name asks for a TIFF
+		static bool canWrite(const QString &fileName);
+
+		// Writes every band of renderer to the file as it comes, only
+		// the bands in flight are ever in memory. progress is told
+		// how many rows are written after every band
+		static bool save(const BandRenderer &renderer, const QString &fileName, QString *error,
+				 const std::function<void(int rows)> &progress = nullptr);
+
+		// Starts the file for an image of size, every band but the
+		// last one has rowsPerStrip rows
+		bool open(const QSize &size, int rowsPerStrip);
+
+		// Premultiplied ARGB32 rows, the next ones from the top
+		bool write(const QImage &band);
+
+		// Writes the directory once every row is in
+		bool close();
+
+		QString errorString() const { return error; }
+
+	private:
+
+		bool fail(const QString &message);
+
+		QFile file;
+		QSize imageSize;
+		int stripRows;
+		int rowsWritten;
+		bool bigTiff;
+		QVector<quint64> stripOffsets;
+		QVector<quint64> stripSizes;
+		QString error;
+};
+
+#endif // TIFFBANDWRITER_H
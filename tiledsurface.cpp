@@ -0,0 +1,262 @@
+#include "tiledsurface.h"
+
+TiledSurface::TiledSurface()
+	: tileColumns(0)
+	, tileRows(0)
+	, fillColor(Qt::white)
+	, recording(false)
+{
+}
+
+TiledSurface::TiledSurface(const TiledSurface &other)
+	: surfaceSize(other.surfaceSize)
+	, tileColumns(other.tileColumns)
+	, tileRows(other.tileRows)
+	, tiles(other.tiles)
+	, dirty(other.dirty)
+	, backgroundImage(other.backgroundImage)
+	, fillColor(other.fillColor)
+	, recording(false)
+	, source(other.source)
+{
+	QMutexLocker locker(&other.sourceMutex);
+	loadedTiles = other.loadedTiles;
+}
+
+QRect TiledSurface::tileRect(int column, int row) const
+{
+	return QRect(column * TileSize, row * TileSize, TileSize, TileSize);
+}
+
+// Grow or shrink the tile grid, keeping the tiles we already have
+void TiledSurface::resize(const QSize &newSize)
+{
+	if (newSize == surfaceSize)
+		return;
+
+	int newColumns = (newSize.width() + TileSize - 1) / TileSize;
+	int newRows = (newSize.height() + TileSize - 1) / TileSize;
+
+	if (newColumns != tileColumns || newRows != tileRows) {
+		QVector<QImage> newTiles(newColumns * newRows);
+		QVector<bool> newDirty(newColumns * newRows, false);
+		int keptColumns = qMin(tileColumns, newColumns);
+		int keptRows = qMin(tileRows, newRows);
+		for (int row = 0; row < keptRows; ++row) {
+			for (int column = 0; column < keptColumns; ++column) {
+				newTiles[row * newColumns + column] = tiles[index(column, row)];
+				newDirty[row * newColumns + column] = dirty[index(column, row)];
+			}
+		}
+		tiles.swap(newTiles);
+		dirty.swap(newDirty);
+		tileColumns = newColumns;
+		tileRows = newRows;
+	}
+	surfaceSize = newSize;
+}
+
+// Only the tile handles are released, no pixels are touched
+void TiledSurface::clear()
+{
+	tiles.fill(QImage());
+	dirty.fill(true);
+	source.reset();
+	loadedTiles.clear();
+}
+
+void TiledSurface::setBackground(const QImage &image)
+{
+	backgroundImage = image.convertToFormat(QImage::Format_ARGB32_Premultiplied);
+}
+
+bool TiledSurface::isAllocated(int column, int row) const
+{
+	return !tiles.at(index(column, row)).isNull();
+}
+
+QImage &TiledSurface::tile(int column, int row)
+{
+	QImage &image = tiles[index(column, row)];
+	if (recording) {
+		QMutexLocker locker(&recordMutex);
+		if (!recordedTiles.contains(tileKey(column, row)))
+			recordedTiles.insert(tileKey(column, row), image);
+	}
+	if (image.isNull() && source)
+		image = sourceTile(column, row, true);
+	if (image.isNull()) {
+		image = QImage(TileSize, TileSize, QImage::Format_ARGB32_Premultiplied);
+		image.fill(Qt::transparent);
+		QPainter painter(&image);
+		painter.translate(-column * TileSize, -row * TileSize);
+		renderBackground(painter, tileRect(column, row));
+	}
+	dirty[index(column, row)] = true;
+	return image;
+}
+
+void TiledSurface::render(QPainter &painter, const QRect &rect) const
+{
+	QRect range = tilesIn(rect);
+	for (int row = range.top(); row <= range.bottom(); ++row) {
+		for (int column = range.left(); column <= range.right(); ++column) {
+			QRect area = tileRect(column, row) & rect;
+			QImage image = tiles.at(index(column, row));
+			if (image.isNull() && source)
+				image = sourceTile(column, row, false);
+			if (image.isNull())
+				renderBackground(painter, area);
+			else
+				painter.drawImage(area.topLeft(), image,
+							area.translated(-column * TileSize, -row * TileSize));
+		}
+	}
+}
+
+// Tiles are blended where they are, only the background of tiles that
+// were never painted on is drawn into a scratch image first
+void TiledSurface::blend(QImage &target, const QPoint &offset, const QRect &rect,
+			 BlendKernels::Mode mode, quint32 opacity) const
+{
+	bool hasBackground = !backgroundImage.isNull() || fillColor.alpha() != 0;
+	QRect range = tilesIn(rect);
+	for (int row = range.top(); row <= range.bottom(); ++row) {
+		for (int column = range.left(); column <= range.right(); ++column) {
+			QRect area = tileRect(column, row) & rect;
+			QImage image = tiles.at(index(column, row));
+			if (image.isNull() && source)
+				image = sourceTile(column, row, false);
+			if (!image.isNull()) {
+				QPoint inTile = area.topLeft() - QPoint(column * TileSize, row * TileSize);
+				const QImage part(image.constScanLine(inTile.y()) + inTile.x() * 4, area.width(),
+						  area.height(), image.bytesPerLine(), image.format());
+				BlendKernels::blendImage(target, area.topLeft() + offset, part, mode, opacity);
+			} else if (hasBackground) {
+				QImage scratch(area.size(), QImage::Format_ARGB32_Premultiplied);
+				scratch.fill(Qt::transparent);
+				QPainter painter(&scratch);
+				painter.translate(-area.topLeft());
+				renderBackground(painter, area);
+				painter.end();
+				BlendKernels::blendImage(target, area.topLeft() + offset, scratch, mode, opacity);
+			}
+		}
+	}
+}
+
+QImage TiledSurface::toImage() const
+{
+	QImage image(surfaceSize, QImage::Format_ARGB32_Premultiplied);
+	QPainter painter(&image);
+	painter.setCompositionMode(QPainter::CompositionMode_Source);
+	render(painter, image.rect());
+	painter.end();
+	return image;
+}
+
+// Tiles that are only drawn stay in the cache, a tile taken for
+// painting moves out of it into the tile grid. Tiles are decompressed
+// outside the lock, two threads after the same tile may both load it
+// and the first one to finish goes into the cache
+QImage TiledSurface::sourceTile(int column, int row, bool take) const
+{
+	if (!source->hasTile(column, row))
+		return QImage();
+
+	quint32 key = tileKey(column, row);
+	{
+		QMutexLocker locker(&sourceMutex);
+		QImage image = take ? loadedTiles.take(key) : loadedTiles.value(key);
+		if (!image.isNull())
+			return image;
+	}
+
+	QImage image = source->loadTile(column, row);
+	if (!take) {
+		QMutexLocker locker(&sourceMutex);
+		QImage &cached = loadedTiles[key];
+		if (cached.isNull())
+			cached = image;
+		else
+			image = cached;
+	}
+	return image;
+}
+
+void TiledSurface::beginRecording()
+{
+	recordedTiles.clear();
+	recording = true;
+}
+
+TiledSurface::TileSet TiledSurface::endRecording()
+{
+	recording = false;
+	TileSet recorded;
+	recorded.swap(recordedTiles);
+	return recorded;
+}
+
+// Tiles outside the grid are left in the set untouched
+QRegion TiledSurface::swapTiles(TileSet &tileSet)
+{
+	QRegion changed;
+	for (TileSet::iterator it = tileSet.begin(); it != tileSet.end(); ++it) {
+		int column = it.key() & 0xffff;
+		int row = it.key() >> 16;
+		if (column >= tileColumns || row >= tileRows)
+			continue;
+		tiles[index(column, row)].swap(it.value());
+		dirty[index(column, row)] = true;
+		changed += tileRect(column, row);
+	}
+	return changed & QRect(QPoint(0, 0), surfaceSize);
+}
+
+bool TiledSurface::isDirty(int column, int row) const
+{
+	return dirty.at(index(column, row));
+}
+
+QRegion TiledSurface::dirtyRegion() const
+{
+	QRegion region;
+	for (int row = 0; row < tileRows; ++row) {
+		for (int column = 0; column < tileColumns; ++column) {
+			if (dirty.at(index(column, row)))
+				region += tileRect(column, row);
+		}
+	}
+	return region & QRect(QPoint(0, 0), surfaceSize);
+}
+
+void TiledSurface::clearDirty()
+{
+	dirty.fill(false);
+}
+
+QRect TiledSurface::tilesIn(const QRect &rect) const
+{
+	QRect area = rect & QRect(QPoint(0, 0), surfaceSize);
+	if (area.isEmpty())
+		return QRect();
+	return QRect(QPoint(area.left() / TileSize, area.top() / TileSize),
+			 QPoint(area.right() / TileSize, area.bottom() / TileSize));
+}
+
+// Anything not covered by the background image gets the background
+// color. Blending a transparent one changes nothing so it is skipped
+void TiledSurface::renderBackground(QPainter &painter, const QRect &rect) const
+{
+	QRect covered = rect & backgroundImage.rect();
+	if (!covered.isEmpty())
+		painter.drawImage(covered.topLeft(), backgroundImage, covered);
+	if (fillColor.alpha() == 0 && painter.compositionMode() != QPainter::CompositionMode_Source)
+		return;
+	if (covered != rect) {
+		QRegion uncovered = QRegion(rect) - covered;
+		for (const QRect &part : uncovered)
+			painter.fillRect(part, fillColor);
+	}
+}
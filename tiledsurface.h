@@ -0,0 +1,171 @@
+#ifndef TILEDSURFACE_H
+#define TILEDSURFACE_H
+
+#include <QColor>
+#include <QHash>
+#include <QImage>
+#include <QMutex>
+#include <QPainter>
+#include <QReadWriteLock>
+#include <QRect>
+#include <QRegion>
+#include <QSharedPointer>
+#include <QSize>
+#include <QVector>
+
+#include "blendkernels.h"
+// Supplies the pixels of tiles that were never allocated, such as
+// the tiles of a project file nobody has looked at yet. Tiles are
+// loaded from whichever thread reads the surface
+class TileSource
+{
+	public:
+
+		virtual ~TileSource() {}
+
+		virtual bool hasTile(int column, int row) const = 0;
+		virtual QImage loadTile(int column, int row) const = 0;
+};
+
+// A paint surface split into fixed size tiles.
+// Tiles are only allocated once something is painted on them,
+// untouched tiles show the background image instead
+class TiledSurface
+{
+	public:
+
+		enum { TileSize = 256 };
+
+		// Tiles keyed by tileKey, a null image stands for a tile
+		// that was never allocated
+		typedef QHash<quint32, QImage> TileSet;
+		static quint32 tileKey(int column, int row) { return quint32(row) << 16 | quint32(column); }
+
+		TiledSurface();
+
+		// Shares the tiles with other, pixels are only copied once
+		// either side paints on a tile. The caller holds other's lock
+		TiledSurface(const TiledSurface &other);
+
+		QSize size() const { return surfaceSize; }
+		int width() const { return surfaceSize.width(); }
+		int height() const { return surfaceSize.height(); }
+		bool isNull() const { return surfaceSize.isEmpty(); }
+
+		int columns() const { return tileColumns; }
+		int rows() const { return tileRows; }
+		QRect tileRect(int column, int row) const;
+
+		// Range of tile columns and rows touched by rect
+		QRect tilesIn(const QRect &rect) const;
+
+		// Changes the size of the surface, tiles which are
+		// still inside the new size are kept
+		void resize(const QSize &newSize);
+
+		// Drops every tile so the surface shows the background again
+		void clear();
+
+		// What untouched tiles show, the area outside of it is filled
+		// with the background color, white unless changed
+		void setBackground(const QImage &image);
+		const QImage &background() const { return backgroundImage; }
+		void setBackgroundColor(const QColor &color) { fillColor = color; }
+		QColor backgroundColor() const { return fillColor; }
+
+		// Unallocated tiles the source has are loaded from it the
+		// first time they are drawn or painted on
+		void setSource(const QSharedPointer<const TileSource> &newSource) { source = newSource; }
+		QSharedPointer<const TileSource> tileSource() const { return source; }
+
+		bool isAllocated(int column, int row) const;
+
+		// The tile as it is in memory, null if it was never allocated
+		QImage tileImage(int column, int row) const { return tiles.at(index(column, row)); }
+
+		// Returns the tile for writing, allocating it from the
+		// background if needed and marking it dirty
+		QImage &tile(int column, int row);
+
+		// Stops sharing the tile grid with any copy. After that tiles
+		// that don't overlap may be written from several threads at
+		// once, while the caller holds the lock for writing
+		void detach() { tiles.detach(); dirty.detach(); }
+
+		// Runs the painting function once for every tile touching rect,
+		// the painter is translated so it uses surface coordinates
+		template <typename PaintFunction>
+		void paint(const QRect &rect, PaintFunction paintFunction);
+
+		// Draws the part of the surface inside rect onto painter
+		void render(QPainter &painter, const QRect &rect) const;
+
+		// The same without a painter, the part inside rect is blended
+		// onto target moved by offset. Target has to be premultiplied
+		// ARGB32 or RGB32
+		void blend(QImage &target, const QPoint &offset, const QRect &rect,
+			   BlendKernels::Mode mode, quint32 opacity) const;
+
+		// Flattened copy of the whole surface
+		QImage toImage() const;
+
+		// While recording, the first write to a tile keeps a shallow
+		// copy of it. QImage shares the pixels until the tile is painted
+		// on, so only the tiles a stroke touches are ever duplicated
+		void beginRecording();
+		TileSet endRecording();
+		bool isRecording() const { return recording; }
+
+		// Puts the given tiles in place and hands back the ones they
+		// replaced, returns the area that changed
+		QRegion swapTiles(TileSet &tileSet);
+
+		// Per tile dirty flags, set whenever a tile is painted on
+		bool isDirty(int column, int row) const;
+		QRegion dirtyRegion() const;
+		void clearDirty();
+
+		// Painting threads take it for writing, anything
+		// reading the tiles from another thread for reading
+		QReadWriteLock &lock() const { return surfaceLock; }
+
+	private:
+
+		int index(int column, int row) const { return row * tileColumns + column; }
+		void renderBackground(QPainter &painter, const QRect &rect) const;
+		QImage sourceTile(int column, int row, bool take) const;
+
+		QSize surfaceSize;
+		int tileColumns;
+		int tileRows;
+		QVector<QImage> tiles;
+		QVector<bool> dirty;
+		QImage backgroundImage;
+		QColor fillColor;
+		bool recording;
+		TileSet recordedTiles;
+		QMutex recordMutex;
+
+		// Tiles loaded from the source for drawing only, several
+		// readers can be loading at the same time
+		QSharedPointer<const TileSource> source;
+		mutable QMutex sourceMutex;
+		mutable TileSet loadedTiles;
+		mutable QReadWriteLock surfaceLock;
+};
+
+template <typename PaintFunction>
+void TiledSurface::paint(const QRect &rect, PaintFunction paintFunction)
+{
+	QRect range = tilesIn(rect);
+	for (int row = range.top(); row <= range.bottom(); ++row) {
+		for (int column = range.left(); column <= range.right(); ++column) {
+			QImage &image = tile(column, row);
+			QPainter painter(&image);
+			painter.translate(-column * TileSize, -row * TileSize);
+			paintFunction(painter);
+		}
+	}
+}
+
+#endif // TILEDSURFACE_H
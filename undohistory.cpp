@@ -0,0 +1,151 @@
+#include "undohistory.h"
+
+#include <QWriteLocker>
+
+#include <cstring>
+
+UndoHistory::UndoHistory(qint64 maxBytes)
+	: budget(maxBytes)
+	, used(0)
+{
+}
+
+void UndoHistory::setMaxBytes(qint64 maxBytes)
+{
+	budget = maxBytes;
+	trim();
+}
+
+void UndoHistory::push(const QSharedPointer<TiledSurface> &surface, const TiledSurface::TileSet &tiles)
+{
+	if (tiles.isEmpty())
+		return;
+
+	for (const Step &step : redoSteps)
+		used -= step.bytes;
+	redoSteps.clear();
+
+	Step step;
+	step.surface = surface;
+	step.tiles = tiles;
+	step.packed = false;
+	step.bytes = cost(step);
+	used += step.bytes;
+	undoSteps.append(step);
+	trim();
+}
+
+QRegion UndoHistory::undo()
+{
+	return swap(undoSteps, redoSteps);
+}
+
+QRegion UndoHistory::redo()
+{
+	return swap(redoSteps, undoSteps);
+}
+
+void UndoHistory::clear()
+{
+	undoSteps.clear();
+	redoSteps.clear();
+	used = 0;
+}
+
+void UndoHistory::removeSurface(const QSharedPointer<TiledSurface> &surface)
+{
+	for (QList<Step> *steps : { &undoSteps, &redoSteps }) {
+		for (int i = steps->size() - 1; i >= 0; --i) {
+			if (steps->at(i).surface != surface)
+				continue;
+			used -= steps->at(i).bytes;
+			steps->removeAt(i);
+		}
+	}
+}
+
+// The step trades its tiles with the surface, so afterwards it
+// holds what is needed to go the other way
+QRegion UndoHistory::swap(QList<Step> &from, QList<Step> &to)
+{
+	if (from.isEmpty())
+		return QRegion();
+
+	Step step = from.takeLast();
+	used -= step.bytes;
+	unpack(step);
+	QRegion changed;
+	{
+		QWriteLocker locker(&step.surface->lock());
+		changed = step.surface->swapTiles(step.tiles);
+	}
+	step.bytes = cost(step);
+	used += step.bytes;
+	to.append(step);
+	trim();
+	return changed;
+}
+
+qint64 UndoHistory::cost(const Step &step)
+{
+	qint64 bytes = 0;
+	if (step.packed) {
+		for (const QByteArray &data : step.packedTiles)
+			bytes += data.size();
+	} else {
+		for (const QImage &image : step.tiles)
+			bytes += image.sizeInBytes();
+	}
+	return bytes;
+}
+
+void UndoHistory::pack(Step &step)
+{
+	if (step.packed)
+		return;
+	for (TiledSurface::TileSet::const_iterator it = step.tiles.constBegin(); it != step.tiles.constEnd(); ++it) {
+		const QImage &image = it.value();
+		step.packedTiles.insert(it.key(), image.isNull() ? QByteArray()
+						: qCompress(image.constBits(), int(image.sizeInBytes()), 1));
+	}
+	step.tiles.clear();
+	step.packed = true;
+}
+
+void UndoHistory::unpack(Step &step)
+{
+	if (!step.packed)
+		return;
+	for (QHash<quint32, QByteArray>::const_iterator it = step.packedTiles.constBegin();
+	     it != step.packedTiles.constEnd(); ++it) {
+		QImage image;
+		if (!it.value().isEmpty()) {
+			QByteArray data = qUncompress(it.value());
+			image = QImage(TiledSurface::TileSize, TiledSurface::TileSize, QImage::Format_ARGB32_Premultiplied);
+			memcpy(image.bits(), data.constData(), size_t(qMin(qint64(data.size()), qint64(image.sizeInBytes()))));
+		}
+		step.tiles.insert(it.key(), image);
+	}
+	step.packedTiles.clear();
+	step.packed = false;
+}
+
+// Compress from the oldest step on, then drop the oldest undo steps
+// and the redo steps furthest away. The newest undo step always stays
+void UndoHistory::trim()
+{
+	for (int i = 0; used > budget && i < undoSteps.size() - UnpackedSteps; ++i) {
+		Step &step = undoSteps[i];
+		if (step.packed)
+			continue;
+		used -= step.bytes;
+		pack(step);
+		step.bytes = cost(step);
+		used += step.bytes;
+	}
+
+	while (used > budget && undoSteps.size() > 1)
+		used -= undoSteps.takeFirst().bytes;
+	while (used > budget && !redoSteps.isEmpty())
+		used -= redoSteps.takeFirst().bytes;
+}
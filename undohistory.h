@@ -0,0 +1,74 @@
+#ifndef UNDOHISTORY_H
+#define UNDOHISTORY_H
+
+#include <QByteArray>
+#include <QHash>
+#include <QList>
+#include <QRegion>
+#include <QSharedPointer>
+
+#include "tiledsurface.h"
+
+// Stroke by stroke undo and redo that only keeps the tiles each
+// stroke touched, along with the layer surface it was made on. Once
+// the history is over budget the oldest steps are compressed first
+// and dropped after that
+class UndoHistory
+{
+	public:
+
+		explicit UndoHistory(qint64 maxBytes = 256 * 1024 * 1024);
+
+		void setMaxBytes(qint64 maxBytes);
+		qint64 maxBytes() const { return budget; }
+		qint64 usedBytes() const { return used; }
+
+		// Takes the tiles of surface as they were before the stroke,
+		// throws away everything that could have been redone
+		void push(const QSharedPointer<TiledSurface> &surface, const TiledSurface::TileSet &tiles);
+
+		bool canUndo() const { return !undoSteps.isEmpty(); }
+		bool canRedo() const { return !redoSteps.isEmpty(); }
+
+		// Both lock the surface of the step for writing and return
+		// the area of it that changed
+		QRegion undo();
+		QRegion redo();
+
+		void clear();
+
+		// Forgets every step made on surface, for layers that are gone
+		void removeSurface(const QSharedPointer<TiledSurface> &surface);
+
+	private:
+
+		struct Step
+		{
+				QSharedPointer<TiledSurface> surface;
+				TiledSurface::TileSet tiles;
+
+				// Compressed tile pixels, an empty array for tiles
+				// that were not allocated
+				QHash<quint32, QByteArray> packedTiles;
+				bool packed;
+				qint64 bytes;
+		};
+
+		// The most recent steps are never compressed so undoing
+		// them stays instant
+		enum { UnpackedSteps = 8 };
+
+		static qint64 cost(const Step &step);
+		static void pack(Step &step);
+		static void unpack(Step &step);
+		QRegion swap(QList<Step> &from, QList<Step> &to);
+		void trim();
+
+		// Oldest first
+		QList<Step> undoSteps;
+		QList<Step> redoSteps;
+		qint64 budget;
+		qint64 used;
+};
+
+#endif // UNDOHISTORY_H